@@ -5,14 +5,20 @@
  *         Nico Raffo <nicoraffo@gmail.com> (modified)
  */
 
+#if defined __linux__
+# define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <signal.h>
 #include <unistd.h>
 #include <stddef.h>
 #include <dlfcn.h>
+#include <time.h>
 
 #if !defined __APPLE__
 # include <sys/types.h>
@@ -55,12 +61,58 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
+/* for epoll */
+#if defined __linux__
+# include <sys/epoll.h>
+#endif
+
+/* for pidfd_open() */
+#if defined __linux__
+# include <sys/syscall.h>
+# if defined SYS_pidfd_open
+#  define VP_PIDFD
+# endif
+#endif
+
+/* for mmap() of a spilled capture */
+#include <sys/mman.h>
+
+/* for vp_file_read_until() */
+#include <regex.h>
+
 /* for socket */
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
 
+/*
+ * for posix_spawn().  Children are started without fork() when it is
+ * available, which does not copy the page tables of a large Vim.
+ * Compile with -DVP_USE_FORK to use fork() anyway.
+ */
+#if defined _POSIX_SPAWN && _POSIX_SPAWN > 0 && !defined VP_USE_FORK
+# include <spawn.h>
+# define VP_SPAWN
+extern char **environ;
+#endif
+
+/* for the drain thread.  Compile with -DVP_NO_DRAIN to leave it out. */
+#if !defined VP_NO_DRAIN
+# include <pthread.h>
+# define VP_DRAIN
+#endif
+
+/* per call statistics.  Compile with -DVP_NO_STATS to leave them out. */
+#if !defined VP_NO_STATS && defined __GNUC__
+# define VP_STATS
+#endif
+
+/* a pty needs a new session with the slave as the controlling terminal. */
+#if defined VP_SPAWN && defined __linux__ && defined POSIX_SPAWN_SETSID
+# define VP_SPAWN_PTY
+#endif
+
 #include "vimstack.c"
 
 const int debug = 0;
@@ -68,624 +120,5488 @@ const int debug = 0;
 /* API */
 const char *vp_dlopen(char *args);      /* [handle] (path) */
 const char *vp_dlclose(char *args);     /* [] (handle) */
+const char *vp_set_encoding(char *args);/* [encoding] (encoding) */
+const char *vp_set_result_cap(char *args);  /* [] (cap) */
 
 const char *vp_file_open(char *args);   /* [fd] (path, flags, mode) */
 const char *vp_file_close(char *args);  /* [] (fd) */
 const char *vp_file_read(char *args);   /* [hd, eof] (fd, nr, timeout) */
 const char *vp_file_write(char *args);  /* [nleft] (fd, hd, timeout) */
+const char *vp_file_write_async(char *args);/* [nqueued] (fd, hd) */
+const char *vp_file_flush(char *args);  /* [nqueued] (fd, timeout) */
+const char *vp_file_read_records(char *args);
+                                        /* [[hd] * nrec, eof]
+                                           (fd, framing, nr, timeout) */
+const char *vp_file_read_ansi(char *args);
+                                        /* [hd, eof, [kind, off, a, b, c]
+                                            * nop] (fd, nr, timeout) */
+const char *vp_file_read_until(char *args);
+                                        /* [hd, found, eof]
+                                           (fd, kind, pattern, timeout) */
+const char *vp_file_redirect(char *args);
+                                        /* [nbytes, eof]
+                                           (fd, fd_to, nr, timeout) */
 
-const char *vp_pipe_open(char *args);   /* [pid, [fd] * npipe]
+const char *vp_pipe_open(char *args);   /* [pid, [fd] * npipe, jobid]
                                            (npipe, argc, [argv]) */
+const char *vp_pipeline_open(char *args);
+                                        /* [[pid] * nstage, fd_stdin, fd_stdout,
+                                            [fd_stderr] * nstage, jobid]
+                                           (npipe, nstage,
+                                            [argc, [argv] * argc] * nstage) */
 const char *vp_pipe_close(char *args);  /* [] (fd) */
 const char *vp_pipe_read(char *args);   /* [hd, eof] (fd, nr, timeout) */
 const char *vp_pipe_write(char *args);  /* [nleft] (fd, hd, timeout) */
+const char *vp_pipe_write_async(char *args);/* [nqueued] (fd, hd) */
+const char *vp_pipe_flush(char *args);  /* [nqueued] (fd, timeout) */
+const char *vp_pipe_read_ansi(char *args);
+                                        /* [hd, eof, [kind, off, a, b, c]
+                                            * nop] (fd, nr, timeout) */
+const char *vp_pipe_read_until(char *args);
+                                        /* [hd, found, eof]
+                                           (fd, kind, pattern, timeout) */
+const char *vp_pipe_read_records(char *args);
+                                        /* [[hd] * nrec, eof]
+                                           (fd, framing, nr, timeout) */
+const char *vp_pipe_redirect(char *args);
+                                        /* [nbytes, eof]
+                                           (fd, fd_to, nr, timeout) */
+const char *vp_system(char *args);      /* [hd_out, hd_err, cond, status]
+                                           (hd_in, timeout, argc, [argv]) */
+const char *vp_filter(char *args);      /* [hd_out, hd_err, cond, status]
+                                           (path_in, path_out, timeout, argc,
+                                            [argv]) */
 
-const char *vp_pty_open(char *args);    /* [pid, fd, ttyname]
-                                           (width, height, argc, [argv]) */
+const char *vp_pty_open(char *args);    /* [pid, fd, ttyname, jobid]
+                                           (width, height, mode, argc,
+                                            [argv]) */
 const char *vp_pty_close(char *args);   /* [] (fd) */
 const char *vp_pty_read(char *args);    /* [hd, eof] (fd, nr, timeout) */
 const char *vp_pty_write(char *args);   /* [nleft] (fd, hd, timeout) */
+const char *vp_pty_write_async(char *args); /* [nqueued] (fd, hd) */
+const char *vp_pty_flush(char *args);   /* [nqueued] (fd, timeout) */
+const char *vp_pty_read_ansi(char *args);
+                                        /* [hd, eof, [kind, off, a, b, c]
+                                            * nop] (fd, nr, timeout) */
+const char *vp_pty_read_until(char *args);
+                                        /* [hd, found, eof]
+                                           (fd, kind, pattern, timeout) */
+const char *vp_pty_read_records(char *args);
+                                        /* [[hd] * nrec, eof]
+                                           (fd, framing, nr, timeout) */
 const char *vp_pty_get_winsize(char *args); /* [width, height] (fd) */
 const char *vp_pty_set_winsize(char *args); /* [] (fd, width, height) */
+const char *vp_pty_set_mode(char *args);    /* [] (fd, mode) */
 
 const char *vp_kill(char *args);        /* [] (pid, sig) */
 const char *vp_waitpid(char *args);     /* [cond, status] (pid) */
+const char *vp_reap_all(char *args);    /* [[pid, cond, status] * n] () */
+
+const char *vp_job_status_all(char *args);
+                                        /* [[jobid, pid, cond, status, msec,
+                                             nbuf] * njob] () */
 
 const char *vp_socket_open(char *args); /* [socket] (host, port) */
 const char *vp_socket_close(char *args);/* [] (socket) */
 const char *vp_socket_read(char *args); /* [hd, eof] (socket, nr, timeout) */
 const char *vp_socket_write(char *args);/* [nleft] (socket, hd, timeout) */
+const char *vp_socket_write_async(char *args);
+                                        /* [nqueued] (socket, hd) */
+const char *vp_socket_flush(char *args);/* [nqueued] (socket, timeout) */
+const char *vp_socket_read_ansi(char *args);
+                                        /* [hd, eof, [kind, off, a, b, c]
+                                            * nop] (socket, nr, timeout) */
+const char *vp_socket_read_until(char *args);
+                                        /* [hd, found, eof]
+                                           (socket, kind, pattern, timeout) */
+const char *vp_socket_read_records(char *args);
+                                        /* [[hd] * nrec, eof]
+                                           (socket, framing, nr, timeout) */
+
+const char *vp_poll_read(char *args);   /* [[fd, hd, eof] * nfd]
+                                           (nr, timeout, nfd, [fd] * nfd) */
+
+const char *vp_fd_buffers(char *args);  /* [[fd, len, size] * nfd] () */
+
+const char *vp_capture_set(char *args); /* [] (fd, mode, limit) */
+const char *vp_capture_read(char *args);/* [hd, eof, total, dropped]
+                                           (fd, nlines) */
+
+const char *vp_epoll_add(char *args);   /* [] (fd) */
+const char *vp_epoll_del(char *args);   /* [] (fd) */
+const char *vp_epoll_wait(char *args);  /* [[fd, hd, eof] * nready]
+                                           (nr, timeout) */
+
+const char *vp_drain_start(char *args); /* [] (ringsize) */
+const char *vp_drain_stop(char *args);  /* [] () */
+const char *vp_drain_register(char *args);  /* [] (fd) */
+const char *vp_drain_unregister(char *args);/* [] (fd) */
+
+const char *vp_batch(char *args);       /* [[error, nval, [val] * nval] * nop]
+                                           (nop, [name, argc, [arg] * argc]
+                                            * nop) */
+
+const char *vp_stats(char *args);       /* [result_size, result_max,
+                                            [name, calls, errors, bytes_in,
+                                             bytes_out, usec, usec_max,
+                                             usec_poll, nsyscall, arg_max,
+                                             histogram] * napi]
+                                           (reset) */
+const char *vp_trace_start(char *args); /* [] (nevent) */
+const char *vp_trace_stop(char *args);  /* [] () */
+const char *vp_trace_dump(char *args);  /* [nevent] (path) */
+const char *vp_trace_slow(char *args);  /* [] (msec, path) */
 /* --- */
 
+/* APIs which are counted by statistics */
+#define VP_API_LIST \
+    X(vp_dlopen) X(vp_dlclose) X(vp_set_encoding) X(vp_set_result_cap) \
+    X(vp_file_open) X(vp_file_close) X(vp_file_read) X(vp_file_write) \
+    X(vp_file_read_records) X(vp_file_read_ansi) X(vp_file_read_until) \
+    X(vp_file_redirect) X(vp_file_write_async) X(vp_file_flush) \
+    X(vp_pipe_open) X(vp_pipeline_open) X(vp_pipe_close) X(vp_pipe_read) \
+    X(vp_pipe_write) X(vp_pipe_read_records) X(vp_pipe_read_ansi) \
+    X(vp_pipe_read_until) X(vp_pipe_redirect) X(vp_pipe_write_async) \
+    X(vp_pipe_flush) \
+    X(vp_system) X(vp_filter) \
+    X(vp_pty_open) X(vp_pty_close) X(vp_pty_read) X(vp_pty_write) \
+    X(vp_pty_read_records) X(vp_pty_read_ansi) X(vp_pty_get_winsize) \
+    X(vp_pty_set_winsize) X(vp_pty_set_mode) X(vp_pty_read_until) \
+    X(vp_pty_write_async) X(vp_pty_flush) \
+    X(vp_kill) X(vp_waitpid) X(vp_reap_all) X(vp_job_status_all) \
+    X(vp_socket_open) X(vp_socket_close) X(vp_socket_read) \
+    X(vp_socket_write) X(vp_socket_read_records) X(vp_socket_read_ansi) \
+    X(vp_socket_read_until) X(vp_socket_write_async) X(vp_socket_flush) \
+    X(vp_poll_read) X(vp_fd_buffers) X(vp_capture_set) X(vp_capture_read) \
+    X(vp_epoll_add) X(vp_epoll_del) X(vp_epoll_wait) \
+    X(vp_drain_start) X(vp_drain_stop) X(vp_drain_register) \
+    X(vp_drain_unregister) X(vp_batch)
+
 #define VP_ARGC_MAX 1024
-#define VP_READ_BUFSIZE 2048
+#define VP_POLL_MAX 256
+#define VP_PIPELINE_MAX 64
+#define VP_KILL_GRACE 1000              /* msec from SIGTERM to SIGKILL */
+#define VP_CLOSE_FLUSH 1000             /* msec to write the queue at close */
+#define VP_READ_BUFSIZE 65536          /* minimum size of a read() */
+#define VP_READ_MAX (16 * 1024 * 1024)  /* maximum size of a read() */
+#define VP_RESULT_CAP (8 * 1024 * 1024) /* default bytes read by a call */
+#define VP_SPLICE_SIZE (1024 * 1024)   /* bytes moved by one splice() */
 
 static vp_stack_t _result = VP_STACK_NULL;
+static vp_stack_t _batch = VP_STACK_NULL;   /* results of vp_batch() */
 
-const char *
-vp_dlopen(char *args)
+/*
+ * Bytes of data returned by one read call, whatever nr is, so that the
+ * result buffer stays small however much a process prints.  The rest is
+ * kept in the fd state and returned by the next read without waiting.
+ * 0 is no limit.
+ */
+static size_t _result_cap = VP_RESULT_CAP;
+
+/*
+ * Statistics.  Each API opens a scope by VP_STATS_SCOPE() at its top, and
+ * the cleanup of the scope adds the call to the counters of the API, so
+ * every return path is counted.  Time spent in poll() and the number of
+ * syscalls are counted by the vp_sys_*() wrappers, and a scope takes the
+ * difference.  A nested API call is also counted by itself.  Only Vim's
+ * thread updates them; the drain thread calls the syscalls directly.
+ */
+#ifdef VP_STATS
+#define VP_STATS_NBUCKET 32     /* log2 of usec; 0 is less than 1 usec */
+
+typedef struct {
+    unsigned long long calls;
+    unsigned long long errors;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long long nsec;
+    unsigned long long nsec_max;
+    unsigned long long nsec_poll;
+    unsigned long long nsyscall;
+    long arg_max;               /* the first argument of the slowest call */
+    unsigned long long hist[VP_STATS_NBUCKET];
+} vp_stats_t;
+
+enum {
+#define X(name) VP_API_##name,
+    VP_API_LIST
+#undef X
+    VP_API_COUNT
+};
+
+static const char *const _stats_name[] = {
+#define X(name) #name,
+    VP_API_LIST
+#undef X
+};
+
+static vp_stats_t _stats[VP_API_COUNT];
+static unsigned long long _stats_nsec_poll = 0;     /* total */
+static unsigned long long _stats_nsyscall = 0;      /* total */
+static size_t _stats_result_max = 0;                /* high water mark */
+
+static unsigned long long
+vp_now_nsec(void)
 {
-    vp_stack_t stack;
-    char *path;
-    void *handle;
+    struct timespec ts;
 
-    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
-    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &path));
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-    handle = dlopen(path, RTLD_LAZY);
-    if (handle == NULL)
-        return dlerror();
-    vp_stack_push_num(&_result, "%p", handle);
-    return vp_stack_return(&_result);
+/*
+ * Trace.  While started, a span is recorded for each API call and for the
+ * syscalls in it, in a ring which keeps the last nevent spans.  Kinds of
+ * spans are the APIs, followed by VP_TRACE_*.  A call which took msec or
+ * more is also logged to a file if the threshold is set.
+ */
+enum {
+    VP_TRACE_POLL = VP_API_COUNT,
+    VP_TRACE_READ,
+    VP_TRACE_WRITE,
+    VP_TRACE_WAITPID,
+    VP_TRACE_SPLICE,
+    VP_TRACE_EPOLL_WAIT,
+    VP_TRACE_SPAWN,
+    VP_TRACE_COUNT
+};
+
+static const char *const _trace_name[] = {
+    "poll", "read", "write", "waitpid", "splice", "epoll_wait", "spawn"
+};
+
+typedef struct {
+    unsigned long long start;   /* nsec */
+    unsigned long long nsec;
+    int kind;
+    int depth;                  /* 0 for APIs called by Vim */
+    long fd;
+    long long bytes;            /* or the result of the syscall */
+} vp_trace_t;
+
+static struct {
+    vp_trace_t *ring;           /* NULL while stopped */
+    size_t size;
+    size_t n;                   /* number of spans ever recorded */
+    unsigned long long origin;  /* nsec at start */
+    int depth;                  /* of nested APIs */
+    unsigned long long slow;    /* nsec; 0 if not logged */
+    char *slow_path;
+} _trace = {NULL, 0, 0, 0, 0, 0, NULL};
+
+static void
+vp_trace_add(int kind, unsigned long long start, unsigned long long nsec,
+        long fd, long long bytes)
+{
+    vp_trace_t *t = &_trace.ring[_trace.n++ % _trace.size];
+
+    t->start = start;
+    t->nsec = nsec;
+    t->kind = kind;
+    t->depth = _trace.depth;
+    t->fd = fd;
+    t->bytes = bytes;
 }
 
-const char *
-vp_dlclose(char *args)
+static void
+vp_trace_clear(void)
 {
-    vp_stack_t stack;
-    void *handle;
+    free(_trace.ring);
+    _trace.ring = NULL;
+    _trace.size = 0;
+    _trace.n = 0;
+    free(_trace.slow_path);
+    _trace.slow_path = NULL;
+    _trace.slow = 0;
+}
 
-    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%p", &handle));
+/* syscall span; start is 0 if the trace was stopped at the call */
+static void
+vp_trace_sys(int kind, unsigned long long start, long fd, long long ret)
+{
+    if (_trace.ring != NULL && start != 0)
+        vp_trace_add(kind, start, vp_now_nsec() - start, fd, ret);
+}
 
-    /* On FreeBSD6, to call dlclose() twice with same pointer causes SIGSEGV */
-    if (dlclose(handle) == -1)
-        return dlerror();
-    vp_stack_free(&_result);
-    return NULL;
+/* append a line of a slow call to the log */
+static void
+vp_trace_log_slow(int api, unsigned long long nsec, long arg, size_t bytes_in,
+        unsigned long long nsec_poll)
+{
+    FILE *fp;
+    time_t now = time(NULL);
+    char date[32];
+
+    if ((fp = fopen(_trace.slow_path, "a")) == NULL)
+        return;
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    fprintf(fp, "%s %s %.3f ms arg=%ld in=%zu out=%zu poll=%.3f ms%s\n",
+            date, _stats_name[api], nsec / 1e6, arg, bytes_in,
+            vp_stack_returned, nsec_poll / 1e6,
+            vp_stack_failed ? " error" : "");
+    fclose(fp);
 }
 
-const char *
-vp_file_open(char *args)
+typedef struct {
+    int api;
+    long arg;
+    size_t bytes_in;
+    unsigned long long start;
+    unsigned long long nsec_poll;
+    unsigned long long nsyscall;
+} vp_scope_t;
+
+/* the first argument is the last value in args */
+static vp_scope_t
+vp_scope_enter(int api, const char *args)
 {
-    vp_stack_t stack;
-    char *path;
-    char *flags;
-    int mode;  /* used when flags have O_CREAT */
-    int f = 0;
-    int fd;
+    vp_scope_t scope;
+    const char *p;
 
-    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
-    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &path));
-    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &flags));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &mode));
+    scope.api = api;
+    scope.arg = -1;
+    scope.bytes_in = (args != NULL) ? strlen(args) : 0;
+    if (scope.bytes_in > 1) {
+        p = args + scope.bytes_in - 1;
+        while (p != args && p[-1] != VP_EOV)
+            --p;
+        if ('0' <= *p && *p <= '9')
+            scope.arg = strtol(p, NULL, 10);
+    }
+    scope.nsec_poll = _stats_nsec_poll;
+    scope.nsyscall = _stats_nsyscall;
+    vp_stack_returned = 0;
+    vp_stack_failed = 0;
+    ++_trace.depth;
+    scope.start = vp_now_nsec();
+    return scope;
+}
 
-#ifdef O_RDONLY
-    if (strstr(flags, "O_RDONLY"))      f |= O_RDONLY;
-#endif
-#ifdef O_WRONLY
-    if (strstr(flags, "O_WRONLY"))      f |= O_WRONLY;
-#endif
-#ifdef O_RDRW
-    if (strstr(flags, "O_RDRW"))        f |= O_RDWR;
-#endif
-#ifdef O_NONBLOCK
-    if (strstr(flags, "O_NONBLOCK"))    f |= O_NONBLOCK;
-#endif
-#ifdef O_APPEND
-    if (strstr(flags, "O_APPEND"))      f |= O_APPEND;
-#endif
-#ifdef O_CREAT
-    if (strstr(flags, "O_CREAT"))       f |= O_CREAT;
-#endif
-#ifdef O_EXCL
-    if (strstr(flags, "O_EXCL"))        f |= O_EXCL;
-#endif
-#ifdef O_TRUNC
-    if (strstr(flags, "O_TRUNC"))       f |= O_TRUNC;
-#endif
-#ifdef O_SHLOCK
-    if (strstr(flags, "O_SHLOCK"))      f |= O_SHLOCK;
-#endif
-#ifdef O_EXLOCK
-    if (strstr(flags, "O_EXLOCK"))      f |= O_EXLOCK;
-#endif
-#ifdef O_DIRECT
-    if (strstr(flags, "O_DIRECT"))      f |= O_DIRECT;
-#endif
-#ifdef O_FSYNC
-    if (strstr(flags, "O_FSYNC"))       f |= O_FSYNC;
-#endif
-#ifdef O_NOFOLLOW
-    if (strstr(flags, "O_NOFOLLOW"))    f |= O_NOFOLLOW;
-#endif
-#ifdef O_TEMPORARY
-    if (strstr(flags, "O_TEMPORARY"))   f |= O_TEMPORARY;
-#endif
-#ifdef O_RANDOM
-    if (strstr(flags, "O_RANDOM"))      f |= O_RANDOM;
-#endif
-#ifdef O_SEQUENTIAL
-    if (strstr(flags, "O_SEQENTIAL"))   f |= O_SEQUENTIAL;
-#endif
-#ifdef O_BINARY
-    if (strstr(flags, "O_BINARY"))      f |= O_BINARY;
-#endif
-#ifdef O_TEXT
-    if (strstr(flags, "O_TEXT"))        f |= O_TEXT;
-#endif
-#ifdef O_INHERIT
-    if (strstr(flags, "O_INHERIT"))     f |= O_INHERIT;
-#endif
-#ifdef _O_SHORT_LIVED
-    if (strstr(flags, "O_SHORT_LIVED")) f |= _O_SHORT_LIVED;
+static void
+vp_scope_leave(vp_scope_t *scope)
+{
+    vp_stats_t *st = &_stats[scope->api];
+    unsigned long long nsec = vp_now_nsec() - scope->start;
+    unsigned long long usec = nsec / 1000;
+    int b = 0;
+
+    while (usec != 0 && b < VP_STATS_NBUCKET - 1) {
+        usec >>= 1;
+        ++b;
+    }
+    ++st->calls;
+    st->errors += vp_stack_failed;
+    st->bytes_in += scope->bytes_in;
+    st->bytes_out += vp_stack_returned;
+    st->nsec += nsec;
+    if (nsec >= st->nsec_max) {
+        st->nsec_max = nsec;
+        st->arg_max = scope->arg;
+    }
+    st->nsec_poll += _stats_nsec_poll - scope->nsec_poll;
+    st->nsyscall += _stats_nsyscall - scope->nsyscall;
+    ++st->hist[b];
+    if (_result.size > _stats_result_max)
+        _stats_result_max = _result.size;
+
+    --_trace.depth;
+    if (_trace.ring != NULL)
+        vp_trace_add(scope->api, scope->start, nsec, scope->arg,
+                vp_stack_returned);
+    if (_trace.slow != 0 && nsec >= _trace.slow && _trace.depth == 0)
+        vp_trace_log_slow(scope->api, nsec, scope->arg, scope->bytes_in,
+                _stats_nsec_poll - scope->nsec_poll);
+}
+
+# define VP_STATS_SCOPE(name, args) \
+    vp_scope_t vp_scope __attribute__((cleanup(vp_scope_leave))) = \
+        vp_scope_enter(VP_API_##name, args)
+# define VP_STATS_SYSCALL()     (++_stats_nsyscall)
+# define VP_STATS_NOW()         vp_now_nsec()
+# define VP_STATS_POLL(start)   (_stats_nsec_poll += vp_now_nsec() - (start))
+/* the clock is read only while tracing */
+# define VP_TRACE_NOW()         ((_trace.ring != NULL) ? vp_now_nsec() : 0)
+# define VP_TRACE_SYS(kind, start, fd, ret) \
+    vp_trace_sys(kind, start, fd, ret)
+#else
+/* a declaration which makes no code, but uses args */
+# define VP_STATS_SCOPE(name, args) \
+    enum { vp_scope_##name = sizeof(args) }
+# define VP_STATS_SYSCALL()     ((void)0)
+# define VP_STATS_NOW()         0
+# define VP_STATS_POLL(start)   ((void)(start))
+# define VP_TRACE_NOW()         0
+# define VP_TRACE_SYS(kind, start, fd, ret) ((void)(start))
 #endif
 
-    fd = open(path, f, mode);
-    if (fd == -1)
-        return vp_stack_return_error(&_result, "open() error: %s",
-                strerror(errno));
-    vp_stack_push_num(&_result, "%d", fd);
-    return vp_stack_return(&_result);
+/* Syscalls of Vim's thread, counted by statistics and traced. */
+static int
+vp_sys_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    unsigned long long start = VP_STATS_NOW();
+    int n = poll(fds, nfds, timeout);
+
+    VP_STATS_POLL(start);
+    VP_STATS_SYSCALL();
+    VP_TRACE_SYS(VP_TRACE_POLL, start, (nfds > 0) ? fds[0].fd : -1, n);
+    return n;
 }
 
-const char *
-vp_file_close(char *args)
+static ssize_t
+vp_sys_read(int fd, void *buf, size_t size)
 {
-    vp_stack_t stack;
-    int fd;
+    unsigned long long start = VP_TRACE_NOW();
+    ssize_t n = read(fd, buf, size);
 
-    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_STATS_SYSCALL();
+    VP_TRACE_SYS(VP_TRACE_READ, start, fd, n);
+    return n;
+}
 
-    if (close(fd) == -1)
-        return vp_stack_return_error(&_result, "close() error: %s",
-                strerror(errno));
-    return NULL;
+static ssize_t
+vp_sys_write(int fd, const void *buf, size_t size)
+{
+    unsigned long long start = VP_TRACE_NOW();
+    ssize_t n = write(fd, buf, size);
+
+    VP_STATS_SYSCALL();
+    VP_TRACE_SYS(VP_TRACE_WRITE, start, fd, n);
+    return n;
 }
 
-const char *
-vp_file_read(char *args)
+static pid_t
+vp_sys_waitpid(pid_t pid, int *status, int options)
 {
-    vp_stack_t stack;
-    int fd;
-    int nr;
-    int timeout;
-    int n;
-    char buf[VP_READ_BUFSIZE];
-    struct pollfd pfd = {0, POLLIN, 0};
+    unsigned long long start = VP_TRACE_NOW();
+    pid_t n = waitpid(pid, status, options);
 
-    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &nr));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+    VP_STATS_SYSCALL();
+    VP_TRACE_SYS(VP_TRACE_WAITPID, start, pid, n);
+    return n;
+}
 
-    pfd.fd = fd;
-    vp_stack_push_str(&_result, ""); /* initialize */
-    while (nr != 0) {
-        n = poll(&pfd, 1, timeout);
-        if (n == -1) {
-            /* eof or error */
-            vp_stack_push_num(&_result, "%d", 1);
-            return vp_stack_return(&_result);
-        } else if (n == 0) {
-            /* timeout */
-            break;
-        }
-        if (pfd.revents & POLLIN) {
-            if (nr > 0)
-                n = read(fd, buf,
-                        (VP_READ_BUFSIZE < nr) ? VP_READ_BUFSIZE : nr);
-            else
-                n = read(fd, buf, VP_READ_BUFSIZE);
-            if (n == -1) {
-                return vp_stack_return_error(&_result, "read() error: %s",
-                        strerror(errno));
-            } else if (n == 0) {
-                /* eof */
-                vp_stack_push_num(&_result, "%d", 1);
-                return vp_stack_return(&_result);
-            }
-            /* decrease stack top for concatenate. */
-            _result.top--;
-            vp_stack_push_bin(&_result, buf, n);
-            if (nr > 0)
-                nr -= n;
-            /* try read more bytes without waiting */
-            timeout = 0;
-            continue;
-        } else if (pfd.revents & (POLLERR | POLLHUP)) {
-            /* eof or error */
-            vp_stack_push_num(&_result, "%d", 1);
-            return vp_stack_return(&_result);
-        } else if (pfd.revents & POLLNVAL) {
-            return vp_stack_return_error(&_result, "poll() POLLNVAL: %d",
-                    pfd.revents);
-        }
-        /* DO NOT REACH HERE */
-        return vp_stack_return_error(&_result, "poll() unknown status: %d",
-                pfd.revents);
+/*
+ * Per fd state.  Bytes are read ahead into buf as many as available, and
+ * those which are not returned yet are carried over to the next read.
+ * The buffer is kept up to VP_READ_BUFSIZE bytes while fd is open.
+ */
+typedef struct vp_fdstate_t {
+    char *buf;      /* buffered bytes */
+    size_t len;     /* number of buffered bytes */
+    size_t size;    /* buffer size */
+} vp_fdstate_t;
+
+static vp_fdstate_t *_fdstate = NULL;  /* indexed by fd */
+static int _fdstate_size = 0;
+
+/* Record framing of vp_file_read_records() */
+#define VP_FRAME_LINE   0   /* terminated by '\n' */
+#define VP_FRAME_NUL    1   /* terminated by '\0' */
+#define VP_FRAME_LENGTH 2   /* 4 bytes big endian length + payload */
+#define VP_FRAME_HEADER 3   /* "Content-Length: n" header + payload */
+
+static vp_fdstate_t *vp_fdstate_get(int fd, int create);
+static void vp_fdstate_clear(int fd);
+static const char *vp_fdstate_reserve(vp_fdstate_t *state, size_t needsize);
+static void vp_fdstate_consume(vp_fdstate_t *state, size_t n);
+static void vp_fdstate_shrink(int fd);
+static int vp_fdstate_fill(vp_fdstate_t *state, int fd);
+static int vp_frame_next(int framing, const char *buf, size_t len,
+        size_t *off, size_t *size, size_t *next);
+static long long vp_now_msec(void);
+static int vp_pipe_cloexec(int p[2]);
+static int vp_epoll_watch(int fd);
+static void vp_child_clear(void);
+static void vp_job_forget_fd(int fd);
+static void vp_job_clear(void);
+static void vp_capture_take(int fd, vp_fdstate_t *state);
+static void vp_capture_clear(int fd);
+static void vp_capture_clear_all(void);
+static void vp_ansi_clear(int fd);
+static void vp_ansi_clear_all(void);
+static void vp_until_clear(void);
+static int vp_write_all(int fd, const char *buf, size_t size);
+
+/* NULL if fd has no state and create is false. */
+static vp_fdstate_t *
+vp_fdstate_get(int fd, int create)
+{
+    if (fd < 0)
+        return NULL;
+    if (fd >= _fdstate_size) {
+        vp_fdstate_t *newstate;
+        int newsize;
+
+        if (!create)
+            return NULL;
+        newsize = (_fdstate_size == 0) ? 64 : _fdstate_size;
+        while (newsize <= fd)
+            newsize *= 2;
+        newstate = (vp_fdstate_t *)realloc(_fdstate,
+                sizeof(vp_fdstate_t) * newsize);
+        if (newstate == NULL)
+            return NULL;
+        memset(newstate + _fdstate_size, 0,
+                sizeof(vp_fdstate_t) * (newsize - _fdstate_size));
+        _fdstate = newstate;
+        _fdstate_size = newsize;
     }
-    vp_stack_push_num(&_result, "%d", 0);
-    return vp_stack_return(&_result);
+    if (!create && _fdstate[fd].buf == NULL)
+        return NULL;
+    return &_fdstate[fd];
 }
 
-const char *
-vp_file_write(char *args)
+static void
+vp_fdstate_clear(int fd)
 {
-    vp_stack_t stack;
-    int fd;
-    char *buf;
-    size_t size;
-    int timeout;
-    size_t nleft;
-    int n;
-    struct pollfd pfd = {0, POLLOUT, 0};
-
-    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
-    VP_RETURN_IF_FAIL(vp_stack_pop_bin(&stack, &buf, &size));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+    vp_fdstate_t *state = vp_fdstate_get(fd, 0);
 
+    if (state != NULL) {
+        free(state->buf);
+        memset(state, 0, sizeof(vp_fdstate_t));
+    }
+}
+
+static const char *
+vp_fdstate_reserve(vp_fdstate_t *state, size_t needsize)
+{
+    if (needsize > state->size) {
+        size_t newsize;
+        char *newbuf;
+
+        newsize = (state->size == 0) ? VP_READ_BUFSIZE : (state->size * 2);
+        while (needsize > newsize)
+            newsize *= 2;
+        if ((newbuf = (char *)realloc(state->buf, newsize)) == NULL)
+            return "vp_fdstate_reserve: NOMEM";
+        state->buf = newbuf;
+        state->size = newsize;
+    }
+    return NULL;
+}
+
+/* drop first n bytes */
+static void
+vp_fdstate_consume(vp_fdstate_t *state, size_t n)
+{
+    if (n == 0)
+        return;
+    memmove(state->buf, state->buf + n, state->len - n);
+    state->len -= n;
+}
+
+/* release the buffer which was grown by a burst */
+static void
+vp_fdstate_shrink(int fd)
+{
+    vp_fdstate_t *state = vp_fdstate_get(fd, 0);
+
+    if (state != NULL && state->len == 0 && state->size > VP_READ_BUFSIZE)
+        vp_fdstate_clear(fd);
+}
+
+/*
+ * read all available bytes into the buffer.  The size is taken from
+ * FIONREAD, so a burst is read by one read().
+ * Return the number of bytes, 0 on eof or -1 on error.
+ */
+static int
+vp_fdstate_fill(vp_fdstate_t *state, int fd)
+{
+    int avail = 0;
+    size_t want;
+    int n;
+
+#ifdef FIONREAD
+    if (ioctl(fd, FIONREAD, &avail) == -1)
+        avail = 0;
+#endif
+    want = (avail > 0) ? (size_t)avail : 0;
+    if (want < state->size - state->len)
+        want = state->size - state->len;    /* fill free space */
+    if (want < VP_READ_BUFSIZE / 16)
+        want = VP_READ_BUFSIZE;
+    if (want > VP_READ_MAX)
+        want = VP_READ_MAX;
+    if (vp_fdstate_reserve(state, state->len + want) != NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    n = vp_sys_read(fd, state->buf + state->len, want);
+    if (n > 0) {
+        state->len += n;
+        vp_capture_take(fd, state);
+    }
+    return n;
+}
+
+/* the longest record which vp_frame_next() accepts */
+static size_t
+vp_frame_max(void)
+{
+    return (_result_cap != 0 && _result_cap < VP_READ_MAX)
+        ? _result_cap : VP_READ_MAX;
+}
+
+/*
+ * Find a complete record in buf[0, len).  Return 1 and set the payload
+ * buf[off, off + size) and the start of the next record, or return 0.
+ * Return -1 if the length of a record is over VP_READ_MAX or the result
+ * cap, or a header has no Content-Length, so that a bad header does not
+ * grow the buffer until that many bytes arrive.
+ */
+static int
+vp_frame_next(int framing, const char *buf, size_t len,
+        size_t *off, size_t *size, size_t *next)
+{
+    const char *p;
+    const char *end;
+    const char *eol;
+    size_t n;
+    size_t max = vp_frame_max();
+    int found;
+
+    switch (framing) {
+    case VP_FRAME_LINE:
+    case VP_FRAME_NUL:
+        p = memchr(buf, (framing == VP_FRAME_LINE) ? '\n' : '\0', len);
+        if (p == NULL)
+            return 0;
+        *off = 0;
+        *size = p - buf;
+        *next = *size + 1;
+        return 1;
+    case VP_FRAME_LENGTH:
+        if (len < 4)
+            return 0;
+        n = ((size_t)(unsigned char)buf[0] << 24)
+            | ((size_t)(unsigned char)buf[1] << 16)
+            | ((size_t)(unsigned char)buf[2] << 8)
+            | (size_t)(unsigned char)buf[3];
+        if (n > max)
+            return -1;
+        if (len - 4 < n)
+            return 0;
+        *off = 4;
+        *size = n;
+        *next = 4 + n;
+        return 1;
+    case VP_FRAME_HEADER:
+        end = memmem(buf, len, "\r\n\r\n", 4);
+        if (end == NULL)
+            return 0;
+        n = 0;
+        found = 0;
+        for (p = buf; p < end; p = eol + 2) {
+            eol = memmem(p, end + 2 - p, "\r\n", 2);
+            if (strncasecmp(p, "Content-Length:", 15) == 0) {
+                n = strtoul(p + 15, NULL, 10);
+                found = 1;
+            }
+        }
+        if (!found || n > max)
+            return -1;
+        *off = end + 4 - buf;
+        if (len - *off < n)
+            return 0;
+        *size = n;
+        *next = *off + n;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Readiness registry of vp_epoll_*().  A wait returns only the fds which
+ * are ready, so its cost does not grow with the number of idle fds.  On
+ * Linux the fds are kept in an epoll set, elsewhere they are poll()ed.
+ */
+static struct {
+    int epfd;           /* -1 until created */
+    int *fds;           /* registered fds */
+    int nfds;
+    int size;
+    int notify;         /* the notify pipe of the drain thread is added */
+} _epoll = {-1, NULL, 0, 0, 0};
+
+#ifdef VP_DRAIN
+/*
+ * Drain thread.  Once started, registered fds are read by a thread into
+ * a ring per fd, so that a child does not stall on a full pipe while Vim
+ * is idle.  A ring has one producer (the thread) and one consumer (Vim)
+ * and needs no lock.  The thread wakes Vim by writing a byte to notify,
+ * which a reader of a registered fd polls instead of the fd.  The lock
+ * only guards the table of rings, which the thread reads after poll().
+ */
+typedef struct vp_ring_t {
+    char *buf;
+    size_t size;        /* power of 2 */
+    size_t head;        /* written by consumer */
+    size_t tail;        /* written by producer */
+    int eof;            /* set by producer after the last byte */
+    int full;           /* producer waits for free space */
+    unsigned serial;
+} vp_ring_t;
+
+static struct {
+    int running;
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int wake[2];        /* Vim to thread */
+    int notify[2];      /* thread to Vim */
+    int pending;        /* a byte is in notify */
+    size_t ringsize;
+    vp_ring_t **ring;   /* indexed by fd */
+    int size;
+    unsigned serial;
+} _drain = {0, 0, 0, PTHREAD_MUTEX_INITIALIZER, {-1, -1}, {-1, -1}, 0, 0,
+    NULL, 0, 0};
+
+/* ring of fd, or NULL if fd is not registered.  Called by Vim only. */
+static vp_ring_t *
+vp_drain_ring(int fd)
+{
+    if (fd < 0 || fd >= _drain.size)
+        return NULL;
+    return _drain.ring[fd];
+}
+
+static void
+vp_drain_wake(int fd)
+{
+    ssize_t n;
+
+    /* a full pipe already has a byte to wake */
+    n = write(fd, "", 1);
+    (void)n;
+}
+
+/* producer: read fd into the free space of r */
+static ssize_t
+vp_ring_fill(vp_ring_t *r, int fd)
+{
+    size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    size_t off = r->tail & (r->size - 1);
+    size_t len = r->size - (r->tail - head);
+    ssize_t n;
+
+    if (len > r->size - off)
+        len = r->size - off;
+    n = read(fd, r->buf + off, len);
+    if (n > 0)
+        __atomic_store_n(&r->tail, r->tail + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+/* consumer: move all bytes of r into the buffer of fd */
+static const char *
+vp_ring_take(int fd, vp_ring_t *r, vp_fdstate_t *state, size_t *taken)
+{
+    size_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    size_t n = tail - r->head;
+    size_t off = r->head & (r->size - 1);
+    size_t len;
+
+    *taken = n;
+    if (n == 0)
+        return NULL;
+    VP_RETURN_IF_FAIL(vp_fdstate_reserve(state, state->len + n));
+    len = (n > r->size - off) ? r->size - off : n;
+    memcpy(state->buf + state->len, r->buf + off, len);
+    memcpy(state->buf + state->len + len, r->buf, n - len);
+    state->len += n;
+    __atomic_store_n(&r->head, tail, __ATOMIC_RELEASE);
+    if (__atomic_exchange_n(&r->full, 0, __ATOMIC_ACQ_REL))
+        vp_drain_wake(_drain.wake[1]);
+    vp_capture_take(fd, state);
+    return NULL;
+}
+
+static void *
+vp_drain_main(void *arg)
+{
+    struct pollfd pfd[VP_POLL_MAX + 1];
+    unsigned serial[VP_POLL_MAX + 1];
+    char c[64];
+    vp_ring_t *r;
+    ssize_t n;
+    int npfd;
+    int notify;
+    int fd;
+    int i;
+
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&_drain.lock);
+        if (_drain.stop) {
+            pthread_mutex_unlock(&_drain.lock);
+            break;
+        }
+        pfd[0].fd = _drain.wake[0];
+        pfd[0].events = POLLIN;
+        npfd = 1;
+        for (fd = 0; fd < _drain.size && npfd <= VP_POLL_MAX; ++fd) {
+            r = _drain.ring[fd];
+            if (r == NULL || __atomic_load_n(&r->eof, __ATOMIC_ACQUIRE))
+                continue;
+            if (r->tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)
+                    == r->size) {
+                /* Vim wakes us when it takes bytes. */
+                __atomic_store_n(&r->full, 1, __ATOMIC_RELEASE);
+                if (r->tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)
+                        == r->size)
+                    continue;
+            }
+            pfd[npfd].fd = fd;
+            pfd[npfd].events = POLLIN;
+            serial[npfd] = r->serial;
+            ++npfd;
+        }
+        pthread_mutex_unlock(&_drain.lock);
+
+        for (i = 0; i < npfd; ++i)
+            pfd[i].revents = 0;
+        if (poll(pfd, npfd, -1) == -1)
+            continue;
+        if (pfd[0].revents & POLLIN) {
+            while (read(_drain.wake[0], c, sizeof(c)) > 0)
+                ;
+        }
+
+        notify = 0;
+        pthread_mutex_lock(&_drain.lock);
+        for (i = 1; i < npfd; ++i) {
+            if (pfd[i].revents == 0)
+                continue;
+            fd = pfd[i].fd;
+            /* unregistered, or even closed and reused, while polling */
+            if (fd >= _drain.size || (r = _drain.ring[fd]) == NULL
+                    || r->serial != serial[i])
+                continue;
+            n = vp_ring_fill(r, fd);
+            if (n > 0) {
+                notify = 1;
+            } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                /* eof or error */
+                __atomic_store_n(&r->eof, 1, __ATOMIC_RELEASE);
+                notify = 1;
+            }
+        }
+        pthread_mutex_unlock(&_drain.lock);
+        if (notify && !__atomic_exchange_n(&_drain.pending, 1,
+                    __ATOMIC_ACQ_REL))
+            vp_drain_wake(_drain.notify[1]);
+    }
+    return NULL;
+}
+
+/* clear the notification before looking into rings */
+static void
+vp_drain_clear_notify(void)
+{
+    char c[64];
+
+    __atomic_store_n(&_drain.pending, 0, __ATOMIC_RELEASE);
+    while (vp_sys_read(_drain.notify[0], c, sizeof(c)) > 0)
+        ;
+}
+
+/*
+ * Wait until the ring of fd has bytes, and move them into the buffer.
+ * Return the number of bytes, 0 on eof, -1 on error or -2 on timeout.
+ */
+static int
+vp_drain_wait(int fd, vp_fdstate_t *state, int timeout)
+{
+    vp_ring_t *r = vp_drain_ring(fd);
+    struct pollfd pfd = {0, POLLIN, 0};
+    long long deadline = vp_now_msec() + timeout;
+    size_t n;
+    int eof;
+    int wait;
+
+    pfd.fd = _drain.notify[0];
+    while (1) {
+        vp_drain_clear_notify();
+        eof = __atomic_load_n(&r->eof, __ATOMIC_ACQUIRE);
+        if (vp_ring_take(fd, r, state, &n) != NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        if (n > 0)
+            return (int)n;
+        if (eof)
+            return 0;
+        wait = -1;
+        if (timeout >= 0) {
+            wait = deadline - vp_now_msec();
+            if (wait <= 0)
+                return -2;
+        }
+        if (vp_sys_poll(&pfd, 1, wait) == 0)
+            return -2;
+    }
+}
+
+/*
+ * Stop draining fd.  Bytes in the ring are moved into the buffer of fd,
+ * and fd is read directly again.
+ */
+static void
+vp_drain_unregister_fd(int fd)
+{
+    vp_ring_t *r = vp_drain_ring(fd);
+    vp_fdstate_t *state;
+    size_t n;
+
+    if (r == NULL)
+        return;
+    pthread_mutex_lock(&_drain.lock);
+    _drain.ring[fd] = NULL;
+    pthread_mutex_unlock(&_drain.lock);
+    vp_drain_wake(_drain.wake[1]);
+
+    /* the thread does not touch r any more */
+    state = vp_fdstate_get(fd, 1);
+    if (state != NULL)
+        vp_ring_take(fd, r, state, &n);
+    free(r->buf);
+    free(r);
+    vp_epoll_watch(fd);
+}
+
+static void
+vp_drain_shutdown(void)
+{
+    int fd;
+
+    if (!_drain.running)
+        return;
+    pthread_mutex_lock(&_drain.lock);
+    _drain.stop = 1;
+    pthread_mutex_unlock(&_drain.lock);
+    vp_drain_wake(_drain.wake[1]);
+    pthread_join(_drain.thread, NULL);
+
+    for (fd = 0; fd < _drain.size; ++fd)
+        vp_drain_unregister_fd(fd);
+    free(_drain.ring);
+    _drain.ring = NULL;
+    _drain.size = 0;
+    close(_drain.wake[0]);
+    close(_drain.wake[1]);
+    close(_drain.notify[0]);
+    close(_drain.notify[1]);
+    _drain.running = 0;
+    _drain.stop = 0;
+    /* the closed notify pipe left the epoll set */
+    _epoll.notify = 0;
+}
+#endif
+
+/*
+ * Capture policy of an fd, set by vp_capture_set().  The bytes read from a
+ * captured fd are moved out of its buffer at once, so a read of it returns
+ * only eof, and what the policy keeps is returned by vp_capture_read():
+ *   discard    nothing
+ *   bytes      the last limit bytes
+ *   lines      the last limit lines
+ *   spill      all; past limit bytes they are moved to an unlinked
+ *              temporary file, whose tail is mmap()ed by a read.
+ * A long running job may print as much as it likes; it costs Vim nothing
+ * until the tail is read.
+ */
+#define VP_CAPTURE_DISCARD  0
+#define VP_CAPTURE_BYTES    1
+#define VP_CAPTURE_LINES    2
+#define VP_CAPTURE_SPILL    3
+
+typedef struct vp_capture_t {
+    int mode;
+    size_t limit;
+    char *buf;          /* kept bytes */
+    size_t len;
+    size_t size;
+    int spill;          /* the temporary file, -1 until spilled */
+    off_t spilled;      /* bytes in the file */
+    unsigned long long total;   /* bytes read from fd */
+    unsigned long long dropped; /* bytes thrown away by the policy */
+    int eof;
+} vp_capture_t;
+
+static vp_capture_t **_capture = NULL;  /* indexed by fd */
+static int _capture_size = 0;
+
+/* NULL if fd has no policy and create is false, or no memory. */
+static vp_capture_t *
+vp_capture_get(int fd, int create)
+{
+    vp_capture_t *c;
+
+    if (fd < 0)
+        return NULL;
+    if (fd >= _capture_size) {
+        vp_capture_t **newtable;
+        int newsize;
+
+        if (!create)
+            return NULL;
+        newsize = (_capture_size == 0) ? 64 : _capture_size;
+        while (newsize <= fd)
+            newsize *= 2;
+        newtable = (vp_capture_t **)realloc(_capture,
+                sizeof(vp_capture_t *) * newsize);
+        if (newtable == NULL)
+            return NULL;
+        memset(newtable + _capture_size, 0,
+                sizeof(vp_capture_t *) * (newsize - _capture_size));
+        _capture = newtable;
+        _capture_size = newsize;
+    }
+    if (_capture[fd] == NULL && create) {
+        c = (vp_capture_t *)calloc(1, sizeof(vp_capture_t));
+        if (c == NULL)
+            return NULL;
+        c->spill = -1;
+        _capture[fd] = c;
+    }
+    return _capture[fd];
+}
+
+static void
+vp_capture_clear(int fd)
+{
+    vp_capture_t *c = vp_capture_get(fd, 0);
+
+    if (c == NULL)
+        return;
+    if (c->spill != -1)
+        close(c->spill);
+    free(c->buf);
+    free(c);
+    _capture[fd] = NULL;
+}
+
+static void
+vp_capture_clear_all(void)
+{
+    int fd;
+
+    for (fd = 0; fd < _capture_size; ++fd)
+        vp_capture_clear(fd);
+    free(_capture);
+    _capture = NULL;
+    _capture_size = 0;
+}
+
+/* offset of the last nlines lines of buf[0, len) and an unterminated one */
+static size_t
+vp_tail_lines(const char *buf, size_t len, size_t nlines)
+{
+    size_t i;
+
+    for (i = len; i > 0; --i) {
+        if (buf[i - 1] == '\n' && nlines-- == 0)
+            return i;
+    }
+    return 0;
+}
+
+/* move the kept bytes and buf to a new temporary file */
+static int
+vp_capture_spill(vp_capture_t *c, const char *buf, size_t len)
+{
+    char path[1024];
+    const char *dir;
+
+    if (c->spill == -1) {
+        dir = getenv("TMPDIR");
+        if (dir == NULL || *dir == '\0')
+            dir = "/tmp";
+        snprintf(path, sizeof(path), "%s/vimproc.XXXXXX", dir);
+        if ((c->spill = mkstemp(path)) == -1)
+            return -1;
+        unlink(path);
+        fcntl(c->spill, F_SETFD, FD_CLOEXEC);
+        if (vp_write_all(c->spill, c->buf, c->len) == -1)
+            return -1;
+        c->spilled = c->len;
+        free(c->buf);
+        c->buf = NULL;
+        c->len = c->size = 0;
+    }
+    if (vp_write_all(c->spill, buf, len) == -1)
+        return -1;
+    c->spilled += len;
+    return 0;
+}
+
+/* apply the policy of fd to the bytes in the buffer of fd */
+static void
+vp_capture_take(int fd, vp_fdstate_t *state)
+{
+    vp_capture_t *c = vp_capture_get(fd, 0);
+    size_t n;
+    size_t keep;
+
+    if (c == NULL || state->len == 0)
+        return;
+    n = state->len;
+    state->len = 0;
+    c->total += n;
+    if (c->mode == VP_CAPTURE_DISCARD) {
+        c->dropped += n;
+        return;
+    }
+    if (c->mode == VP_CAPTURE_SPILL
+            && (c->spill != -1 || c->len + n > c->limit)) {
+        if (vp_capture_spill(c, state->buf, n) == -1)
+            c->dropped += n;
+        return;
+    }
+
+    if (c->len + n > c->size) {
+        size_t newsize = (c->size == 0) ? VP_READ_BUFSIZE : c->size;
+        char *newbuf;
+
+        while (newsize < c->len + n)
+            newsize *= 2;
+        if ((newbuf = (char *)realloc(c->buf, newsize)) == NULL) {
+            c->dropped += n;
+            return;
+        }
+        c->buf = newbuf;
+        c->size = newsize;
+    }
+    memcpy(c->buf + c->len, state->buf, n);
+    c->len += n;
+
+    keep = c->len;
+    if (c->mode == VP_CAPTURE_BYTES && keep > c->limit)
+        keep = c->limit;
+    else if (c->mode == VP_CAPTURE_LINES)
+        keep = c->len - vp_tail_lines(c->buf, c->len, c->limit);
+    /* even a line without newline does not take all memory */
+    if (keep > VP_READ_MAX)
+        keep = VP_READ_MAX;
+    if (keep < c->len) {
+        memmove(c->buf, c->buf + c->len - keep, keep);
+        c->dropped += c->len - keep;
+        c->len = keep;
+    }
+}
+
+/*
+ * Read what fd has without waiting, up to VP_READ_MAX bytes so that a fast
+ * writer does not keep Vim here.  Return 1 on eof, 0 or -1 on error.
+ */
+static int
+vp_capture_pump(int fd, vp_capture_t *c)
+{
+    vp_fdstate_t *state = vp_fdstate_get(fd, 1);
+    struct pollfd pfd = {0, POLLIN, 0};
+    unsigned long long total = c->total;
+    int n;
+
+    if (state == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (c->eof)
+        return 1;
+#ifdef VP_DRAIN
+    if (vp_drain_ring(fd) != NULL) {
+        vp_ring_t *r = vp_drain_ring(fd);
+        size_t taken;
+
+        c->eof = __atomic_load_n(&r->eof, __ATOMIC_ACQUIRE);
+        if (vp_ring_take(fd, r, state, &taken) != NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        return c->eof;
+    }
+#endif
     pfd.fd = fd;
-    nleft = 0;
-    while (nleft < size) {
-        n = poll(&pfd, 1, timeout);
+    while (c->total - total < VP_READ_MAX) {
+        n = vp_sys_poll(&pfd, 1, 0);
+        if (n == 0)
+            return 0;
+        if (n == -1 || (pfd.revents & POLLIN) == 0) {
+            if (n != -1 && (pfd.revents & POLLNVAL)) {
+                errno = EBADF;
+                return -1;
+            }
+            /* eof or error */
+            c->eof = 1;
+            return 1;
+        }
+        n = vp_fdstate_fill(state, fd);
+        if (n == 0) {
+            c->eof = 1;
+            return 1;
+        } else if (n == -1) {
+            return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Outbound queue of an fd, filled by vp_file_write_async().  What the fd
+ * does not take at once is kept here and written without blocking by
+ * later calls: vp_file_flush(), vp_file_write() of the same fd, and the
+ * APIs which Vim calls while a process runs.  The fd is made non-blocking
+ * while bytes are queued, and blocks again when the queue is empty if it
+ * did before.  An error of a write in the background is returned by the
+ * next call for the fd, and the queue is dropped.
+ */
+typedef struct vp_outq_t {
+    char *buf;          /* NULL while nothing is queued */
+    size_t off;         /* bytes already written */
+    size_t len;         /* bytes queued after off */
+    size_t size;
+    int nonblock;       /* fd was non-blocking before the queue */
+    int error;          /* errno of a failed write, or 0 */
+} vp_outq_t;
+
+static vp_outq_t **_outq = NULL;        /* indexed by fd */
+static int _outq_size = 0;
+static size_t _outq_total = 0;          /* bytes queued for all fds */
+
+/* NULL if fd has no queue and create is false, or no memory. */
+static vp_outq_t *
+vp_outq_get(int fd, int create)
+{
+    vp_outq_t *q;
+
+    if (fd < 0)
+        return NULL;
+    if (fd >= _outq_size) {
+        vp_outq_t **newtable;
+        int newsize;
+
+        if (!create)
+            return NULL;
+        newsize = (_outq_size == 0) ? 64 : _outq_size;
+        while (newsize <= fd)
+            newsize *= 2;
+        newtable = (vp_outq_t **)realloc(_outq,
+                sizeof(vp_outq_t *) * newsize);
+        if (newtable == NULL)
+            return NULL;
+        memset(newtable + _outq_size, 0,
+                sizeof(vp_outq_t *) * (newsize - _outq_size));
+        _outq = newtable;
+        _outq_size = newsize;
+    }
+    if (_outq[fd] == NULL && create) {
+        q = (vp_outq_t *)calloc(1, sizeof(vp_outq_t));
+        if (q == NULL)
+            return NULL;
+        _outq[fd] = q;
+    }
+    return _outq[fd];
+}
+
+/* drop the queued bytes; the buffer is released with them */
+static void
+vp_outq_drop(vp_outq_t *q)
+{
+    _outq_total -= q->len;
+    free(q->buf);
+    q->buf = NULL;
+    q->off = 0;
+    q->len = 0;
+    q->size = 0;
+}
+
+static void
+vp_outq_clear(int fd)
+{
+    vp_outq_t *q = vp_outq_get(fd, 0);
+
+    if (q == NULL)
+        return;
+    vp_outq_drop(q);
+    free(q);
+    _outq[fd] = NULL;
+}
+
+static void
+vp_outq_clear_all(void)
+{
+    int fd;
+
+    for (fd = 0; fd < _outq_size; ++fd)
+        vp_outq_clear(fd);
+    free(_outq);
+    _outq = NULL;
+    _outq_size = 0;
+    _outq_total = 0;
+}
+
+/* append size bytes to the queue of fd */
+static const char *
+vp_outq_push(int fd, vp_outq_t *q, const char *buf, size_t size)
+{
+    int flags;
+
+    if (size == 0)
+        return NULL;
+    if (q->buf == NULL) {
+        if ((flags = fcntl(fd, F_GETFL)) == -1
+                || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+            return "vp_outq_push: fcntl() error";
+        q->nonblock = flags & O_NONBLOCK;
+    }
+    if (q->off + q->len + size > q->size) {
+        size_t newsize;
+        char *newbuf;
+
+        /* move the queued bytes to the front before growing */
+        memmove(q->buf, q->buf + q->off, q->len);
+        q->off = 0;
+        newsize = (q->size == 0) ? VP_READ_BUFSIZE : q->size;
+        while (q->len + size > newsize)
+            newsize *= 2;
+        if (newsize > q->size) {
+            if ((newbuf = (char *)realloc(q->buf, newsize)) == NULL)
+                return "vp_outq_push: NOMEM";
+            q->buf = newbuf;
+            q->size = newsize;
+        }
+    }
+    memcpy(q->buf + q->off + q->len, buf, size);
+    q->len += size;
+    _outq_total += size;
+    return NULL;
+}
+
+/*
+ * Write the queued bytes until fd takes no more.  On an error the queue
+ * is dropped and the errno is kept in it.  Return -1 on error.
+ */
+static int
+vp_outq_write(int fd, vp_outq_t *q)
+{
+    ssize_t n;
+    int ret = 0;
+
+    while (q->len > 0) {
+        n = vp_sys_write(fd, q->buf + q->off, q->len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            q->error = errno;
+            ret = -1;
+            break;
+        }
+        q->off += n;
+        q->len -= n;
+        _outq_total -= n;
+    }
+    if (q->buf != NULL && !q->nonblock)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    vp_outq_drop(q);
+    return ret;
+}
+
+/*
+ * Wait until the queue of fd is written, for timeout msec at most.
+ * Return -1 with errno on error.
+ */
+static int
+vp_outq_wait(int fd, vp_outq_t *q, int timeout)
+{
+    struct pollfd pfd = {0, POLLOUT, 0};
+    long long deadline = vp_now_msec() + timeout;
+    int wait = timeout;
+    int n;
+
+    if (q->error != 0) {
+        errno = q->error;
+        q->error = 0;
+        return -1;
+    }
+    pfd.fd = fd;
+    while (vp_outq_write(fd, q) == 0 && q->len > 0) {
+        if (timeout >= 0) {
+            wait = deadline - vp_now_msec();
+            if (wait <= 0)
+                return 0;
+        }
+        n = vp_sys_poll(&pfd, 1, wait);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        } else if (n == 0) {
+            return 0;
+        } else if (pfd.revents & POLLNVAL) {
+            errno = EBADF;
+            return -1;
+        }
+        /* POLLERR or POLLHUP is returned by the write */
+    }
+    if (q->error != 0) {
+        errno = q->error;
+        q->error = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* write what the queues of all fds can take now, without waiting */
+static void
+vp_outq_flush_all(void)
+{
+    int fd;
+
+    if (_outq_total == 0)
+        return;
+    for (fd = 0; fd < _outq_size; ++fd) {
+        if (_outq[fd] != NULL && _outq[fd]->len > 0)
+            vp_outq_write(fd, _outq[fd]);
+    }
+}
+
+static int
+vp_epoll_index(int fd)
+{
+    int i;
+
+    for (i = 0; i < _epoll.nfds; ++i) {
+        if (_epoll.fds[i] == fd)
+            return i;
+    }
+    return -1;
+}
+
+#if defined __linux__
+/* the epoll set is created by the first use. */
+static int
+vp_epoll_create(void)
+{
+    if (_epoll.epfd == -1)
+        _epoll.epfd = epoll_create1(EPOLL_CLOEXEC);
+    return _epoll.epfd;
+}
+#endif
+
+/*
+ * Add a registered fd to the epoll set.  An fd read by the drain thread is
+ * not added; it is added when unregistered from the thread.
+ */
+static int
+vp_epoll_watch(int fd)
+{
+#if defined __linux__
+    struct epoll_event ev;
+
+    if (vp_epoll_index(fd) < 0)
+        return 0;
+# ifdef VP_DRAIN
+    if (vp_drain_ring(fd) != NULL)
+        return 0;
+# endif
+    if (vp_epoll_create() == -1)
+        return -1;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(_epoll.epfd, EPOLL_CTL_ADD, fd, &ev) == -1
+            && errno != EEXIST)
+        return -1;
+#endif
+    return 0;
+}
+
+/* remove fd from the registry.  fd may be already closed. */
+static void
+vp_epoll_forget(int fd)
+{
+    int i = vp_epoll_index(fd);
+
+    if (i < 0)
+        return;
+#if defined __linux__
+    epoll_ctl(_epoll.epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+    _epoll.fds[i] = _epoll.fds[--_epoll.nfds];
+}
+
+const char *
+vp_dlopen(char *args)
+{
+    VP_STATS_SCOPE(vp_dlopen, args);
+    vp_stack_t stack;
+    char *path;
+    void *handle;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &path));
+
+    vp_hex_init();
+
+    handle = dlopen(path, RTLD_LAZY);
+    if (handle == NULL)
+        return dlerror();
+    vp_stack_push_num(&_result, "%p", handle);
+    return vp_stack_return(&_result);
+}
+
+const char *
+vp_dlclose(char *args)
+{
+    VP_STATS_SCOPE(vp_dlclose, args);
+    vp_stack_t stack;
+    void *handle;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%p", &handle));
+
+#ifdef VP_DRAIN
+    /* the thread must not run after this library is unloaded */
+    vp_drain_shutdown();
+#endif
+    vp_child_clear();
+    vp_job_clear();
+    vp_capture_clear_all();
+    vp_ansi_clear_all();
+    vp_until_clear();
+    vp_outq_clear_all();
+#ifdef VP_STATS
+    vp_trace_clear();
+#endif
+    /* On FreeBSD6, to call dlclose() twice with same pointer causes SIGSEGV */
+    if (dlclose(handle) == -1)
+        return dlerror();
+    vp_stack_free(&_result);
+    vp_stack_free(&_batch);
+    return NULL;
+}
+
+/* select the encoding of binary values: "hex" or "esc" */
+const char *
+vp_set_encoding(char *args)
+{
+    VP_STATS_SCOPE(vp_set_encoding, args);
+    vp_stack_t stack;
+    char *encoding;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &encoding));
+
+    if (strcmp(encoding, "hex") == 0)
+        vp_bin_encoding = VP_BIN_HEX;
+    else if (strcmp(encoding, "esc") == 0)
+        vp_bin_encoding = VP_BIN_ESC;
+    else
+        return vp_stack_return_error(&_result, "unknown encoding: %s",
+                encoding);
+    vp_stack_push_str(&_result, encoding);
+    return vp_stack_return(&_result);
+}
+
+const char *
+vp_set_result_cap(char *args)
+{
+    VP_STATS_SCOPE(vp_set_result_cap, args);
+    vp_stack_t stack;
+    int cap;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &cap));
+    if (cap < 0)
+        return vp_stack_return_error(&_result, "cap range error: %d", cap);
+    _result_cap = cap;
+    return NULL;
+}
+
+const char *
+vp_file_open(char *args)
+{
+    VP_STATS_SCOPE(vp_file_open, args);
+    vp_stack_t stack;
+    char *path;
+    char *flags;
+    int mode;  /* used when flags have O_CREAT */
+    int f = 0;
+    int fd;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &path));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &flags));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &mode));
+
+#ifdef O_RDONLY
+    if (strstr(flags, "O_RDONLY"))      f |= O_RDONLY;
+#endif
+#ifdef O_WRONLY
+    if (strstr(flags, "O_WRONLY"))      f |= O_WRONLY;
+#endif
+#ifdef O_RDRW
+    if (strstr(flags, "O_RDRW"))        f |= O_RDWR;
+#endif
+#ifdef O_NONBLOCK
+    if (strstr(flags, "O_NONBLOCK"))    f |= O_NONBLOCK;
+#endif
+#ifdef O_APPEND
+    if (strstr(flags, "O_APPEND"))      f |= O_APPEND;
+#endif
+#ifdef O_CREAT
+    if (strstr(flags, "O_CREAT"))       f |= O_CREAT;
+#endif
+#ifdef O_EXCL
+    if (strstr(flags, "O_EXCL"))        f |= O_EXCL;
+#endif
+#ifdef O_TRUNC
+    if (strstr(flags, "O_TRUNC"))       f |= O_TRUNC;
+#endif
+#ifdef O_SHLOCK
+    if (strstr(flags, "O_SHLOCK"))      f |= O_SHLOCK;
+#endif
+#ifdef O_EXLOCK
+    if (strstr(flags, "O_EXLOCK"))      f |= O_EXLOCK;
+#endif
+#ifdef O_DIRECT
+    if (strstr(flags, "O_DIRECT"))      f |= O_DIRECT;
+#endif
+#ifdef O_FSYNC
+    if (strstr(flags, "O_FSYNC"))       f |= O_FSYNC;
+#endif
+#ifdef O_NOFOLLOW
+    if (strstr(flags, "O_NOFOLLOW"))    f |= O_NOFOLLOW;
+#endif
+#ifdef O_TEMPORARY
+    if (strstr(flags, "O_TEMPORARY"))   f |= O_TEMPORARY;
+#endif
+#ifdef O_RANDOM
+    if (strstr(flags, "O_RANDOM"))      f |= O_RANDOM;
+#endif
+#ifdef O_SEQUENTIAL
+    if (strstr(flags, "O_SEQENTIAL"))   f |= O_SEQUENTIAL;
+#endif
+#ifdef O_BINARY
+    if (strstr(flags, "O_BINARY"))      f |= O_BINARY;
+#endif
+#ifdef O_TEXT
+    if (strstr(flags, "O_TEXT"))        f |= O_TEXT;
+#endif
+#ifdef O_INHERIT
+    if (strstr(flags, "O_INHERIT"))     f |= O_INHERIT;
+#endif
+#ifdef _O_SHORT_LIVED
+    if (strstr(flags, "O_SHORT_LIVED")) f |= _O_SHORT_LIVED;
+#endif
+
+    fd = open(path, f, mode);
+    if (fd == -1)
+        return vp_stack_return_error(&_result, "open() error: %s",
+                strerror(errno));
+    vp_stack_push_num(&_result, "%d", fd);
+    return vp_stack_return(&_result);
+}
+
+const char *
+vp_file_close(char *args)
+{
+    VP_STATS_SCOPE(vp_file_close, args);
+    vp_stack_t stack;
+    int fd;
+    vp_outq_t *q;
+    size_t nleft = 0;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+
+    /*
+     * Bytes queued by vp_file_write_async() go before eof.  An error means
+     * that the reader is gone, so they are dropped as by a write().
+     */
+    if ((q = vp_outq_get(fd, 0)) != NULL && q->len > 0) {
+        vp_outq_wait(fd, q, VP_CLOSE_FLUSH);
+        nleft = q->len;
+    }
+#ifdef VP_DRAIN
+    vp_drain_unregister_fd(fd);
+#endif
+    vp_epoll_forget(fd);
+    vp_job_forget_fd(fd);
+    vp_fdstate_clear(fd);
+    vp_capture_clear(fd);
+    vp_ansi_clear(fd);
+    vp_outq_clear(fd);
+    if (close(fd) == -1)
+        return vp_stack_return_error(&_result, "close() error: %s",
+                strerror(errno));
+    if (nleft > 0)
+        return vp_stack_return_error(&_result,
+                "close(): %zu queued bytes are not written", nleft);
+    return NULL;
+}
+
+const char *
+vp_file_read(char *args)
+{
+    VP_STATS_SCOPE(vp_file_read, args);
+    vp_stack_t stack;
+    int fd;
+    int nr;
+    int timeout;
+    int n;
+    vp_fdstate_t *state;
+    struct pollfd pfd = {0, POLLIN, 0};
+
+    vp_outq_flush_all();
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &nr));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+
+    if (fd < 0)
+        return vp_stack_return_error(&_result, "invalid fd: %d", fd);
+
+    state = vp_fdstate_get(fd, 1);
+    if (state == NULL)
+        return vp_stack_return_error(&_result, "vp_fdstate_get: NOMEM");
+    if (_result_cap != 0 && (nr < 0 || (size_t)nr > _result_cap))
+        nr = (int)_result_cap;
+
+    pfd.fd = fd;
+    vp_stack_push_str(&_result, ""); /* initialize */
+    while (nr != 0) {
+        if (state->len > 0) {
+            /* return buffered bytes first */
+            n = (nr < 0 || (size_t)nr > state->len) ? (int)state->len : nr;
+            /* decrease stack top for concatenate. */
+            _result.top--;
+            vp_stack_push_bin(&_result, state->buf, n);
+            vp_fdstate_consume(state, n);
+            if (nr > 0)
+                nr -= n;
+            /* try read more bytes without waiting */
+            timeout = 0;
+            continue;
+        }
+#ifdef VP_DRAIN
+        if (vp_drain_ring(fd) != NULL) {
+            n = vp_drain_wait(fd, state, timeout);
+            if (n == -1) {
+                return vp_stack_return_error(&_result, "vp_drain_wait: %s",
+                        strerror(errno));
+            } else if (n == -2) {
+                /* timeout */
+                break;
+            } else if (n == 0) {
+                /* eof */
+                vp_fdstate_clear(fd);
+                vp_stack_push_num(&_result, "%d", 1);
+                return vp_stack_return(&_result);
+            }
+            continue;
+        }
+#endif
+        n = vp_sys_poll(&pfd, 1, timeout);
+        if (n == -1) {
+            /* eof or error */
+            vp_fdstate_clear(fd);
+            vp_stack_push_num(&_result, "%d", 1);
+            return vp_stack_return(&_result);
+        } else if (n == 0) {
+            /* timeout */
+            break;
+        }
+        if (pfd.revents & POLLIN) {
+            n = vp_fdstate_fill(state, fd);
+            if (n == -1) {
+                return vp_stack_return_error(&_result, "read() error: %s",
+                        strerror(errno));
+            } else if (n == 0) {
+                /* eof */
+                vp_fdstate_clear(fd);
+                vp_stack_push_num(&_result, "%d", 1);
+                return vp_stack_return(&_result);
+            }
+            continue;
+        } else if (pfd.revents & (POLLERR | POLLHUP)) {
+            /* eof or error */
+            vp_fdstate_clear(fd);
+            vp_stack_push_num(&_result, "%d", 1);
+            return vp_stack_return(&_result);
+        } else if (pfd.revents & POLLNVAL) {
+            return vp_stack_return_error(&_result, "poll() POLLNVAL: %d",
+                    pfd.revents);
+        }
+        /* DO NOT REACH HERE */
+        return vp_stack_return_error(&_result, "poll() unknown status: %d",
+                pfd.revents);
+    }
+    vp_fdstate_shrink(fd);
+    vp_stack_push_num(&_result, "%d", 0);
+    return vp_stack_return(&_result);
+}
+
+const char *
+vp_file_write(char *args)
+{
+    VP_STATS_SCOPE(vp_file_write, args);
+    vp_stack_t stack;
+    int fd;
+    char *buf;
+    size_t size;
+    int timeout;
+    size_t nleft;
+    int n;
+    struct pollfd pfd = {0, POLLOUT, 0};
+    vp_outq_t *q;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_bin(&stack, &buf, &size));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+
+    vp_outq_flush_all();
+    /* bytes queued by vp_file_write_async() go first */
+    q = vp_outq_get(fd, 0);
+    if (q != NULL && (q->len > 0 || q->error != 0)) {
+        if (vp_outq_wait(fd, q, timeout) == -1)
+            return vp_stack_return_error(&_result, "write() error: %s",
+                    strerror(errno));
+        if (q->len > 0) {
+            /* buf waits behind them */
+            VP_RETURN_IF_FAIL(vp_outq_push(fd, q, buf, size));
+            vp_stack_push_num(&_result, "%zu", size);
+            return vp_stack_return(&_result);
+        }
+    }
+
+    pfd.fd = fd;
+    nleft = 0;
+    while (nleft < size) {
+        n = vp_sys_poll(&pfd, 1, timeout);
+        if (n == -1) {
+            return vp_stack_return_error(&_result, "poll() error: %s",
+                    strerror(errno));
+        } else if (n == 0) {
+            /* timeout */
+            break;
+        }
+        if (pfd.revents & POLLOUT) {
+            n = vp_sys_write(fd, buf + nleft, size - nleft);
+            if (n == -1) {
+                /* fd may be non-blocking */
+                if (errno == EAGAIN || errno == EINTR) {
+                    timeout = 0;
+                    continue;
+                }
+                return vp_stack_return_error(&_result, "write() error: %s",
+                        strerror(errno));
+            }
+            nleft += n;
+            /* try write more bytes without waiting */
+            timeout = 0;
+            continue;
+        } else if (pfd.revents & (POLLERR | POLLHUP)) {
+            /* eof or error */
+            break;
+        } else if (pfd.revents & POLLNVAL) {
+            return vp_stack_return_error(&_result, "poll() POLLNVAL: %d",
+                    pfd.revents);
+        }
+        /* DO NOT REACH HERE */
+        return vp_stack_return_error(&_result, "poll() unknown status: %s",
+                pfd.revents);
+    }
+    vp_stack_push_num(&_result, "%zu", nleft);
+    return vp_stack_return(&_result);
+}
+
+/*
+ * Write without blocking.  What fd does not take now is queued, and the
+ * number of queued bytes is returned so that a caller can wait by
+ * vp_file_flush() before it queues more.
+ */
+const char *
+vp_file_write_async(char *args)
+{
+    VP_STATS_SCOPE(vp_file_write_async, args);
+    vp_stack_t stack;
+    int fd;
+    char *buf;
+    size_t size;
+    vp_outq_t *q;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_bin(&stack, &buf, &size));
+
+    if (fd < 0)
+        return vp_stack_return_error(&_result, "invalid fd: %d", fd);
+
+    vp_outq_flush_all();
+    if ((q = vp_outq_get(fd, 1)) == NULL)
+        return vp_stack_return_error(&_result, "vp_outq_get: NOMEM");
+    if (q->error != 0) {
+        errno = q->error;
+        q->error = 0;
+        return vp_stack_return_error(&_result, "write() error: %s",
+                strerror(errno));
+    }
+    VP_RETURN_IF_FAIL(vp_outq_push(fd, q, buf, size));
+    if (vp_outq_write(fd, q) == -1) {
+        errno = q->error;
+        q->error = 0;
+        return vp_stack_return_error(&_result, "write() error: %s",
+                strerror(errno));
+    }
+    vp_stack_push_num(&_result, "%zu", q->len);
+    return vp_stack_return(&_result);
+}
+
+/*
+ * Wait until the queue of fd is written, for timeout msec at most.  With
+ * timeout 0 it only writes what fd takes now.  Return the bytes left.
+ */
+const char *
+vp_file_flush(char *args)
+{
+    VP_STATS_SCOPE(vp_file_flush, args);
+    vp_stack_t stack;
+    int fd;
+    int timeout;
+    vp_outq_t *q;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+
+    vp_outq_flush_all();
+    q = vp_outq_get(fd, 0);
+    if (q != NULL && vp_outq_wait(fd, q, timeout) == -1)
+        return vp_stack_return_error(&_result, "write() error: %s",
+                strerror(errno));
+    vp_stack_push_num(&_result, "%zu", (q != NULL) ? q->len : 0);
+    return vp_stack_return(&_result);
+}
+
+/*
+ * Read complete records.  framing is "line", "nul", "length" or
+ * "content-length".  A partial record is carried over to the next read.
+ * On eof, a partial line is returned as the last record and a partial
+ * message is dropped.
+ */
+const char *
+vp_file_read_records(char *args)
+{
+    VP_STATS_SCOPE(vp_file_read_records, args);
+    vp_stack_t stack;
+    int fd;
+    char *framing_str;
+    int framing;
+    int nr;
+    int timeout;
+    int n;
+    int eof = 0;
+    size_t head;
+    size_t off;
+    size_t size;
+    size_t next;
+    size_t total = 0;
+    vp_fdstate_t *state;
+    struct pollfd pfd = {0, POLLIN, 0};
+
+    vp_outq_flush_all();
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &framing_str));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &nr));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+
+    if (fd < 0)
+        return vp_stack_return_error(&_result, "invalid fd: %d", fd);
+
+    if (strcmp(framing_str, "line") == 0)
+        framing = VP_FRAME_LINE;
+    else if (strcmp(framing_str, "nul") == 0)
+        framing = VP_FRAME_NUL;
+    else if (strcmp(framing_str, "length") == 0)
+        framing = VP_FRAME_LENGTH;
+    else if (strcmp(framing_str, "content-length") == 0)
+        framing = VP_FRAME_HEADER;
+    else
+        return vp_stack_return_error(&_result, "unknown framing: %s",
+                framing_str);
+
+    state = vp_fdstate_get(fd, 1);
+    if (state == NULL)
+        return vp_stack_return_error(&_result, "vp_fdstate_get: NOMEM");
+
+    pfd.fd = fd;
+    while (1) {
+        /* return complete records first */
+        head = 0;
+        n = 0;
+        while (nr != 0 && (_result_cap == 0 || total < _result_cap)
+                && (n = vp_frame_next(framing, state->buf + head,
+                    state->len - head, &off, &size, &next)) == 1) {
+            vp_stack_push_bin(&_result, state->buf + head + off, size);
+            head += next;
+            total += size;
+            if (nr > 0)
+                --nr;
+        }
+        vp_fdstate_consume(state, head);
+        if (n == -1)
+            return vp_stack_return_error(&_result,
+                    "record error: no Content-Length, or over %zu bytes",
+                    vp_frame_max());
+        if (nr == 0 || (_result_cap != 0 && total >= _result_cap))
+            break;
+
+#ifdef VP_DRAIN
+        if (vp_drain_ring(fd) != NULL) {
+            n = vp_drain_wait(fd, state, timeout);
+            if (n == -1) {
+                return vp_stack_return_error(&_result, "vp_drain_wait: %s",
+                        strerror(errno));
+            } else if (n == -2) {
+                /* timeout */
+                break;
+            } else if (n == 0) {
+                /* eof */
+                eof = 1;
+                break;
+            }
+            timeout = 0;
+            continue;
+        }
+#endif
+        n = vp_sys_poll(&pfd, 1, timeout);
+        if (n == -1) {
+            /* eof or error */
+            eof = 1;
+            break;
+        } else if (n == 0) {
+            /* timeout */
+            break;
+        }
+        if (pfd.revents & POLLIN) {
+            n = vp_fdstate_fill(state, fd);
+            if (n == -1) {
+                return vp_stack_return_error(&_result, "read() error: %s",
+                        strerror(errno));
+            } else if (n == 0) {
+                /* eof */
+                eof = 1;
+                break;
+            }
+            /* try read more bytes without waiting */
+            timeout = 0;
+            continue;
+        } else if (pfd.revents & (POLLERR | POLLHUP)) {
+            /* eof or error */
+            eof = 1;
+            break;
+        } else if (pfd.revents & POLLNVAL) {
+            return vp_stack_return_error(&_result, "poll() POLLNVAL: %d",
+                    pfd.revents);
+        }
+        /* DO NOT REACH HERE */
+        return vp_stack_return_error(&_result, "poll() unknown status: %d",
+                pfd.revents);
+    }
+    if (eof) {
+        if (state->len > 0
+                && (framing == VP_FRAME_LINE || framing == VP_FRAME_NUL))
+            vp_stack_push_bin(&_result, state->buf, state->len);
+        vp_fdstate_clear(fd);
+    } else {
+        vp_fdstate_shrink(fd);
+    }
+    vp_stack_push_num(&_result, "%d", eof);
+    return vp_stack_return(&_result);
+}
+
+/*
+ * ANSI/VT escape sequences, decoded by vp_file_read_ansi().  The text is
+ * returned without them, and each sequence which a terminal emulator needs
+ * becomes an op [kind, off, a, b, c], where off is the byte offset in the
+ * text from which it applies:
+ *   attr       fg, bg, flags   SGR.  A color is 0-255, or -1 for default.
+ *   cup        row, col        cursor position (CSI H, CSI f)
+ *   move       drow, dcol      relative cursor move (CSI A, B, C, D)
+ *   col        col             cursor column (CSI G)
+ *   el         n               erase in line (CSI K)
+ *   ed         n               erase in display (CSI J)
+ *   save                       save the cursor (ESC 7, CSI s)
+ *   restore                    restore the cursor (ESC 8, CSI u)
+ *   mode       param, set      private mode (CSI ? h, CSI ? l)
+ *   csi        final, p1, p2   any other CSI
+ * OSC, DCS and charset designations are dropped, and the other control
+ * characters are left in the text.  The parser state is kept per fd until
+ * it is closed, so a sequence split between reads is decoded as a whole.
+ */
+#define VP_ANSI_GROUND      0
+#define VP_ANSI_ESC         1
+#define VP_ANSI_ESC_INTER   2   /* ESC and intermediate bytes */
+#define VP_ANSI_CSI         3
+#define VP_ANSI_STRING      4   /* OSC, DCS, ... terminated by ST or BEL */
+#define VP_ANSI_STRING_ESC  5   /* ESC in a string, maybe ST */
+
+#define VP_ANSI_NPARAM      16
+
+/* SGR flags */
+#define VP_ANSI_BOLD        0x01
+#define VP_ANSI_DIM         0x02
+#define VP_ANSI_ITALIC      0x04
+#define VP_ANSI_UNDERLINE   0x08
+#define VP_ANSI_BLINK       0x10
+#define VP_ANSI_REVERSE     0x20
+#define VP_ANSI_STRIKE      0x40
+
+typedef struct vp_ansi_t {
+    int state;
+    int priv;           /* private marker of CSI, or 0 */
+    int param[VP_ANSI_NPARAM];
+    int nparam;         /* index of the current parameter */
+    int fg;
+    int bg;
+    int flags;
+} vp_ansi_t;
+
+typedef struct {
+    const char *kind;
+    size_t off;
+    int a;
+    int b;
+    int c;
+} vp_ansi_op_t;
+
+static vp_ansi_t **_ansi = NULL;        /* indexed by fd */
+static int _ansi_size = 0;
+
+static struct {
+    vp_ansi_op_t *list;
+    size_t n;
+    size_t size;
+} _ansi_ops = {NULL, 0, 0};
+
+/* NULL if no memory */
+static vp_ansi_t *
+vp_ansi_get(int fd)
+{
+    vp_ansi_t *a;
+
+    if (fd < 0)
+        return NULL;
+    if (fd >= _ansi_size) {
+        vp_ansi_t **newtable;
+        int newsize = (_ansi_size == 0) ? 64 : _ansi_size;
+
+        while (newsize <= fd)
+            newsize *= 2;
+        newtable = (vp_ansi_t **)realloc(_ansi, sizeof(vp_ansi_t *) * newsize);
+        if (newtable == NULL)
+            return NULL;
+        memset(newtable + _ansi_size, 0,
+                sizeof(vp_ansi_t *) * (newsize - _ansi_size));
+        _ansi = newtable;
+        _ansi_size = newsize;
+    }
+    if (_ansi[fd] == NULL) {
+        if ((a = (vp_ansi_t *)calloc(1, sizeof(vp_ansi_t))) == NULL)
+            return NULL;
+        a->fg = a->bg = -1;
+        _ansi[fd] = a;
+    }
+    return _ansi[fd];
+}
+
+static void
+vp_ansi_clear(int fd)
+{
+    if (fd < 0 || fd >= _ansi_size)
+        return;
+    free(_ansi[fd]);
+    _ansi[fd] = NULL;
+}
+
+static void
+vp_ansi_clear_all(void)
+{
+    int fd;
+
+    for (fd = 0; fd < _ansi_size; ++fd)
+        vp_ansi_clear(fd);
+    free(_ansi);
+    _ansi = NULL;
+    _ansi_size = 0;
+    free(_ansi_ops.list);
+    _ansi_ops.list = NULL;
+    _ansi_ops.n = _ansi_ops.size = 0;
+}
+
+static const char *
+vp_ansi_op(const char *kind, size_t off, int a, int b, int c)
+{
+    vp_ansi_op_t *op;
+
+    if (_ansi_ops.n == _ansi_ops.size) {
+        size_t newsize = (_ansi_ops.size == 0) ? 64 : _ansi_ops.size * 2;
+        vp_ansi_op_t *newlist = (vp_ansi_op_t *)realloc(_ansi_ops.list,
+                sizeof(vp_ansi_op_t) * newsize);
+
+        if (newlist == NULL)
+            return "vp_ansi_op: NOMEM";
+        _ansi_ops.list = newlist;
+        _ansi_ops.size = newsize;
+    }
+    op = &_ansi_ops.list[_ansi_ops.n++];
+    op->kind = kind;
+    op->off = off;
+    op->a = a;
+    op->b = b;
+    op->c = c;
+    return NULL;
+}
+
+/* 24 bit color to the 6x6x6 cube of 256 colors */
+static int
+vp_ansi_rgb(int r, int g, int b)
+{
+#define VP_ANSI_CUBE(x) \
+    ((((x) < 0 ? 0 : (x) > 255 ? 255 : (x)) * 5 + 127) / 255)
+    return 16 + 36 * VP_ANSI_CUBE(r) + 6 * VP_ANSI_CUBE(g) + VP_ANSI_CUBE(b);
+#undef VP_ANSI_CUBE
+}
+
+static const char *
+vp_ansi_sgr(vp_ansi_t *a, size_t off)
+{
+    int fg = a->fg;
+    int bg = a->bg;
+    int flags = a->flags;
+    int *color;
+    int i;
+    int p;
+
+    for (i = 0; i <= a->nparam; ++i) {
+        p = a->param[i];
+        if (p == 0) {
+            a->fg = a->bg = -1;
+            a->flags = 0;
+        } else if (p == 1) {
+            a->flags |= VP_ANSI_BOLD;
+        } else if (p == 2) {
+            a->flags |= VP_ANSI_DIM;
+        } else if (p == 3) {
+            a->flags |= VP_ANSI_ITALIC;
+        } else if (p == 4) {
+            a->flags |= VP_ANSI_UNDERLINE;
+        } else if (p == 5 || p == 6) {
+            a->flags |= VP_ANSI_BLINK;
+        } else if (p == 7) {
+            a->flags |= VP_ANSI_REVERSE;
+        } else if (p == 9) {
+            a->flags |= VP_ANSI_STRIKE;
+        } else if (p == 21 || p == 22) {
+            a->flags &= ~(VP_ANSI_BOLD | VP_ANSI_DIM);
+        } else if (p == 23) {
+            a->flags &= ~VP_ANSI_ITALIC;
+        } else if (p == 24) {
+            a->flags &= ~VP_ANSI_UNDERLINE;
+        } else if (p == 25) {
+            a->flags &= ~VP_ANSI_BLINK;
+        } else if (p == 27) {
+            a->flags &= ~VP_ANSI_REVERSE;
+        } else if (p == 29) {
+            a->flags &= ~VP_ANSI_STRIKE;
+        } else if (30 <= p && p <= 37) {
+            a->fg = p - 30;
+        } else if (p == 39) {
+            a->fg = -1;
+        } else if (40 <= p && p <= 47) {
+            a->bg = p - 40;
+        } else if (p == 49) {
+            a->bg = -1;
+        } else if (90 <= p && p <= 97) {
+            a->fg = p - 90 + 8;
+        } else if (100 <= p && p <= 107) {
+            a->bg = p - 100 + 8;
+        } else if (p == 38 || p == 48) {
+            color = (p == 38) ? &a->fg : &a->bg;
+            if (i + 2 <= a->nparam && a->param[i + 1] == 5) {
+                *color = (a->param[i + 2] > 255) ? 255 : a->param[i + 2];
+                i += 2;
+            } else if (i + 4 <= a->nparam && a->param[i + 1] == 2) {
+                *color = vp_ansi_rgb(a->param[i + 2], a->param[i + 3],
+                        a->param[i + 4]);
+                i += 4;
+            }
+        }
+    }
+    if (a->fg == fg && a->bg == bg && a->flags == flags)
+        return NULL;
+    /* only the last of the changes at the same offset matters */
+    if (_ansi_ops.n > 0 && _ansi_ops.list[_ansi_ops.n - 1].off == off
+            && strcmp(_ansi_ops.list[_ansi_ops.n - 1].kind, "attr") == 0)
+        --_ansi_ops.n;
+    return vp_ansi_op("attr", off, a->fg, a->bg, a->flags);
+}
+
+static const char *
+vp_ansi_csi(vp_ansi_t *a, int final, size_t off)
+{
+    int p0 = a->param[0];
+    int p1 = (a->nparam >= 1) ? a->param[1] : 0;
+    int n = (p0 == 0) ? 1 : p0;
+
+    if (a->priv == '?' && (final == 'h' || final == 'l'))
+        return vp_ansi_op("mode", off, p0, final == 'h', 0);
+    if (a->priv != 0)
+        return vp_ansi_op("csi", off, final, p0, p1);
+    switch (final) {
+    case 'm':
+        return vp_ansi_sgr(a, off);
+    case 'H':
+    case 'f':
+        return vp_ansi_op("cup", off, n, (p1 == 0) ? 1 : p1, 0);
+    case 'A':
+        return vp_ansi_op("move", off, -n, 0, 0);
+    case 'B':
+        return vp_ansi_op("move", off, n, 0, 0);
+    case 'C':
+        return vp_ansi_op("move", off, 0, n, 0);
+    case 'D':
+        return vp_ansi_op("move", off, 0, -n, 0);
+    case 'G':
+        return vp_ansi_op("col", off, n, 0, 0);
+    case 'K':
+        return vp_ansi_op("el", off, p0, 0, 0);
+    case 'J':
+        return vp_ansi_op("ed", off, p0, 0, 0);
+    case 's':
+        return vp_ansi_op("save", off, 0, 0, 0);
+    case 'u':
+        return vp_ansi_op("restore", off, 0, 0, 0);
+    }
+    return vp_ansi_op("csi", off, final, p0, p1);
+}
+
+/*
+ * Decode in[0, len) into out, which has len bytes, and the ops.
+ * *outlen is the length of the text returned so far.
+ */
+static const char *
+vp_ansi_decode(vp_ansi_t *a, const char *in, size_t len, char *out,
+        size_t *outlen)
+{
+    size_t o = *outlen;
+    size_t i;
+    int c;
+
+    for (i = 0; i < len; ++i) {
+        c = (unsigned char)in[i];
+        if (c == 0x18 || c == 0x1a) {
+            /* CAN and SUB cancel a sequence */
+            a->state = VP_ANSI_GROUND;
+            continue;
+        }
+        switch (a->state) {
+        case VP_ANSI_GROUND:
+            if (c == 0x1b)
+                a->state = VP_ANSI_ESC;
+            else
+                out[o++] = (char)c;
+            break;
+        case VP_ANSI_ESC:
+            if (c == '[') {
+                a->state = VP_ANSI_CSI;
+                a->priv = 0;
+                a->nparam = 0;
+                memset(a->param, 0, sizeof(a->param));
+            } else if (c == ']' || c == 'P' || c == 'X' || c == '^'
+                    || c == '_') {
+                a->state = VP_ANSI_STRING;
+            } else if (0x20 <= c && c <= 0x2f) {
+                a->state = VP_ANSI_ESC_INTER;
+            } else if (c == 0x1b) {
+                /* stay */
+            } else if (c < 0x20) {
+                out[o++] = (char)c;
+            } else {
+                if (c == '7')
+                    VP_RETURN_IF_FAIL(vp_ansi_op("save", o, 0, 0, 0));
+                else if (c == '8')
+                    VP_RETURN_IF_FAIL(vp_ansi_op("restore", o, 0, 0, 0));
+                a->state = VP_ANSI_GROUND;
+            }
+            break;
+        case VP_ANSI_ESC_INTER:
+            if (c == 0x1b)
+                a->state = VP_ANSI_ESC;
+            else if (c < 0x20)
+                out[o++] = (char)c;
+            else if (c >= 0x30)
+                a->state = VP_ANSI_GROUND;
+            break;
+        case VP_ANSI_CSI:
+            if ('0' <= c && c <= '9') {
+                if (a->param[a->nparam] < 65536)
+                    a->param[a->nparam] = a->param[a->nparam] * 10 + (c - '0');
+            } else if (c == ';' || c == ':') {
+                if (a->nparam < VP_ANSI_NPARAM - 1)
+                    ++a->nparam;
+            } else if (0x3c <= c && c <= 0x3f) {
+                a->priv = c;
+            } else if (0x40 <= c && c <= 0x7e) {
+                a->state = VP_ANSI_GROUND;
+                VP_RETURN_IF_FAIL(vp_ansi_csi(a, c, o));
+            } else if (c == 0x1b) {
+                a->state = VP_ANSI_ESC;
+            } else if (c < 0x20) {
+                /* executed in the middle of a sequence */
+                out[o++] = (char)c;
+            }
+            /* intermediate bytes are ignored */
+            break;
+        case VP_ANSI_STRING:
+            if (c == 0x07)
+                a->state = VP_ANSI_GROUND;
+            else if (c == 0x1b)
+                a->state = VP_ANSI_STRING_ESC;
+            break;
+        case VP_ANSI_STRING_ESC:
+            a->state = (c == '\\') ? VP_ANSI_GROUND : VP_ANSI_STRING;
+            break;
+        }
+    }
+    *outlen = o;
+    return NULL;
+}
+
+/*
+ * vp_file_read() with the escape sequences decoded as above.  Return the
+ * text, eof and the ops.
+ */
+const char *
+vp_file_read_ansi(char *args)
+{
+    VP_STATS_SCOPE(vp_file_read_ansi, args);
+    vp_stack_t stack;
+    int fd;
+    int nr;
+    int timeout;
+    int n;
+    int eof = 0;
+    size_t len;
+    size_t i;
+    char *text = NULL;
+    char *newtext;
+    size_t textsize = 0;
+    size_t textlen = 0;
+    vp_ansi_t *a;
+    vp_fdstate_t *state;
+    struct pollfd pfd = {0, POLLIN, 0};
+    const char *err;
+
+    vp_outq_flush_all();
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &nr));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+
+    if (fd < 0)
+        return vp_stack_return_error(&_result, "invalid fd: %d", fd);
+
+    state = vp_fdstate_get(fd, 1);
+    a = vp_ansi_get(fd);
+    if (state == NULL || a == NULL)
+        return vp_stack_return_error(&_result, "vp_ansi_get: NOMEM");
+    if (_result_cap != 0 && (nr < 0 || (size_t)nr > _result_cap))
+        nr = (int)_result_cap;
+    _ansi_ops.n = 0;
+
+    pfd.fd = fd;
+    while (nr != 0) {
+        if (state->len > 0) {
+            /* decode buffered bytes first; the text is not longer */
+            len = (nr < 0 || (size_t)nr > state->len) ? state->len : (size_t)nr;
+            newtext = (char *)realloc(text, textsize + len);
+            if (newtext == NULL) {
+                free(text);
+                return vp_stack_return_error(&_result,
+                        "vp_file_read_ansi: NOMEM");
+            }
+            text = newtext;
+            textsize += len;
+            if ((err = vp_ansi_decode(a, state->buf, len, text,
+                            &textlen)) != NULL) {
+                free(text);
+                return vp_stack_return_error(&_result, "%s", err);
+            }
+            vp_fdstate_consume(state, len);
+            if (nr > 0)
+                nr -= len;
+            /* try read more bytes without waiting */
+            timeout = 0;
+            continue;
+        }
+#ifdef VP_DRAIN
+        if (vp_drain_ring(fd) != NULL) {
+            n = vp_drain_wait(fd, state, timeout);
+            if (n == -1) {
+                free(text);
+                return vp_stack_return_error(&_result, "vp_drain_wait: %s",
+                        strerror(errno));
+            } else if (n == -2) {
+                /* timeout */
+                break;
+            } else if (n == 0) {
+                /* eof */
+                eof = 1;
+                break;
+            }
+            continue;
+        }
+#endif
+        n = vp_sys_poll(&pfd, 1, timeout);
+        if (n == -1) {
+            /* eof or error */
+            eof = 1;
+            break;
+        } else if (n == 0) {
+            /* timeout */
+            break;
+        }
+        if (pfd.revents & POLLIN) {
+            n = vp_fdstate_fill(state, fd);
+            if (n == -1) {
+                free(text);
+                return vp_stack_return_error(&_result, "read() error: %s",
+                        strerror(errno));
+            } else if (n == 0) {
+                /* eof */
+                eof = 1;
+                break;
+            }
+        } else if (pfd.revents & (POLLERR | POLLHUP)) {
+            /* eof or error */
+            eof = 1;
+            break;
+        } else {
+            free(text);
+            return vp_stack_return_error(&_result, "poll() POLLNVAL: %d",
+                    pfd.revents);
+        }
+    }
+
+    vp_stack_push_bin(&_result, (text != NULL) ? text : "", textlen);
+    free(text);
+    vp_stack_push_num(&_result, "%d", eof);
+    for (i = 0; i < _ansi_ops.n; ++i) {
+        vp_stack_push_str(&_result, _ansi_ops.list[i].kind);
+        vp_stack_push_num(&_result, "%zu", _ansi_ops.list[i].off);
+        vp_stack_push_num(&_result, "%d", _ansi_ops.list[i].a);
+        vp_stack_push_num(&_result, "%d", _ansi_ops.list[i].b);
+        vp_stack_push_num(&_result, "%d", _ansi_ops.list[i].c);
+    }
+    if (eof)
+        vp_fdstate_clear(fd);
+    else
+        vp_fdstate_shrink(fd);
+    return vp_stack_return(&_result);
+}
+
+/* Patterns of vp_file_read_until() */
+#define VP_UNTIL_LITERAL    0
+#define VP_UNTIL_REGEX      1
+#define VP_UNTIL_OSC133     2
+
+/* the regex of the last call, which a REPL session repeats */
+static struct {
+    char *pattern;
+    regex_t re;
+} _until = {NULL};
+
+static void
+vp_until_clear(void)
+{
+    if (_until.pattern != NULL) {
+        regfree(&_until.re);
+        free(_until.pattern);
+        _until.pattern = NULL;
+    }
+}
+
+/*
+ * Find pattern in buf[*from, len), which is terminated by NUL.  Return 1
+ * and set the end of the match, or return 0.  *from is where the search
+ * can start next time; a regex starts at the beginning of a line.
+ */
+static int
+vp_until_match(int kind, const char *pattern, const char *buf, size_t len,
+        size_t *from, size_t *end)
+{
+    size_t plen = strlen(pattern);
+    const char *p;
+    const char *q;
+    regmatch_t m;
+
+    switch (kind) {
+    case VP_UNTIL_LITERAL:
+        p = memmem(buf + *from, len - *from, pattern, plen);
+        if (p != NULL) {
+            *end = p - buf + plen;
+            return 1;
+        }
+        /* the pattern may start in the last plen - 1 bytes */
+        *from = (len >= plen) ? len - plen + 1 : 0;
+        return 0;
+    case VP_UNTIL_REGEX:
+        /* a NUL in buf stops the match */
+        if (regexec(&_until.re, buf + *from, 1, &m, 0) == 0) {
+            *end = *from + m.rm_eo;
+            return 1;
+        }
+        /* only the last line, which is incomplete, is searched again */
+        for (p = buf + len; p > buf + *from && p[-1] != '\n'; --p)
+            ;
+        *from = p - buf;
+        return 0;
+    case VP_UNTIL_OSC133:
+        /* ESC ] 133 ; letter [; ...] terminated by BEL or ESC \ */
+        for (p = buf + *from; (p = memmem(p, len - (p - buf),
+                        "\033]133;", 6)) != NULL; p += 6) {
+            if (p + 6 >= buf + len)
+                break;
+            if (*pattern != '\0' && p[6] != *pattern)
+                continue;
+            for (q = p + 7; q < buf + len; ++q) {
+                if (*q == '\007') {
+                    *end = q + 1 - buf;
+                    return 1;
+                }
+                if (*q == '\033' && q + 1 < buf + len && q[1] == '\\') {
+                    *end = q + 2 - buf;
+                    return 1;
+                }
+            }
+            break;
+        }
+        /* an incomplete marker is searched again */
+        *from = (p != NULL) ? (size_t)(p - buf)
+            : (len >= 6) ? len - 6 + 1 : 0;
+        return 0;
+    }
+    return 0;
+}
+
+/*
+ * Read until pattern appears or timeout passes, so that a prompt is found
+ * as soon as the child prints it.  kind is "literal", "regex" (POSIX
+ * extended, where ^ and $ match at a newline too) or "osc133", whose
+ * pattern is the letter of the marker, or empty for any.  A regex is
+ * searched again from the last incomplete line only, so a match over
+ * lines has to be read at once.  The bytes up to the end of the match are
+ * returned, and the rest is kept for the next read.  Without a match, the
+ * bytes read are returned up to the result cap.
+ */
+const char *
+vp_file_read_until(char *args)
+{
+    VP_STATS_SCOPE(vp_file_read_until, args);
+    vp_stack_t stack;
+    int fd;
+    char *kindname;
+    char *pattern;
+    int timeout;
+    int kind;
+    int n;
+    int ret;
+    int found = 0;
+    int eof = 0;
+    int wait;
+    int expired = 0;
+    size_t from = 0;
+    size_t end = 0;
+    long long deadline;
+    vp_fdstate_t *state;
+    struct pollfd pfd = {0, POLLIN, 0};
+
+    vp_outq_flush_all();
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &kindname));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &pattern));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+
+    if (fd < 0)
+        return vp_stack_return_error(&_result, "invalid fd: %d", fd);
+
+    if (strcmp(kindname, "literal") == 0)
+        kind = VP_UNTIL_LITERAL;
+    else if (strcmp(kindname, "regex") == 0)
+        kind = VP_UNTIL_REGEX;
+    else if (strcmp(kindname, "osc133") == 0)
+        kind = VP_UNTIL_OSC133;
+    else
+        return vp_stack_return_error(&_result, "unknown pattern kind: %s",
+                kindname);
+    if (kind == VP_UNTIL_LITERAL && *pattern == '\0')
+        return vp_stack_return_error(&_result, "empty pattern");
+    if (kind == VP_UNTIL_REGEX && (_until.pattern == NULL
+                || strcmp(_until.pattern, pattern) != 0)) {
+        vp_until_clear();
+        ret = regcomp(&_until.re, pattern, REG_EXTENDED | REG_NEWLINE);
+        if (ret != 0) {
+            char msg[256];
+
+            regerror(ret, &_until.re, msg, sizeof(msg));
+            return vp_stack_return_error(&_result, "regcomp() error: %s",
+                    msg);
+        }
+        if ((_until.pattern = strdup(pattern)) == NULL) {
+            regfree(&_until.re);
+            return vp_stack_return_error(&_result, "strdup: NOMEM");
+        }
+    }
+
+    state = vp_fdstate_get(fd, 1);
+    if (state == NULL)
+        return vp_stack_return_error(&_result, "vp_fdstate_get: NOMEM");
+
+    pfd.fd = fd;
+    deadline = vp_now_msec() + timeout;
+    while (1) {
+        if (state->len > 0) {
+            if (vp_fdstate_reserve(state, state->len + 1) != NULL)
+                return vp_stack_return_error(&_result,
+                        "vp_fdstate_reserve: NOMEM");
+            state->buf[state->len] = '\0';
+            found = vp_until_match(kind, pattern, state->buf, state->len,
+                    &from, &end);
+            if (found || (_result_cap != 0 && state->len >= _result_cap))
+                break;
+        }
+        wait = -1;
+        if (timeout >= 0) {
+            wait = deadline - vp_now_msec();
+            if (wait <= 0) {
+                /* what is readable now is read once more */
+                if (expired)
+                    break;
+                expired = 1;
+                wait = 0;
+            }
+        }
+#ifdef VP_DRAIN
+        if (vp_drain_ring(fd) != NULL) {
+            n = vp_drain_wait(fd, state, wait);
+            if (n == -1) {
+                return vp_stack_return_error(&_result, "vp_drain_wait: %s",
+                        strerror(errno));
+            } else if (n == -2) {
+                /* timeout */
+                break;
+            } else if (n == 0) {
+                /* eof */
+                eof = 1;
+                break;
+            }
+            continue;
+        }
+#endif
+        n = vp_sys_poll(&pfd, 1, wait);
+        if (n == -1) {
+            /* eof or error */
+            eof = 1;
+            break;
+        } else if (n == 0) {
+            /* timeout */
+            break;
+        }
+        if (pfd.revents & POLLIN) {
+            n = vp_fdstate_fill(state, fd);
+            if (n == -1) {
+                return vp_stack_return_error(&_result, "read() error: %s",
+                        strerror(errno));
+            } else if (n == 0) {
+                /* eof */
+                eof = 1;
+                break;
+            }
+        } else if (pfd.revents & (POLLERR | POLLHUP)) {
+            /* eof or error */
+            eof = 1;
+            break;
+        } else {
+            return vp_stack_return_error(&_result, "poll() POLLNVAL: %d",
+                    pfd.revents);
+        }
+    }
+
+    if (!found) {
+        end = state->len;
+        if (_result_cap != 0 && end > _result_cap) {
+            end = _result_cap;
+            /* eof is reported with the rest */
+            eof = 0;
+        }
+    }
+    vp_stack_push_bin(&_result, (state->buf != NULL) ? state->buf : "", end);
+    vp_fdstate_consume(state, end);
+    vp_stack_push_num(&_result, "%d", found);
+    vp_stack_push_num(&_result, "%d", eof);
+    if (eof)
+        vp_fdstate_clear(fd);
+    else
+        vp_fdstate_shrink(fd);
+    return vp_stack_return(&_result);
+}
+
+/* monotonic clock in msec */
+static long long
+vp_now_msec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* write() all of buf to a blocking fd */
+static int
+vp_write_all(int fd, const char *buf, size_t size)
+{
+    ssize_t n;
+
+    while (size > 0) {
+        n = vp_sys_write(fd, buf, size);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/*
+ * Move output of fd to fd_to without passing it to Vim.  Only the number
+ * of bytes moved and eof are returned.  Unlike read, it keeps moving until
+ * eof, nr bytes or timeout.  Bytes queued to fd_to and bytes already read
+ * ahead into the buffer of fd go first.  On Linux the rest is moved by
+ * splice() when one of the fds is a pipe and fd_to is not O_APPEND,
+ * otherwise it is read into the buffer and written.
+ */
+const char *
+vp_file_redirect(char *args)
+{
+    VP_STATS_SCOPE(vp_file_redirect, args);
+    vp_stack_t stack;
+    int fd;
+    int fd_to;
+    int nr;
+    int timeout;
+    size_t total = 0;
+    size_t want;
+    int eof = 0;
+    int use_splice = 0;
+    unsigned long long start;
+    long long deadline;
+    int wait;
+    vp_fdstate_t *state;
+    vp_outq_t *q;
+    struct pollfd pfd = {0, POLLIN, 0};
+    ssize_t n;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd_to));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &nr));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+
+    vp_outq_flush_all();
+    /* bytes queued by vp_file_write_async() to fd_to go first */
+    q = vp_outq_get(fd_to, 0);
+    if (q != NULL && (q->len > 0 || q->error != 0)) {
+        if (vp_outq_wait(fd_to, q, timeout) == -1)
+            return vp_stack_return_error(&_result, "write() error: %s",
+                    strerror(errno));
+        if (q->len > 0) {
+            vp_stack_push_num(&_result, "%zu", total);
+            vp_stack_push_num(&_result, "%d", eof);
+            return vp_stack_return(&_result);
+        }
+    }
+
+#ifdef VP_DRAIN
+    /* the ring is moved into the buffer and fd is read directly */
+    vp_drain_unregister_fd(fd);
+#endif
+    state = vp_fdstate_get(fd, 0);
+    if (state != NULL && state->len > 0) {
+        want = (nr < 0 || state->len < (size_t)nr) ? state->len : (size_t)nr;
+        if (vp_write_all(fd_to, state->buf, want) == -1)
+            return vp_stack_return_error(&_result, "write() error: %s",
+                    strerror(errno));
+        vp_fdstate_consume(state, want);
+        total += want;
+    }
+
+#if defined __linux__
+    /* splice() refuses O_APPEND, which the buffer keeps */
+    use_splice = !(fcntl(fd_to, F_GETFL) & O_APPEND);
+#endif
+
+    pfd.fd = fd;
+    deadline = vp_now_msec() + timeout;
+    while (nr < 0 || total < (size_t)nr) {
+        wait = -1;
+        if (timeout >= 0) {
+            wait = deadline - vp_now_msec();
+            if (wait < 0)
+                wait = 0;
+        }
+        n = vp_sys_poll(&pfd, 1, wait);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return vp_stack_return_error(&_result, "poll() error: %s",
+                    strerror(errno));
+        } else if (n == 0) {
+            /* timeout */
+            break;
+        }
+        if (pfd.revents & POLLNVAL)
+            return vp_stack_return_error(&_result, "poll() POLLNVAL: %d",
+                    pfd.revents);
+
+        want = (nr < 0) ? VP_SPLICE_SIZE : (size_t)nr - total;
+        if (want > VP_SPLICE_SIZE)
+            want = VP_SPLICE_SIZE;
+#if defined __linux__
+        if (use_splice) {
+            start = VP_TRACE_NOW();
+            n = splice(fd, NULL, fd_to, NULL, want, SPLICE_F_MOVE);
+            VP_STATS_SYSCALL();
+            VP_TRACE_SYS(VP_TRACE_SPLICE, start, fd, n);
+            if (n == -1 && errno == EINVAL) {
+                /* neither is a pipe, or fd_to does not support it */
+                use_splice = 0;
+                continue;
+            }
+        } else
+#endif
+        {
+            state = vp_fdstate_get(fd, 1);
+            if (state == NULL)
+                return vp_stack_return_error(&_result, "vp_fdstate_get: NOMEM");
+            n = vp_fdstate_fill(state, fd);
+            if (n > 0) {
+                if ((size_t)n > want)
+                    n = want;
+                if (vp_write_all(fd_to, state->buf, n) == -1)
+                    return vp_stack_return_error(&_result, "write() error: %s",
+                            strerror(errno));
+                vp_fdstate_consume(state, n);
+            }
+        }
+        if (n == -1) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return vp_stack_return_error(&_result, "%s error: %s",
+                    use_splice ? "splice()" : "read()", strerror(errno));
+        } else if (n == 0) {
+            eof = 1;
+            break;
+        }
+        total += n;
+    }
+    vp_fdstate_shrink(fd);
+    vp_stack_push_num(&_result, "%zu", total);
+    vp_stack_push_num(&_result, "%d", eof);
+    return vp_stack_return(&_result);
+}
+
+/*
+ * Read many fds by one poll().  Wait until one of them is ready, then read
+ * available bytes from every ready fd.  nr limits the bytes of each fd.
+ * eof is reported after all buffered bytes of the fd are returned.
+ */
+const char *
+vp_poll_read(char *args)
+{
+    VP_STATS_SCOPE(vp_poll_read, args);
+    vp_stack_t stack;
+    int nr;
+    int timeout;
+    int nfd;
+    int fd[VP_POLL_MAX];
+    int eof[VP_POLL_MAX];
+    int idx[VP_POLL_MAX];
+    struct pollfd pfd[VP_POLL_MAX];
+    int npfd;
+    vp_fdstate_t *state;
+    size_t total;
+    size_t len;
+#ifdef VP_DRAIN
+    int drained[VP_POLL_MAX];
+    int ndrained = 0;
+    vp_ring_t *r;
+    size_t taken;
+    int got;
+#endif
+    int i;
+    int j;
+    int n;
+
+    vp_outq_flush_all();
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &nr));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &nfd));
+    if (nfd < 0 || VP_POLL_MAX < nfd)
+        return vp_stack_return_error(&_result, "nfd range error. too many fds.");
+    for (i = 0; i < nfd; ++i) {
+        VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd[i]));
+        if (fd[i] < 0)
+            return vp_stack_return_error(&_result, "invalid fd: %d", fd[i]);
+        /* allocate all states before taking pointers */
+        if ((state = vp_fdstate_get(fd[i], 1)) == NULL)
+            return vp_stack_return_error(&_result, "vp_fdstate_get: NOMEM");
+        /* bytes left by the previous read are returned without waiting */
+        if (state->len > 0)
+            timeout = 0;
+        eof[i] = 0;
+#ifdef VP_DRAIN
+        drained[i] = (vp_drain_ring(fd[i]) != NULL);
+        ndrained += drained[i];
+#endif
+    }
+
+    total = 0;
+    while (total < VP_READ_MAX) {
+        npfd = 0;
+        for (i = 0; i < nfd; ++i) {
+            if (eof[i])
+                continue;
+#ifdef VP_DRAIN
+            if (drained[i])
+                continue;
+#endif
+            pfd[npfd].fd = fd[i];
+            pfd[npfd].events = POLLIN;
+            pfd[npfd].revents = 0;
+            idx[npfd] = i;
+            ++npfd;
+        }
+#ifdef VP_DRAIN
+        if (ndrained > 0) {
+            /* take rings, and wait for the thread with other fds */
+            vp_drain_clear_notify();
+            got = 0;
+            n = 0;
+            for (i = 0; i < nfd; ++i) {
+                if (!drained[i] || eof[i])
+                    continue;
+                r = vp_drain_ring(fd[i]);
+                eof[i] = __atomic_load_n(&r->eof, __ATOMIC_ACQUIRE);
+                state = vp_fdstate_get(fd[i], 1);
+                if (vp_ring_take(fd[i], r, state, &taken) != NULL)
+                    return vp_stack_return_error(&_result,
+                            "vp_ring_take: NOMEM");
+                if (taken > 0) {
+                    eof[i] = 0;
+                    got = 1;
+                    total += taken;
+                }
+                if (!eof[i])
+                    n = 1;
+            }
+            if (got)
+                timeout = 0;
+            if (n) {
+                pfd[npfd].fd = _drain.notify[0];
+                pfd[npfd].events = POLLIN;
+                pfd[npfd].revents = 0;
+                idx[npfd] = -1;
+                ++npfd;
+            }
+        }
+#endif
+        if (npfd == 0)
+            break;
+
+        n = vp_sys_poll(pfd, npfd, timeout);
+        if (n == -1) {
+            if (errno == EINTR)
+                break;
+            return vp_stack_return_error(&_result, "poll() error: %s",
+                    strerror(errno));
+        } else if (n == 0) {
+            /* timeout */
+            break;
+        }
+        for (j = 0; j < npfd; ++j) {
+            i = idx[j];
+            if (i < 0)
+                continue;       /* notified by the drain thread */
+            if (pfd[j].revents & POLLIN) {
+                n = vp_fdstate_fill(vp_fdstate_get(fd[i], 1), fd[i]);
+                if (n == -1)
+                    return vp_stack_return_error(&_result,
+                            "read() error: %s", strerror(errno));
+                else if (n == 0)
+                    eof[i] = 1;
+                total += n;
+            } else if (pfd[j].revents & (POLLERR | POLLHUP)) {
+                /* eof or error */
+                eof[i] = 1;
+            } else if (pfd[j].revents & POLLNVAL) {
+                return vp_stack_return_error(&_result, "poll() POLLNVAL: %d",
+                        fd[i]);
+            }
+        }
+        /* try read more bytes without waiting */
+        timeout = 0;
+    }
+
+    total = 0;
+    for (i = 0; i < nfd; ++i) {
+        state = vp_fdstate_get(fd[i], 1);
+        len = (nr < 0 || (size_t)nr > state->len) ? state->len : (size_t)nr;
+        if (_result_cap != 0 && len > _result_cap - total)
+            len = _result_cap - total;
+        total += len;
+        vp_stack_push_num(&_result, "%d", fd[i]);
+        vp_stack_push_bin(&_result, state->buf, len);
+        vp_fdstate_consume(state, len);
+        if (state->len > 0)
+            eof[i] = 0;
+        vp_stack_push_num(&_result, "%d", eof[i]);
+        if (eof[i])
+            vp_fdstate_clear(fd[i]);
+        else
+            vp_fdstate_shrink(fd[i]);
+    }
+    return vp_stack_return(&_result);
+}
+
+/*
+ * pipe() whose both ends are close-on-exec and not one of 0, 1 and 2, so
+ * that a child never inherits the ends meant for another child.
+ */
+static int
+vp_pipe_cloexec(int p[2])
+{
+    int i;
+    int fd;
+
+#if defined __linux__
+    if (pipe2(p, O_CLOEXEC) < 0)
+        return -1;
+#else
+    if (pipe(p) < 0)
+        return -1;
+    fcntl(p[0], F_SETFD, FD_CLOEXEC);
+    fcntl(p[1], F_SETFD, FD_CLOEXEC);
+#endif
+    for (i = 0; i < 2; ++i) {
+        if (p[i] > STDERR_FILENO)
+            continue;
+        /* stdin, stdout or stderr of Vim was closed. */
+        fd = fcntl(p[i], F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+        if (fd < 0) {
+            close(p[0]);
+            close(p[1]);
+            return -1;
+        }
+        close(p[i]);
+        p[i] = fd;
+    }
+    return 0;
+}
+
+/* open() as vp_pipe_cloexec() */
+static int
+vp_open_cloexec(const char *path, int flags, mode_t mode)
+{
+    int fd;
+    int fd2;
+
+    if ((fd = open(path, flags | O_CLOEXEC, mode)) < 0 || fd > STDERR_FILENO)
+        return fd;
+    fd2 = fcntl(fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+    close(fd);
+    return fd2;
+}
+
+static void
+vp_pipe_close_all(int p[][2], int n)
+{
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        close(p[i][0]);
+        close(p[i][1]);
+    }
+}
+
+/*
+ * Start argv with its stdin, stdout and stderr on the given fds.  All
+ * other fds are expected to be close-on-exec.
+ * Return the name of the failed call, or NULL.
+ */
+static const char *
+vp_spawn(char **argv, int in, int out, int err, pid_t *pid)
+{
+    unsigned long long start = VP_TRACE_NOW();
+#ifdef VP_SPAWN
+    posix_spawn_file_actions_t fa;
+    int ret;
+
+    if ((ret = posix_spawn_file_actions_init(&fa)) != 0) {
+        errno = ret;
+        return "posix_spawn_file_actions_init()";
+    }
+    /* dup2() to itself does not clear close-on-exec; fds are never 0-2 */
+    posix_spawn_file_actions_adddup2(&fa, in, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, out, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, err, STDERR_FILENO);
+    ret = posix_spawn(pid, argv[0], &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    VP_TRACE_SYS(VP_TRACE_SPAWN, start, in, (ret == 0) ? *pid : -1);
+    if (ret != 0) {
+        errno = ret;
+        return "posix_spawn()";
+    }
+    return NULL;
+#else
+    *pid = fork();
+    if (*pid < 0) {
+        return "fork()";
+    } else if (*pid == 0) {
+        /* child */
+        if (dup2(in, STDIN_FILENO) != STDIN_FILENO
+                || dup2(out, STDOUT_FILENO) != STDOUT_FILENO
+                || dup2(err, STDERR_FILENO) != STDERR_FILENO) {
+            write(out, strerror(errno), strlen(strerror(errno)));
+            _exit(EXIT_FAILURE);
+        }
+        execv(argv[0], argv);
+        /* error */
+        write(STDOUT_FILENO, strerror(errno), strlen(strerror(errno)));
+        _exit(EXIT_FAILURE);
+    }
+    VP_TRACE_SYS(VP_TRACE_SPAWN, start, in, *pid);
+    return NULL;
+#endif
+}
+
+/*
+ * Start argv with pipes.  The parent's ends are returned in fd: fd[0] is
+ * stdin, fd[1] is stdout and fd[2] is stderr of the child.  If npipe is
+ * 2, stderr is redirected to stdout and fd[2] is -1.
+ * Return the name of the failed call, or NULL.
+ */
+static const char *
+vp_pipe_exec(char **argv, int npipe, int fd[3], pid_t *pid)
+{
+    int p[3][2];
+    const char *errfunc;
+    int err;
+    int i;
+
+    for (i = 0; i < npipe; ++i) {
+        if (vp_pipe_cloexec(p[i]) < 0) {
+            err = errno;
+            vp_pipe_close_all(p, i);
+            errno = err;
+            return "pipe()";
+        }
+    }
+
+    errfunc = vp_spawn(argv, p[0][0], p[1][1],
+            (npipe == 3) ? p[2][1] : p[1][1], pid);
+    if (errfunc != NULL) {
+        err = errno;
+        vp_pipe_close_all(p, npipe);
+        errno = err;
+        return errfunc;
+    }
+
+    /* parent */
+    close(p[0][0]);
+    close(p[1][1]);
+    fd[0] = p[0][1];
+    fd[1] = p[1][0];
+    fd[2] = -1;
+    if (npipe == 3) {
+        close(p[2][1]);
+        fd[2] = p[2][0];
+    }
+    return NULL;
+}
+
+/* push [cond, status] of waitpid() */
+static const char *
+vp_push_status(int status)
+{
+    if (WIFCONTINUED(status)) {
+        vp_stack_push_str(&_result, "run");
+        vp_stack_push_num(&_result, "%d", 0);
+    } else if (WIFEXITED(status)) {
+        vp_stack_push_str(&_result, "exit");
+        vp_stack_push_num(&_result, "%d", WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+        vp_stack_push_str(&_result, "signal");
+        vp_stack_push_num(&_result, "%d", WTERMSIG(status));
+    } else if (WIFSTOPPED(status)) {
+        vp_stack_push_str(&_result, "stop");
+        vp_stack_push_num(&_result, "%d", WSTOPSIG(status));
+    } else {
+        return vp_stack_return_error(&_result,
+                "waitpid() unknown status: status=%d", status);
+    }
+    return NULL;
+}
+
+/*
+ * Job table.  A job is what one vp_pipe_open(), vp_pipeline_open() or
+ * vp_pty_open() started: its fds, the pid whose status is the job's, and
+ * the start and exit time.  Output stays in the buffers of the fds, so
+ * vp_job_status_all() returns the state of every job in one call.  A job
+ * is removed when it has exited and all of its fds are closed.
+ */
+typedef struct {
+    int id;
+    pid_t pid;
+    int *fd;            /* -1 once closed */
+    int nfd;
+    int done;
+    int status;
+    long long start;    /* msec */
+    long long end;
+} vp_job_t;
+
+static struct {
+    vp_job_t *list;
+    int n;
+    int size;
+    int lastid;
+} _job = {NULL, 0, 0, 0};
+
+static void
+vp_job_remove(int i)
+{
+    free(_job.list[i].fd);
+    _job.list[i] = _job.list[--_job.n];
+}
+
+/* 0 if no memory; the children run without a job. */
+static int
+vp_job_new(pid_t pid, const int *fd, int nfd)
+{
+    vp_job_t *job;
+    int *fdcopy;
+
+    if (_job.n == _job.size) {
+        int newsize = (_job.size == 0) ? 16 : _job.size * 2;
+        vp_job_t *newlist = (vp_job_t *)realloc(_job.list,
+                sizeof(vp_job_t) * newsize);
+
+        if (newlist == NULL)
+            return 0;
+        _job.list = newlist;
+        _job.size = newsize;
+    }
+    fdcopy = (int *)malloc(sizeof(int) * nfd);
+    if (fdcopy == NULL)
+        return 0;
+    memcpy(fdcopy, fd, sizeof(int) * nfd);
+    job = &_job.list[_job.n++];
+    job->id = ++_job.lastid;
+    job->pid = pid;
+    job->fd = fdcopy;
+    job->nfd = nfd;
+    job->done = 0;
+    job->status = 0;
+    job->start = vp_now_msec();
+    job->end = 0;
+    return job->id;
+}
+
+/* remove the job at i if it is finished */
+static int
+vp_job_finished(int i)
+{
+    vp_job_t *job = &_job.list[i];
+    int j;
+
+    if (!job->done)
+        return 0;
+    for (j = 0; j < job->nfd; ++j) {
+        if (job->fd[j] != -1)
+            return 0;
+    }
+    vp_job_remove(i);
+    return 1;
+}
+
+/* called once the final status of pid is known */
+static void
+vp_job_exited(pid_t pid, int status)
+{
+    int i;
+
+    for (i = 0; i < _job.n; ++i) {
+        if (_job.list[i].pid == pid && !_job.list[i].done) {
+            _job.list[i].done = 1;
+            _job.list[i].status = status;
+            _job.list[i].end = vp_now_msec();
+            vp_job_finished(i);
+            return;
+        }
+    }
+}
+
+static void
+vp_job_forget_fd(int fd)
+{
+    int i;
+    int j;
+
+    for (i = 0; i < _job.n; ++i) {
+        for (j = 0; j < _job.list[i].nfd; ++j) {
+            if (_job.list[i].fd[j] == fd) {
+                _job.list[i].fd[j] = -1;
+                vp_job_finished(i);
+                return;
+            }
+        }
+    }
+}
+
+static void
+vp_job_clear(void)
+{
+    while (_job.n > 0)
+        vp_job_remove(_job.n - 1);
+    free(_job.list);
+    _job.list = NULL;
+    _job.size = 0;
+}
+
+/*
+ * Children started by vp_pipe_open(), vp_pipeline_open() and vp_pty_open().
+ * vp_reap_all() reaps the exited ones at once, and the status is kept
+ * until vp_waitpid() asks for it.  On Linux the exits are found by one
+ * poll() of pidfds, elsewhere each child is probed by waitpid().  SIGCHLD
+ * is not used because its handler belongs to Vim.
+ */
+typedef struct {
+    pid_t pid;
+    int pidfd;          /* -1 if not available */
+    int reaped;
+    int reported;       /* returned by vp_reap_all() */
+    int status;
+} vp_child_t;
+
+static struct {
+    vp_child_t *list;
+    int n;
+    int size;
+} _child = {NULL, 0, 0};
+
+static int
+vp_child_index(pid_t pid)
+{
+    int i;
+
+    for (i = 0; i < _child.n; ++i) {
+        if (_child.list[i].pid == pid)
+            return i;
+    }
+    return -1;
+}
+
+static void
+vp_child_remove(int i)
+{
+    if (_child.list[i].pidfd != -1)
+        close(_child.list[i].pidfd);
+    _child.list[i] = _child.list[--_child.n];
+}
+
+/* An untracked child can still be waited by vp_waitpid(). */
+static void
+vp_child_track(pid_t pid)
+{
+    vp_child_t *c;
+    int i;
+
+    /* the pid of a former child which was not waited is reused */
+    if ((i = vp_child_index(pid)) >= 0)
+        vp_child_remove(i);
+    if (_child.n == _child.size) {
+        int newsize = (_child.size == 0) ? 16 : _child.size * 2;
+        vp_child_t *newlist = (vp_child_t *)realloc(_child.list,
+                sizeof(vp_child_t) * newsize);
+
+        if (newlist == NULL)
+            return;
+        _child.list = newlist;
+        _child.size = newsize;
+    }
+    c = &_child.list[_child.n++];
+    c->pid = pid;
+    c->pidfd = -1;
+#ifdef VP_PIDFD
+    /* close-on-exec by default */
+    c->pidfd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+    c->reaped = 0;
+    c->reported = 0;
+    c->status = 0;
+}
+
+/* 1 if c has exited.  c is removed if it was reaped by someone else. */
+static int
+vp_child_reap(int i)
+{
+    vp_child_t *c = &_child.list[i];
+    int status;
+    pid_t n;
+
+    if (c->reaped)
+        return 1;
+    n = vp_sys_waitpid(c->pid, &status, WNOHANG);
+    if (n == -1 && errno == ECHILD) {
+        vp_child_remove(i);
+        return 0;
+    }
+    if (n != c->pid)
+        return 0;
+    c->reaped = 1;
+    c->status = status;
+    if (c->pidfd != -1) {
+        close(c->pidfd);
+        c->pidfd = -1;
+    }
+    vp_job_exited(c->pid, status);
+    return 1;
+}
+
+/*
+ * Reap every exited child.  A child removed by vp_child_reap() moves the
+ * last one before i, which is checked by the next call.
+ */
+static void
+vp_child_poll(void)
+{
+    struct pollfd pfd[VP_POLL_MAX];
+    pid_t pid[VP_POLL_MAX];
+    int npfd;
+    int i = 0;
+    int j;
+
+    while (i < _child.n) {
+        npfd = 0;
+        for (; i < _child.n && npfd < VP_POLL_MAX; ++i) {
+            if (_child.list[i].reaped)
+                continue;
+            /* poll() ignores -1, and the child is probed by waitpid() */
+            pfd[npfd].fd = _child.list[i].pidfd;
+            pfd[npfd].events = POLLIN;
+            pfd[npfd].revents = 0;
+            pid[npfd++] = _child.list[i].pid;
+        }
+        /* a pidfd is readable when the child has exited */
+        if (npfd == 0 || vp_sys_poll(pfd, npfd, 0) == -1)
+            continue;
+        for (j = 0; j < npfd; ++j) {
+            if ((pfd[j].fd == -1 || pfd[j].revents != 0)
+                    && vp_child_index(pid[j]) >= 0)
+                vp_child_reap(vp_child_index(pid[j]));
+        }
+    }
+}
+
+static void
+vp_child_clear(void)
+{
+    while (_child.n > 0)
+        vp_child_remove(_child.n - 1);
+    free(_child.list);
+    _child.list = NULL;
+    _child.size = 0;
+}
+
+const char *
+vp_pipe_open(char *args)
+{
+    VP_STATS_SCOPE(vp_pipe_open, args);
+    vp_stack_t stack;
+    int npipe;
+    int argc;
+    char *argv[VP_ARGC_MAX];
+    int fd[3];
+    pid_t pid;
+    const char *errfunc;
+    int i;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &npipe));
+    if (npipe != 2 && npipe != 3)
+        return vp_stack_return_error(&_result, "npipe range error. wrong pipes.");
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &argc));
+    if (argc < 1 || VP_ARGC_MAX <= argc)
+        return vp_stack_return_error(&_result, "argc range error. too many arguments. please use xargs.");
+    for (i = 0; i < argc; ++i)
+        VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &(argv[i])));
+    argv[argc] = NULL;
+
+    errfunc = vp_pipe_exec(argv, npipe, fd, &pid);
+    if (errfunc != NULL)
+        return vp_stack_return_error(&_result, "%s error: %s", errfunc,
+                strerror(errno));
+    vp_child_track(pid);
+
+    vp_stack_push_num(&_result, "%d", pid);
+    vp_stack_push_num(&_result, "%d", fd[0]);
+    vp_stack_push_num(&_result, "%d", fd[1]);
+    if (npipe == 3)
+        vp_stack_push_num(&_result, "%d", fd[2]);
+    vp_stack_push_num(&_result, "%d", vp_job_new(pid, fd, npipe));
+    return vp_stack_return(&_result);
+}
+
+/*
+ * Start a pipeline.  Stage i's stdout is connected to stage i+1's stdin
+ * by a pipe in the kernel, so the data between the stages never passes
+ * through Vim.  Only stdin of the first stage, stdout of the last stage
+ * and stderr of every stage are returned.  If npipe is 2, the stderr of
+ * each stage goes to its stdout and no stderr is returned.
+ */
+const char *
+vp_pipeline_open(char *args)
+{
+    VP_STATS_SCOPE(vp_pipeline_open, args);
+    vp_stack_t stack;
+    int npipe;
+    int nstage;
+    int argc;
+    char *argv[VP_ARGC_MAX];
+    int start[VP_PIPELINE_MAX];
+    pid_t pid[VP_PIPELINE_MAX];
+    int fd_err[VP_PIPELINE_MAX + 2];    /* + fd_stdin, fd_stdout */
+    int fd_in;
+    int fd_out;
+    int in;                     /* stdin of the current stage */
+    int out[2];
+    int err[2];
+    const char *errfunc = NULL;
+    int n;
+    int i;
+    int j;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &npipe));
+    if (npipe != 2 && npipe != 3)
+        return vp_stack_return_error(&_result, "npipe range error. wrong pipes.");
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &nstage));
+    if (nstage < 1 || VP_PIPELINE_MAX < nstage)
+        return vp_stack_return_error(&_result, "nstage range error. too many commands.");
+    n = 0;
+    for (i = 0; i < nstage; ++i) {
+        VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &argc));
+        if (argc < 1 || VP_ARGC_MAX <= n + argc)
+            return vp_stack_return_error(&_result, "argc range error. too many arguments. please use xargs.");
+        start[i] = n;
+        for (j = 0; j < argc; ++j)
+            VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &(argv[n++])));
+        argv[n++] = NULL;
+    }
+
+    if (vp_pipe_cloexec(out) < 0)
+        return vp_stack_return_error(&_result, "pipe() error: %s",
+                strerror(errno));
+    in = out[0];
+    fd_in = out[1];
+    for (i = 0; i < nstage; ++i) {
+        fd_err[i] = -1;
+        if (vp_pipe_cloexec(out) < 0) {
+            errfunc = "pipe()";
+            break;
+        }
+        if (npipe == 3 && vp_pipe_cloexec(err) < 0) {
+            errfunc = "pipe()";
+            close(out[0]);
+            close(out[1]);
+            break;
+        }
+        errfunc = vp_spawn(argv + start[i], in, out[1],
+                (npipe == 3) ? err[1] : out[1], &pid[i]);
+        close(in);
+        close(out[1]);
+        if (npipe == 3) {
+            close(err[1]);
+            fd_err[i] = err[0];
+        }
+        in = out[0];
+        if (errfunc != NULL)
+            break;
+    }
+    if (errfunc != NULL) {
+        int e = errno;
+
+        /* stop the stages already started. */
+        for (j = 0; j < i; ++j) {
+            kill(pid[j], SIGKILL);
+            vp_sys_waitpid(pid[j], NULL, 0);
+        }
+        for (j = 0; j <= i && j < nstage; ++j) {
+            if (fd_err[j] != -1)
+                close(fd_err[j]);
+        }
+        close(in);
+        close(fd_in);
+        return vp_stack_return_error(&_result, "%s error: %s", errfunc,
+                strerror(e));
+    }
+    fd_out = in;
+
+    for (i = 0; i < nstage; ++i) {
+        vp_child_track(pid[i]);
+        vp_stack_push_num(&_result, "%d", pid[i]);
+    }
+    vp_stack_push_num(&_result, "%d", fd_in);
+    vp_stack_push_num(&_result, "%d", fd_out);
+    if (npipe == 3) {
+        for (i = 0; i < nstage; ++i)
+            vp_stack_push_num(&_result, "%d", fd_err[i]);
+    }
+    /* the job owns fd_err, fd_stdin and fd_stdout */
+    fd_err[nstage] = fd_in;
+    fd_err[nstage + 1] = fd_out;
+    n = (npipe == 3) ? 0 : nstage;
+    vp_stack_push_num(&_result, "%d",
+            vp_job_new(pid[nstage - 1], fd_err + n, nstage + 2 - n));
+    return vp_stack_return(&_result);
+}
+
+const char *
+vp_pipe_close(char *args)
+{
+    VP_STATS_SCOPE(vp_pipe_close, args);
+    return vp_file_close(args);
+}
+
+const char *
+vp_pipe_read(char *args)
+{
+    VP_STATS_SCOPE(vp_pipe_read, args);
+    return vp_file_read(args);
+}
+
+const char *
+vp_pipe_write(char *args)
+{
+    VP_STATS_SCOPE(vp_pipe_write, args);
+    return vp_file_write(args);
+}
+
+const char *
+vp_pipe_write_async(char *args)
+{
+    VP_STATS_SCOPE(vp_pipe_write_async, args);
+    return vp_file_write_async(args);
+}
+
+const char *
+vp_pipe_flush(char *args)
+{
+    VP_STATS_SCOPE(vp_pipe_flush, args);
+    return vp_file_flush(args);
+}
+
+const char *
+vp_pipe_read_records(char *args)
+{
+    VP_STATS_SCOPE(vp_pipe_read_records, args);
+    return vp_file_read_records(args);
+}
+
+const char *
+vp_pipe_read_ansi(char *args)
+{
+    VP_STATS_SCOPE(vp_pipe_read_ansi, args);
+    return vp_file_read_ansi(args);
+}
+
+const char *
+vp_pipe_read_until(char *args)
+{
+    VP_STATS_SCOPE(vp_pipe_read_until, args);
+    return vp_file_read_until(args);
+}
+
+const char *
+vp_pipe_redirect(char *args)
+{
+    VP_STATS_SCOPE(vp_pipe_redirect, args);
+    return vp_file_redirect(args);
+}
+
+/* signal to send when the deadline of vp_system() expires */
+static int
+vp_system_escalate(pid_t pid, int sig)
+{
+    sig = (sig == 0) ? SIGTERM : SIGKILL;
+    kill(pid, sig);
+    return sig;
+}
+
+static void
+vp_system_close(int fd[3])
+{
+    int i;
+
+    for (i = 0; i < 3; ++i) {
+        if (fd[i] != -1) {
+            vp_fdstate_clear(fd[i]);
+            close(fd[i]);
+            fd[i] = -1;
+        }
+    }
+}
+
+/*
+ * Feed input to fd[0] while fd[1] and fd[2] are read, and wait for pid.
+ * An fd which is -1 is not used, and its output is empty.  The fds are
+ * closed.  Returns [hd_out, hd_err, cond, status] as vp_system().
+ */
+static const char *
+vp_system_wait(pid_t pid, int fd[3], const char *input, size_t size,
+        int timeout)
+{
+    size_t nwritten;
+    int eof[3];
+    struct pollfd pfd[3];
+    int idx[3];
+    int npfd;
+    long long deadline = 0;
+    long long now;
+    int wait;
+    int sig = 0;
+    int status;
+    int reaped = 0;
+    vp_fdstate_t *state;
+    int i;
+    int n;
+
+    if ((fd[1] != -1 && vp_fdstate_get(fd[1], 1) == NULL)
+            || (fd[2] != -1 && vp_fdstate_get(fd[2], 1) == NULL)) {
+        kill(pid, SIGKILL);
+        vp_sys_waitpid(pid, &status, 0);
+        vp_system_close(fd);
+        return vp_stack_return_error(&_result, "vp_fdstate_get: NOMEM");
+    }
+    if (fd[0] != -1)
+        fcntl(fd[0], F_SETFL, fcntl(fd[0], F_GETFL) | O_NONBLOCK);
+    nwritten = 0;
+    eof[0] = (size == 0);
+    eof[1] = (fd[1] == -1);
+    eof[2] = (fd[2] == -1);
+    if (timeout > 0)
+        deadline = vp_now_msec() + timeout;
+
+    while (!eof[1] || !eof[2]) {
+        if (eof[0] && fd[0] != -1) {
+            /* send eof to stdin */
+            close(fd[0]);
+            fd[0] = -1;
+        }
+
+        wait = -1;
+        if (deadline != 0) {
+            now = vp_now_msec();
+            if (now >= deadline) {
+                if (sig == SIGKILL)
+                    /* pipes are kept open by the other process. */
+                    break;
+                sig = vp_system_escalate(pid, sig);
+                deadline = now + VP_KILL_GRACE;
+            }
+            wait = deadline - now;
+        }
+        if (sig != 0) {
+            /* the pipes may be held by grandchildren; stop reading once
+             * the process itself has gone. */
+            if (vp_sys_waitpid(pid, &status, WNOHANG) == pid) {
+                reaped = 1;
+                break;
+            }
+            if (wait > 50)
+                wait = 50;
+        }
+
+        npfd = 0;
+        for (i = 0; i < 3; ++i) {
+            if (eof[i])
+                continue;
+            pfd[npfd].fd = fd[i];
+            pfd[npfd].events = (i == 0) ? POLLOUT : POLLIN;
+            pfd[npfd].revents = 0;
+            idx[npfd] = i;
+            ++npfd;
+        }
+        n = vp_sys_poll(pfd, npfd, wait);
         if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            kill(pid, SIGKILL);
+            vp_sys_waitpid(pid, &status, 0);
+            vp_system_close(fd);
             return vp_stack_return_error(&_result, "poll() error: %s",
                     strerror(errno));
-        } else if (n == 0) {
-            /* timeout */
-            break;
         }
-        if (pfd.revents & POLLOUT) {
-            n = write(fd, buf + nleft, size - nleft);
-            if (n == -1) {
-                return vp_stack_return_error(&_result, "write() error: %s",
-                        strerror(errno));
+
+        for (i = 0; i < npfd; ++i) {
+            if (pfd[i].revents == 0)
+                continue;
+            if (idx[i] == 0) {
+                if (pfd[i].revents & POLLOUT) {
+                    n = vp_sys_write(fd[0], input + nwritten, size - nwritten);
+                    if (n > 0)
+                        nwritten += n;
+                    /* EPIPE: the process does not read stdin. */
+                    if ((n == -1 && errno != EAGAIN) || nwritten == size)
+                        eof[0] = 1;
+                } else {
+                    eof[0] = 1;
+                }
+            } else if (pfd[i].revents & POLLIN) {
+                state = vp_fdstate_get(fd[idx[i]], 1);
+                if (vp_fdstate_fill(state, fd[idx[i]]) <= 0)
+                    eof[idx[i]] = 1;
+            } else {
+                /* POLLERR, POLLHUP or POLLNVAL */
+                eof[idx[i]] = 1;
             }
-            nleft += n;
-            /* try write more bytes without waiting */
-            timeout = 0;
+        }
+    }
+    if (fd[0] != -1) {
+        close(fd[0]);
+        fd[0] = -1;
+    }
+
+    /* reap the process.  it has closed stdout and stderr. */
+    wait = 1;
+    n = pid;
+    while (!reaped
+            && (n = vp_sys_waitpid(pid, &status, (deadline != 0) ? WNOHANG : 0)) == 0) {
+        now = vp_now_msec();
+        if (now >= deadline) {
+            sig = vp_system_escalate(pid, sig);
+            deadline = now + VP_KILL_GRACE;
+        }
+        vp_sys_poll(NULL, 0, wait);
+        if (wait < 50)
+            wait *= 2;
+    }
+
+    for (i = 1; i < 3; ++i) {
+        if (fd[i] == -1) {
+            vp_stack_push_str(&_result, "");
             continue;
-        } else if (pfd.revents & (POLLERR | POLLHUP)) {
-            /* eof or error */
-            break;
-        } else if (pfd.revents & POLLNVAL) {
-            return vp_stack_return_error(&_result, "poll() POLLNVAL: %d",
-                    pfd.revents);
         }
-        /* DO NOT REACH HERE */
-        return vp_stack_return_error(&_result, "poll() unknown status: %s",
-                pfd.revents);
+        state = vp_fdstate_get(fd[i], 1);
+        vp_stack_push_bin(&_result, state->buf, state->len);
     }
-    vp_stack_push_num(&_result, "%zu", nleft);
+    vp_system_close(fd);
+    if (n == -1)
+        return vp_stack_return_error(&_result, "waitpid() error: %s",
+                strerror(errno));
+    if (sig != 0) {
+        vp_stack_push_str(&_result, "timeout");
+        vp_stack_push_num(&_result, "%d",
+                WIFSIGNALED(status) ? WTERMSIG(status) : sig);
+    } else {
+        VP_RETURN_IF_FAIL(vp_push_status(status));
+    }
+    return vp_stack_return(&_result);
+}
+
+/*
+ * Run argv and wait for it in one call.  Input is written to stdin while
+ * stdout and stderr are read, so a large input does not deadlock.  If
+ * timeout (msec) is positive and expires, the process gets SIGTERM, and
+ * SIGKILL after VP_KILL_GRACE, and cond is "timeout".
+ */
+const char *
+vp_system(char *args)
+{
+    VP_STATS_SCOPE(vp_system, args);
+    vp_stack_t stack;
+    char *input;
+    size_t size;
+    int timeout;
+    int argc;
+    char *argv[VP_ARGC_MAX];
+    int fd[3];
+    pid_t pid;
+    const char *errfunc;
+    int i;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_bin(&stack, &input, &size));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &argc));
+    if (argc < 1 || VP_ARGC_MAX <= argc)
+        return vp_stack_return_error(&_result, "argc range error. too many arguments. please use xargs.");
+    for (i = 0; i < argc; ++i)
+        VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &(argv[i])));
+    argv[argc] = NULL;
+
+    errfunc = vp_pipe_exec(argv, 3, fd, &pid);
+    if (errfunc != NULL)
+        return vp_stack_return_error(&_result, "%s error: %s", errfunc,
+                strerror(errno));
+    return vp_system_wait(pid, fd, input, size, timeout);
+}
+
+/*
+ * Filter the file path_in by argv into the file path_out.  The files are
+ * stdin and stdout of the process, so it reads and writes them at its own
+ * pace and neither side can block the other; only stderr passes through
+ * Vim.  The result is the same as vp_system() with empty hd_out.
+ */
+const char *
+vp_filter(char *args)
+{
+    VP_STATS_SCOPE(vp_filter, args);
+    vp_stack_t stack;
+    char *path_in;
+    char *path_out;
+    int timeout;
+    int argc;
+    char *argv[VP_ARGC_MAX];
+    int in;
+    int out;
+    int err[2];
+    int fd[3] = {-1, -1, -1};
+    pid_t pid;
+    const char *errfunc;
+    int i;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &path_in));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &path_out));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &argc));
+    if (argc < 1 || VP_ARGC_MAX <= argc)
+        return vp_stack_return_error(&_result, "argc range error. too many arguments. please use xargs.");
+    for (i = 0; i < argc; ++i)
+        VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &(argv[i])));
+    argv[argc] = NULL;
+
+    if ((in = vp_open_cloexec(path_in, O_RDONLY, 0)) == -1)
+        return vp_stack_return_error(&_result, "open() error: %s: %s",
+                path_in, strerror(errno));
+    if ((out = vp_open_cloexec(path_out, O_WRONLY | O_CREAT | O_TRUNC,
+                    0600)) == -1) {
+        close(in);
+        return vp_stack_return_error(&_result, "open() error: %s: %s",
+                path_out, strerror(errno));
+    }
+    if (vp_pipe_cloexec(err) < 0) {
+        close(in);
+        close(out);
+        return vp_stack_return_error(&_result, "pipe() error: %s",
+                strerror(errno));
+    }
+
+    errfunc = vp_spawn(argv, in, out, err[1], &pid);
+    close(in);
+    close(out);
+    close(err[1]);
+    if (errfunc != NULL) {
+        close(err[0]);
+        return vp_stack_return_error(&_result, "%s error: %s", errfunc,
+                strerror(errno));
+    }
+    fd[2] = err[0];
+    return vp_system_wait(pid, fd, NULL, 0, timeout);
+}
+
+/*
+ * Line discipline of a pty: "cooked" is the default of the system (and
+ * turns the others back), "noecho" does not echo the input back, and "raw"
+ * passes every byte through as is.  Without echo, what Vim writes is not
+ * read back again.  fd is the master or the slave; the termios is taken
+ * from the pty itself, so Vim needs no terminal.
+ */
+#define VP_PTY_COOKED   0
+#define VP_PTY_NOECHO   1
+#define VP_PTY_RAW      2
+
+static int
+vp_pty_mode(const char *name)
+{
+    if (strcmp(name, "cooked") == 0)
+        return VP_PTY_COOKED;
+    else if (strcmp(name, "noecho") == 0)
+        return VP_PTY_NOECHO;
+    else if (strcmp(name, "raw") == 0)
+        return VP_PTY_RAW;
+    return -1;
+}
+
+static int
+vp_pty_setmode(int fd, int mode)
+{
+    struct termios ti;
+
+    if (tcgetattr(fd, &ti) < 0)
+        return -1;
+    switch (mode) {
+    case VP_PTY_COOKED:
+        ti.c_iflag |= ICRNL | IXON;
+        ti.c_oflag |= OPOST;
+        ti.c_lflag |= ECHO | ICANON | ISIG | IEXTEN;
+        break;
+    case VP_PTY_NOECHO:
+        ti.c_iflag |= ICRNL | IXON;
+        ti.c_oflag |= OPOST;
+        ti.c_lflag |= ICANON | ISIG | IEXTEN;
+        ti.c_lflag &= ~(ECHO | ECHONL);
+        break;
+    case VP_PTY_RAW:
+        ti.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP
+                | INLCR | IGNCR | ICRNL | IXON);
+        ti.c_oflag &= ~OPOST;
+        ti.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+        ti.c_cflag &= ~(CSIZE | PARENB);
+        ti.c_cflag |= CS8;
+        ti.c_cc[VMIN] = 1;
+        ti.c_cc[VTIME] = 0;
+        break;
+    }
+    return tcsetattr(fd, TCSANOW, &ti);
+}
+
+#ifdef VP_SPAWN_PTY
+/*
+ * forkpty() without fork().  The child becomes a session leader and opens
+ * the slave, which makes it the controlling terminal.
+ * Return the name of the failed call, or NULL.
+ */
+static const char *
+vp_pty_spawn(char **argv, struct winsize *ws, int mode, int *fdm, pid_t *pid)
+{
+    char name[64];
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t fa;
+    const char *errfunc = NULL;
+    int fd;
+    int ret;
+
+    fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0)
+        return "posix_openpt()";
+    if (grantpt(fd) < 0) {
+        errfunc = "grantpt()";
+    } else if (unlockpt(fd) < 0) {
+        errfunc = "unlockpt()";
+    } else if ((ret = ptsname_r(fd, name, sizeof(name))) != 0) {
+        errno = ret;
+        errfunc = "ptsname_r()";
+    } else if (ioctl(fd, TIOCSWINSZ, ws) < 0) {
+        errfunc = "ioctl()";
+    } else if (mode != VP_PTY_COOKED && vp_pty_setmode(fd, mode) < 0) {
+        errfunc = "tcsetattr()";
+    }
+    if (errfunc != NULL) {
+        ret = errno;
+        close(fd);
+        errno = ret;
+        return errfunc;
+    }
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, name, O_RDWR, 0);
+    posix_spawn_file_actions_adddup2(&fa, STDIN_FILENO, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, STDIN_FILENO, STDERR_FILENO);
+    ret = posix_spawn(pid, argv[0], &fa, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    if (ret != 0) {
+        close(fd);
+        errno = ret;
+        return "posix_spawn()";
+    }
+    *fdm = fd;
+    return NULL;
+}
+#endif
+
+const char *
+vp_pty_open(char *args)
+{
+    VP_STATS_SCOPE(vp_pty_open, args);
+    vp_stack_t stack;
+    int argc;
+    char *argv[VP_ARGC_MAX];
+    int fdm;
+    pid_t pid;
+    struct winsize ws = {0, 0, 0, 0};
+    char *modename;
+    int mode;
+#ifdef VP_SPAWN_PTY
+    const char *errfunc;
+#endif
+    unsigned long long start;
+    int i;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%hu", &(ws.ws_col)));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%hu", &(ws.ws_row)));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &modename));
+    if ((mode = vp_pty_mode(modename)) < 0)
+        return vp_stack_return_error(&_result, "unknown pty mode: %s",
+                modename);
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &argc));
+    if (argc < 1 || VP_ARGC_MAX <= argc)
+        return vp_stack_return_error(&_result, "argc range error. too many arguments. please use xargs.");
+    for (i = 0; i < argc; ++i)
+        VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &(argv[i])));
+    argv[argc] = NULL;
+
+    /*
+     * The termios of Vim's terminal is not used: gvim started from a menu
+     * has none.  The mode is set on the new pty instead.
+     */
+    start = VP_TRACE_NOW();
+#ifdef VP_SPAWN_PTY
+    errfunc = vp_pty_spawn(argv, &ws, mode, &fdm, &pid);
+    if (errfunc != NULL)
+        return vp_stack_return_error(&_result, "%s error: %s", errfunc,
+                strerror(errno));
+#else
+    pid = forkpty(&fdm, NULL, NULL, &ws);
+#endif
+    
+    if (pid < 0) {
+        return vp_stack_return_error(&_result, "forkpty() error: %s",
+                strerror(errno));
+    } else if (pid == 0) {
+        /* child */
+        if ((mode != VP_PTY_COOKED && vp_pty_setmode(STDIN_FILENO, mode) < 0)
+                || execv(argv[0], argv) < 0) {
+            /* error */
+            write(fdm, strerror(errno), strlen(strerror(errno)));
+            _exit(EXIT_FAILURE);
+        }
+    } else {
+        /* parent */
+        VP_TRACE_SYS(VP_TRACE_SPAWN, start, fdm, pid);
+        vp_child_track(pid);
+#ifndef VP_SPAWN_PTY
+        /* the child may not have set it yet when Vim writes */
+        if (mode != VP_PTY_COOKED)
+            vp_pty_setmode(fdm, mode);
+#endif
+        vp_stack_push_num(&_result, "%d", pid);
+        vp_stack_push_num(&_result, "%d", fdm);
+        /* XXX - ttyname(fdm) breaks in OS X */
+        vp_stack_push_str(&_result, "unused");
+        vp_stack_push_num(&_result, "%d", vp_job_new(pid, &fdm, 1));
+        return vp_stack_return(&_result);
+    }
+    /* DO NOT REACH HERE */
+    return NULL;
+}
+
+const char *
+vp_pty_close(char *args)
+{
+    VP_STATS_SCOPE(vp_pty_close, args);
+    return vp_file_close(args);
+}
+
+const char *
+vp_pty_read(char *args)
+{
+    VP_STATS_SCOPE(vp_pty_read, args);
+    return vp_file_read(args);
+}
+
+const char *
+vp_pty_write(char *args)
+{
+    VP_STATS_SCOPE(vp_pty_write, args);
+    return vp_file_write(args);
+}
+
+const char *
+vp_pty_write_async(char *args)
+{
+    VP_STATS_SCOPE(vp_pty_write_async, args);
+    return vp_file_write_async(args);
+}
+
+const char *
+vp_pty_flush(char *args)
+{
+    VP_STATS_SCOPE(vp_pty_flush, args);
+    return vp_file_flush(args);
+}
+
+const char *
+vp_pty_read_records(char *args)
+{
+    VP_STATS_SCOPE(vp_pty_read_records, args);
+    return vp_file_read_records(args);
+}
+
+const char *
+vp_pty_read_ansi(char *args)
+{
+    VP_STATS_SCOPE(vp_pty_read_ansi, args);
+    return vp_file_read_ansi(args);
+}
+
+const char *
+vp_pty_read_until(char *args)
+{
+    VP_STATS_SCOPE(vp_pty_read_until, args);
+    return vp_file_read_until(args);
+}
+
+const char *
+vp_pty_get_winsize(char *args)
+{
+    VP_STATS_SCOPE(vp_pty_get_winsize, args);
+    vp_stack_t stack;
+    int fd;
+    struct winsize ws = {0, 0, 0, 0};
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+
+    if (ioctl(fd, TIOCGWINSZ, &ws) < 0)
+        return vp_stack_return_error(&_result, "ioctl() error: %s",
+                strerror(errno));
+    vp_stack_push_num(&_result, "%hu", ws.ws_col);
+    vp_stack_push_num(&_result, "%hu", ws.ws_row);
     return vp_stack_return(&_result);
 }
+const char *
+vp_pty_set_winsize(char *args)
+{
+    VP_STATS_SCOPE(vp_pty_set_winsize, args);
+    vp_stack_t stack;
+    int fd;
+    struct winsize ws = {0, 0, 0, 0};
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%hu", &(ws.ws_col)));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%hu", &(ws.ws_row)));
+
+    if (ioctl(fd, TIOCSWINSZ, &ws) < 0)
+        return vp_stack_return_error(&_result, "ioctl() error: %s",
+                strerror(errno));
+    return NULL;
+}
 
 const char *
-vp_pipe_open(char *args)
+vp_pty_set_mode(char *args)
 {
+    VP_STATS_SCOPE(vp_pty_set_mode, args);
+    vp_stack_t stack;
+    int fd;
+    char *modename;
+    int mode;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &modename));
+
+    if ((mode = vp_pty_mode(modename)) < 0)
+        return vp_stack_return_error(&_result, "unknown pty mode: %s",
+                modename);
+    if (vp_pty_setmode(fd, mode) < 0)
+        return vp_stack_return_error(&_result, "tcsetattr() error: %s",
+                strerror(errno));
+    return NULL;
+}
+
+const char *
+vp_kill(char *args)
+{
+    VP_STATS_SCOPE(vp_kill, args);
     vp_stack_t stack;
-    int npipe;
-    int argc;
-    char *argv[VP_ARGC_MAX];
-    int fd[3][2];
     pid_t pid;
-    int i;
+    int sig;
 
     VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &npipe));
-    if (npipe != 2 && npipe != 3)
-        return vp_stack_return_error(&_result, "npipe range error. wrong pipes.");
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &argc));
-    if (argc < 1 || VP_ARGC_MAX <= argc)
-        return vp_stack_return_error(&_result, "argc range error. too many arguments. please use xargs.");
-    for (i = 0; i < argc; ++i)
-        VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &(argv[i])));
-    argv[argc] = NULL;
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &pid));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &sig));
 
-    if (pipe(fd[0]) < 0 || pipe(fd[1]) < 0 || (npipe == 3 && pipe(fd[2]) < 0))
-        return vp_stack_return_error(&_result, "pipe() error: %s",
+    if (kill(pid, sig) == -1)
+        return vp_stack_return_error(&_result, "kill() error: %s",
                 strerror(errno));
+    return NULL;
+}
 
-    pid = fork();
-    if (pid < 0) {
-        return vp_stack_return_error(&_result, "fork() error: %s",
+const char *
+vp_waitpid(char *args)
+{
+    VP_STATS_SCOPE(vp_waitpid, args);
+    vp_stack_t stack;
+    pid_t pid;
+    pid_t n;
+    int status;
+    int i;
+
+    vp_outq_flush_all();
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &pid));
+
+    /* reaped by vp_reap_all() */
+    if ((i = vp_child_index(pid)) >= 0 && _child.list[i].reaped) {
+        status = _child.list[i].status;
+        vp_child_remove(i);
+        VP_RETURN_IF_FAIL(vp_push_status(status));
+        return vp_stack_return(&_result);
+    }
+
+    n = vp_sys_waitpid(pid, &status, WNOHANG | WUNTRACED);
+    if (n == -1)
+        return vp_stack_return_error(&_result, "waitpid() error: %s",
                 strerror(errno));
-    } else if (pid == 0) {
-        /* child */
-        close(fd[0][1]);
-        close(fd[1][0]);
-        if (npipe == 3)
-            close(fd[2][0]);
-        if (fd[0][0] != STDIN_FILENO) {
-            if (dup2(fd[0][0], STDIN_FILENO) != STDIN_FILENO) {
-                write(fd[1][1], strerror(errno), strlen(strerror(errno)));
-                _exit(EXIT_FAILURE);
-            }
-            close(fd[0][0]);
-        }
-        if (fd[1][1] != STDOUT_FILENO) {
-            if (dup2(fd[1][1], STDOUT_FILENO) != STDOUT_FILENO) {
-                write(fd[1][1], strerror(errno), strlen(strerror(errno)));
-                _exit(EXIT_FAILURE);
+    if (n == 0) {
+        /* status is not set while the child is running */
+        vp_stack_push_str(&_result, "run");
+        vp_stack_push_num(&_result, "%d", 0);
+        return vp_stack_return(&_result);
+    }
+    if (!WIFSTOPPED(status)) {
+        if (i >= 0)
+            vp_child_remove(i);
+        vp_job_exited(pid, status);
+    }
+    VP_RETURN_IF_FAIL(vp_push_status(status));
+    return vp_stack_return(&_result);
+}
+
+/*
+ * Reap the exited children, and return those which are not returned yet.
+ * The status is also kept for vp_waitpid().
+ */
+const char *
+vp_reap_all(char *args)
+{
+    VP_STATS_SCOPE(vp_reap_all, args);
+    int i;
+
+    vp_outq_flush_all();
+    vp_child_poll();
+    for (i = 0; i < _child.n; ++i) {
+        vp_child_t *c = &_child.list[i];
+
+        if (!c->reaped || c->reported)
+            continue;
+        c->reported = 1;
+        vp_stack_push_num(&_result, "%d", c->pid);
+        VP_RETURN_IF_FAIL(vp_push_status(c->status));
+    }
+    return vp_stack_return(&_result);
+}
+
+/*
+ * State of every job: cond and status as vp_waitpid(), msec since the
+ * start (until the exit if exited), and bytes of output buffered in the
+ * DLL which Vim has not read yet.
+ */
+const char *
+vp_job_status_all(char *args)
+{
+    VP_STATS_SCOPE(vp_job_status_all, args);
+    vp_job_t *job;
+    vp_fdstate_t *state;
+    size_t nbuf;
+    int i;
+    int j;
+
+    vp_outq_flush_all();
+    vp_child_poll();
+    for (i = 0; i < _job.n; ++i) {
+        job = &_job.list[i];
+        nbuf = 0;
+        for (j = 0; j < job->nfd; ++j) {
+            if ((state = vp_fdstate_get(job->fd[j], 0)) != NULL)
+                nbuf += state->len;
+#ifdef VP_DRAIN
+            if (vp_drain_ring(job->fd[j]) != NULL) {
+                vp_ring_t *r = vp_drain_ring(job->fd[j]);
+
+                nbuf += __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - r->head;
             }
-            close(fd[1][1]);
+#endif
         }
-        if (npipe == 2) {
-            if (dup2(STDOUT_FILENO, STDERR_FILENO) != STDERR_FILENO) {
-                write(STDOUT_FILENO, strerror(errno), strlen(strerror(errno)));
-                _exit(EXIT_FAILURE);
-            }
-        } else if (fd[2][1] != STDERR_FILENO) {
-            if (dup2(fd[2][1], STDERR_FILENO) != STDERR_FILENO) {
-                write(STDOUT_FILENO, strerror(errno), strlen(strerror(errno)));
-                _exit(EXIT_FAILURE);
-            }
-            close(fd[2][1]);
+        vp_stack_push_num(&_result, "%d", job->id);
+        vp_stack_push_num(&_result, "%d", job->pid);
+        if (job->done) {
+            VP_RETURN_IF_FAIL(vp_push_status(job->status));
+        } else {
+            vp_stack_push_str(&_result, "run");
+            vp_stack_push_num(&_result, "%d", 0);
         }
-        if (execv(argv[0], argv) < 0) {
-            /* error */
-            write(STDOUT_FILENO, strerror(errno), strlen(strerror(errno)));
-            _exit(EXIT_FAILURE);
+        vp_stack_push_num(&_result, "%lld",
+                (job->done ? job->end : vp_now_msec()) - job->start);
+        vp_stack_push_num(&_result, "%zu", nbuf);
+    }
+    return vp_stack_return(&_result);
+}
+
+/*
+ * Counters of each API which has been called, in usec.  histogram is
+ * "b:n,..." of non-empty buckets, where n calls took less than 2^b usec
+ * (and 2^(b-1) or more).  The counters are cleared after return if reset
+ * is not 0.
+ */
+const char *
+vp_stats(char *args)
+{
+    vp_stack_t stack;
+    int reset;
+#ifdef VP_STATS
+    char hist[VP_STATS_NBUCKET * 24];
+    size_t len;
+    vp_stats_t *st;
+    int i;
+    int b;
+#endif
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &reset));
+
+#ifdef VP_STATS
+    vp_stack_push_num(&_result, "%zu", _result.size);
+    vp_stack_push_num(&_result, "%zu", _stats_result_max);
+    for (i = 0; i < VP_API_COUNT; ++i) {
+        st = &_stats[i];
+        if (st->calls == 0)
+            continue;
+        len = 0;
+        hist[0] = '\0';
+        for (b = 0; b < VP_STATS_NBUCKET; ++b) {
+            if (st->hist[b] != 0)
+                len += snprintf(hist + len, sizeof(hist) - len, "%s%d:%llu",
+                        (len == 0) ? "" : ",", b, st->hist[b]);
         }
-    } else {
-        /* parent */
-        close(fd[0][0]);
-        close(fd[1][1]);
-        if (npipe == 3)
-            close(fd[2][1]);
-        vp_stack_push_num(&_result, "%d", pid);
-        vp_stack_push_num(&_result, "%d", fd[0][1]);
-        vp_stack_push_num(&_result, "%d", fd[1][0]);
-        if (npipe == 3)
-            vp_stack_push_num(&_result, "%d", fd[2][0]);
-        return vp_stack_return(&_result);
+        vp_stack_push_str(&_result, _stats_name[i]);
+        vp_stack_push_num(&_result, "%llu", st->calls);
+        vp_stack_push_num(&_result, "%llu", st->errors);
+        vp_stack_push_num(&_result, "%llu", st->bytes_in);
+        vp_stack_push_num(&_result, "%llu", st->bytes_out);
+        vp_stack_push_num(&_result, "%llu", st->nsec / 1000);
+        vp_stack_push_num(&_result, "%llu", st->nsec_max / 1000);
+        vp_stack_push_num(&_result, "%llu", st->nsec_poll / 1000);
+        vp_stack_push_num(&_result, "%llu", st->nsyscall);
+        vp_stack_push_num(&_result, "%ld", st->arg_max);
+        vp_stack_push_str(&_result, hist);
+    }
+    if (reset) {
+        memset(_stats, 0, sizeof(_stats));
+        _stats_result_max = _result.size;
+    }
+    return vp_stack_return(&_result);
+#else
+    (void)reset;
+    return vp_stack_return_error(&_result, "vp_stats: built with VP_NO_STATS");
+#endif
+}
+
+/* Start tracing.  The spans recorded so far are cleared. */
+const char *
+vp_trace_start(char *args)
+{
+    vp_stack_t stack;
+    int nevent;
+#ifdef VP_STATS
+    vp_trace_t *ring;
+#endif
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &nevent));
+
+#ifdef VP_STATS
+    if (nevent < 1)
+        return vp_stack_return_error(&_result, "nevent range error.");
+    ring = (vp_trace_t *)malloc(sizeof(vp_trace_t) * nevent);
+    if (ring == NULL)
+        return vp_stack_return_error(&_result, "vp_trace_start: NOMEM");
+    free(_trace.ring);
+    _trace.ring = ring;
+    _trace.size = nevent;
+    _trace.n = 0;
+    _trace.origin = vp_now_nsec();
+    return NULL;
+#else
+    return vp_stack_return_error(&_result, "vp_trace_start: built with VP_NO_STATS");
+#endif
+}
+
+/* Stop tracing and free the spans.  The slow call log is kept. */
+const char *
+vp_trace_stop(char *args)
+{
+    (void)args;
+#ifdef VP_STATS
+    free(_trace.ring);
+    _trace.ring = NULL;
+    _trace.size = 0;
+    _trace.n = 0;
+#endif
+    return NULL;
+}
+
+/*
+ * Write the spans in the ring to path in the Chrome trace event format,
+ * which chrome://tracing and Perfetto can load.  "arg" is the first
+ * argument of an API or the fd (pid for waitpid) of a syscall, and "ret"
+ * is the bytes returned by an API or the result of a syscall.
+ */
+const char *
+vp_trace_dump(char *args)
+{
+    vp_stack_t stack;
+    char *path;
+#ifdef VP_STATS
+    FILE *fp;
+    vp_trace_t *t;
+    size_t first;
+    size_t count;
+    size_t i;
+#endif
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &path));
+
+#ifdef VP_STATS
+    if (_trace.ring == NULL)
+        return vp_stack_return_error(&_result, "vp_trace_dump: not started");
+    if ((fp = fopen(path, "w")) == NULL)
+        return vp_stack_return_error(&_result, "fopen() error: %s",
+                strerror(errno));
+    count = (_trace.n < _trace.size) ? _trace.n : _trace.size;
+    first = _trace.n - count;
+    fprintf(fp, "{\"traceEvents\":[\n");
+    for (i = 0; i < count; ++i) {
+        t = &_trace.ring[(first + i) % _trace.size];
+        fprintf(fp, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":1,"
+                "\"args\":{\"arg\":%ld,\"ret\":%lld,\"depth\":%d}}%s\n",
+                (t->kind < VP_API_COUNT) ? _stats_name[t->kind]
+                    : _trace_name[t->kind - VP_API_COUNT],
+                (t->kind < VP_API_COUNT) ? "api" : "syscall",
+                (t->start - _trace.origin) / 1e3, t->nsec / 1e3,
+                (int)getpid(), t->fd, t->bytes, t->depth,
+                (i + 1 < count) ? "," : "");
     }
-    /* DO NOT REACH HEAR */
+    fprintf(fp, "],\"displayTimeUnit\":\"ms\"}\n");
+    if (fclose(fp) == EOF)
+        return vp_stack_return_error(&_result, "fclose() error: %s",
+                strerror(errno));
+    vp_stack_push_num(&_result, "%zu", count);
+    return vp_stack_return(&_result);
+#else
+    return vp_stack_return_error(&_result, "vp_trace_dump: built with VP_NO_STATS");
+#endif
+}
+
+/*
+ * Log an API call which kept Vim blocked for msec or more, appending a
+ * line to path.  Nested calls are not logged by themselves.  msec 0 stops
+ * logging.
+ */
+const char *
+vp_trace_slow(char *args)
+{
+    vp_stack_t stack;
+    int msec;
+    char *path;
+#ifdef VP_STATS
+    char *newpath = NULL;
+#endif
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &msec));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &path));
+
+#ifdef VP_STATS
+    if (msec > 0 && (newpath = strdup(path)) == NULL)
+        return vp_stack_return_error(&_result, "vp_trace_slow: NOMEM");
+    free(_trace.slow_path);
+    _trace.slow_path = newpath;
+    _trace.slow = (msec > 0) ? (unsigned long long)msec * 1000000 : 0;
     return NULL;
+#else
+    return vp_stack_return_error(&_result, "vp_trace_slow: built with VP_NO_STATS");
+#endif
 }
 
+/*
+ * This is based on socket.diff.gz written by Yasuhiro Matsumoto.
+ * see: http://marc.theaimsgroup.com/?l=vim-dev&m=105289857008664&w=2
+ */
 const char *
-vp_pipe_close(char *args)
+vp_socket_open(char *args)
+{
+    VP_STATS_SCOPE(vp_socket_open, args);
+    vp_stack_t stack;
+    char *host;
+    char *port;
+    char *p;
+    int n;
+    unsigned short nport;
+    int sock;
+    struct sockaddr_in sockaddr;
+    struct hostent *hostent;
+    struct servent *servent;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &host));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &port));
+
+    n = strtol(port, &p, 10);
+    if (p == port + strlen(port)) {
+        nport = htons(n);
+    } else {
+        servent = getservbyname(port, NULL);
+        if (servent == NULL)
+            return vp_stack_return_error(&_result, "getservbyname() error: %s",
+                    port);
+        nport = servent->s_port;
+    }
+
+    sock = socket(PF_INET, SOCK_STREAM, 0);
+    hostent = gethostbyname(host);
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_port = nport;
+    sockaddr.sin_addr = *((struct in_addr*)*hostent->h_addr_list);
+
+    if (connect(sock, (struct sockaddr*)&sockaddr, sizeof(struct sockaddr_in))
+            == -1)
+        return vp_stack_return_error(&_result, "connect() error: %s",
+                strerror(errno));
+
+    vp_stack_push_num(&_result, "%d", sock);
+    return vp_stack_return(&_result);
+}
+
+const char *
+vp_socket_close(char *args)
 {
+    VP_STATS_SCOPE(vp_socket_close, args);
     return vp_file_close(args);
 }
 
 const char *
-vp_pipe_read(char *args)
+vp_socket_read(char *args)
 {
+    VP_STATS_SCOPE(vp_socket_read, args);
     return vp_file_read(args);
 }
 
 const char *
-vp_pipe_write(char *args)
+vp_socket_write(char *args)
+{
+    VP_STATS_SCOPE(vp_socket_write, args);
+    return vp_file_write(args);
+}
+
+const char *
+vp_socket_write_async(char *args)
+{
+    VP_STATS_SCOPE(vp_socket_write_async, args);
+    return vp_file_write_async(args);
+}
+
+const char *
+vp_socket_flush(char *args)
+{
+    VP_STATS_SCOPE(vp_socket_flush, args);
+    return vp_file_flush(args);
+}
+
+const char *
+vp_socket_read_records(char *args)
+{
+    VP_STATS_SCOPE(vp_socket_read_records, args);
+    return vp_file_read_records(args);
+}
+
+const char *
+vp_socket_read_ansi(char *args)
+{
+    VP_STATS_SCOPE(vp_socket_read_ansi, args);
+    return vp_file_read_ansi(args);
+}
+
+const char *
+vp_socket_read_until(char *args)
+{
+    VP_STATS_SCOPE(vp_socket_read_until, args);
+    return vp_file_read_until(args);
+}
+
+
+/* report the read ahead buffers to check the memory cost */
+const char *
+vp_fd_buffers(char *args)
 {
-    return vp_file_write(args);
+    VP_STATS_SCOPE(vp_fd_buffers, args);
+    int fd;
+
+    for (fd = 0; fd < _fdstate_size; ++fd) {
+        if (_fdstate[fd].buf == NULL)
+            continue;
+        vp_stack_push_num(&_result, "%d", fd);
+        vp_stack_push_num(&_result, "%zu", _fdstate[fd].len);
+        vp_stack_push_num(&_result, "%zu", _fdstate[fd].size);
+    }
+    return vp_stack_return(&_result);
 }
 
+/*
+ * mode is "discard", "bytes", "lines" or "spill" (see vp_capture_t), or
+ * "all" to read fd as usual again.  A new policy starts with nothing kept.
+ */
 const char *
-vp_pty_open(char *args)
+vp_capture_set(char *args)
 {
+    VP_STATS_SCOPE(vp_capture_set, args);
+    static const char *modes[] = {"discard", "bytes", "lines", "spill"};
     vp_stack_t stack;
-    int argc;
-    char *argv[VP_ARGC_MAX];
-    int fdm;
-    pid_t pid;
-    struct winsize ws = {0, 0, 0, 0};
-    struct termios ti;
-    int i;
+    int fd;
+    char *mode;
+    int limit;
+    vp_capture_t *c;
+    vp_fdstate_t *state;
+    int m;
 
     VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%hu", &(ws.ws_col)));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%hu", &(ws.ws_row)));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &argc));
-    if (argc < 1 || VP_ARGC_MAX <= argc)
-        return vp_stack_return_error(&_result, "argc range error. too many arguments. please use xargs.");
-    for (i = 0; i < argc; ++i)
-        VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &(argv[i])));
-    argv[argc] = NULL;
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &mode));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &limit));
 
-    /* Set termios parameter */
-    /*if (tcgetattr(STDIN_FILENO, &ti) < 0) {*/
-        /*[> tcgetattr will fail when gvim is executed from gnome menu. <]*/
-        /*[> Because, gvim hasn't terminal. <]*/
-        
-        /*[>return vp_stack_return_error(&_result, "tcgetattr() error: %s",<]*/
-                /*[>strerror(errno));<]*/
-        /*pid = forkpty(&fdm, NULL, NULL, &ws);*/
-    /*} else {*/
-        /*ti.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP*/
-                /*| INLCR | IGNCR | ICRNL | IXON);*/
-        /*ti.c_oflag &= ~OPOST;*/
-        /*ti.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);*/
-        /*ti.c_cflag &= ~(CSIZE | PARENB);*/
-        /*ti.c_cflag |= CS8;*/
-
-        /*pid = forkpty(&fdm, NULL, &ti, &ws);*/
-    /*}*/
-    pid = forkpty(&fdm, NULL, NULL, &ws);
-    
-    if (pid < 0) {
-        return vp_stack_return_error(&_result, "forkpty() error: %s",
-                strerror(errno));
-    } else if (pid == 0) {
-        /* child */
-        if (execv(argv[0], argv) < 0) {
-            /* error */
-            write(fdm, strerror(errno), strlen(strerror(errno)));
-            _exit(EXIT_FAILURE);
-        }
-    } else {
-        /* parent */
-        vp_stack_push_num(&_result, "%d", pid);
-        vp_stack_push_num(&_result, "%d", fdm);
-        /* XXX - ttyname(fdm) breaks in OS X */
-        vp_stack_push_str(&_result, "unused");
-        return vp_stack_return(&_result);
+    if (fd < 0)
+        return vp_stack_return_error(&_result, "invalid fd: %d", fd);
+
+    vp_capture_clear(fd);
+    if (strcmp(mode, "all") == 0)
+        return NULL;
+    for (m = 0; m < (int)(sizeof(modes) / sizeof(modes[0])); ++m) {
+        if (strcmp(mode, modes[m]) == 0)
+            break;
     }
-    /* DO NOT REACH HERE */
+    if (m == (int)(sizeof(modes) / sizeof(modes[0])))
+        return vp_stack_return_error(&_result, "unknown capture mode: %s",
+                mode);
+    if (limit < 0)
+        return vp_stack_return_error(&_result, "limit range error: %d",
+                limit);
+    if ((c = vp_capture_get(fd, 1)) == NULL)
+        return vp_stack_return_error(&_result, "vp_capture_get: NOMEM");
+    c->mode = m;
+    c->limit = limit;
+    /* bytes read ahead are the first captured */
+    if ((state = vp_fdstate_get(fd, 0)) != NULL)
+        vp_capture_take(fd, state);
     return NULL;
 }
 
+/*
+ * Read what fd has without waiting, and return the last nlines lines kept
+ * by the policy of fd (all of them if nlines is negative) without removing
+ * them, up to the result cap.  total and dropped count the bytes read
+ * from fd and the bytes the policy has thrown away.
+ */
 const char *
-vp_pty_close(char *args)
+vp_capture_read(char *args)
 {
-    return vp_file_close(args);
+    VP_STATS_SCOPE(vp_capture_read, args);
+    vp_stack_t stack;
+    int fd;
+    int nlines;
+    vp_capture_t *c;
+    const char *buf;
+    size_t len;
+    size_t off;
+    void *map = MAP_FAILED;
+    size_t maplen = 0;
+    int eof;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &nlines));
+
+    if (fd < 0)
+        return vp_stack_return_error(&_result, "invalid fd: %d", fd);
+
+    if ((c = vp_capture_get(fd, 0)) == NULL)
+        return vp_stack_return_error(&_result, "no capture: %d", fd);
+    if ((eof = vp_capture_pump(fd, c)) == -1)
+        return vp_stack_return_error(&_result, "read() error: %s",
+                strerror(errno));
+
+    buf = c->buf;
+    len = c->len;
+    if (c->spill != -1 && c->spilled > 0) {
+        /* only the tail which can be returned is mapped */
+        off_t start = 0;
+
+        if (_result_cap != 0 && c->spilled > (off_t)_result_cap)
+            start = (c->spilled - _result_cap)
+                & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+        maplen = c->spilled - start;
+        map = mmap(NULL, maplen, PROT_READ, MAP_SHARED, c->spill, start);
+        if (map == MAP_FAILED)
+            return vp_stack_return_error(&_result, "mmap() error: %s",
+                    strerror(errno));
+        buf = (const char *)map;
+        len = maplen;
+    }
+    if (nlines == 0 || len == 0)
+        off = len;
+    else if (nlines < 0)
+        off = 0;
+    else
+        off = vp_tail_lines(buf, len, nlines);
+    if (_result_cap != 0 && len - off > _result_cap)
+        off = len - _result_cap;
+
+    vp_stack_push_bin(&_result, buf + off, len - off);
+    if (map != MAP_FAILED)
+        munmap(map, maplen);
+    vp_stack_push_num(&_result, "%d", eof);
+    vp_stack_push_num(&_result, "%llu", c->total);
+    vp_stack_push_num(&_result, "%llu", c->dropped);
+    return vp_stack_return(&_result);
 }
 
 const char *
-vp_pty_read(char *args)
+vp_drain_start(char *args)
 {
-    return vp_file_read(args);
+    VP_STATS_SCOPE(vp_drain_start, args);
+#ifdef VP_DRAIN
+    vp_stack_t stack;
+    int ringsize;
+    sigset_t all;
+    sigset_t old;
+    int ret;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &ringsize));
+
+    if (_drain.running)
+        return NULL;
+    _drain.ringsize = 4096;
+    while (ringsize > 0 && _drain.ringsize < (size_t)ringsize)
+        _drain.ringsize *= 2;
+    if (vp_pipe_cloexec(_drain.wake) < 0)
+        return vp_stack_return_error(&_result, "pipe() error: %s",
+                strerror(errno));
+    if (vp_pipe_cloexec(_drain.notify) < 0) {
+        ret = errno;
+        close(_drain.wake[0]);
+        close(_drain.wake[1]);
+        return vp_stack_return_error(&_result, "pipe() error: %s",
+                strerror(ret));
+    }
+    fcntl(_drain.wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(_drain.wake[1], F_SETFL, O_NONBLOCK);
+    fcntl(_drain.notify[0], F_SETFL, O_NONBLOCK);
+    fcntl(_drain.notify[1], F_SETFL, O_NONBLOCK);
+
+    /* signals are for Vim's thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ret = pthread_create(&_drain.thread, NULL, vp_drain_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret != 0) {
+        close(_drain.wake[0]);
+        close(_drain.wake[1]);
+        close(_drain.notify[0]);
+        close(_drain.notify[1]);
+        return vp_stack_return_error(&_result, "pthread_create() error: %s",
+                strerror(ret));
+    }
+    _drain.running = 1;
+    return NULL;
+#else
+    return vp_stack_return_error(&_result, "drain thread is not supported");
+#endif
 }
 
 const char *
-vp_pty_write(char *args)
+vp_drain_stop(char *args)
 {
-    return vp_file_write(args);
+    VP_STATS_SCOPE(vp_drain_stop, args);
+#ifdef VP_DRAIN
+    vp_drain_shutdown();
+#endif
+    return NULL;
 }
 
 const char *
-vp_pty_get_winsize(char *args)
+vp_drain_register(char *args)
 {
+    VP_STATS_SCOPE(vp_drain_register, args);
+#ifdef VP_DRAIN
     vp_stack_t stack;
     int fd;
-    struct winsize ws = {0, 0, 0, 0};
+    vp_ring_t *r;
 
     VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
     VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
 
-    if (ioctl(fd, TIOCGWINSZ, &ws) < 0)
-        return vp_stack_return_error(&_result, "ioctl() error: %s",
-                strerror(errno));
-    vp_stack_push_num(&_result, "%hu", ws.ws_col);
-    vp_stack_push_num(&_result, "%hu", ws.ws_row);
-    return vp_stack_return(&_result);
+    if (!_drain.running)
+        return vp_stack_return_error(&_result, "drain thread is not started");
+    if (fd < 0)
+        return vp_stack_return_error(&_result, "invalid fd: %d", fd);
+    if (vp_drain_ring(fd) != NULL)
+        return NULL;
+    if (fd >= _drain.size) {
+        vp_ring_t **newring;
+        int newsize = (_drain.size == 0) ? 64 : _drain.size;
+
+        while (newsize <= fd)
+            newsize *= 2;
+        pthread_mutex_lock(&_drain.lock);
+        newring = (vp_ring_t **)realloc(_drain.ring,
+                sizeof(vp_ring_t *) * newsize);
+        if (newring != NULL) {
+            memset(newring + _drain.size, 0,
+                    sizeof(vp_ring_t *) * (newsize - _drain.size));
+            _drain.ring = newring;
+            _drain.size = newsize;
+        }
+        pthread_mutex_unlock(&_drain.lock);
+        if (newring == NULL)
+            return vp_stack_return_error(&_result, "vp_drain_register: NOMEM");
+    }
+    r = (vp_ring_t *)calloc(1, sizeof(vp_ring_t));
+    if (r == NULL || (r->buf = (char *)malloc(_drain.ringsize)) == NULL) {
+        free(r);
+        return vp_stack_return_error(&_result, "vp_drain_register: NOMEM");
+    }
+    r->size = _drain.ringsize;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    pthread_mutex_lock(&_drain.lock);
+    r->serial = ++_drain.serial;
+    _drain.ring[fd] = r;
+    pthread_mutex_unlock(&_drain.lock);
+    vp_drain_wake(_drain.wake[1]);
+    return NULL;
+#else
+    return vp_stack_return_error(&_result, "drain thread is not supported");
+#endif
 }
+
 const char *
-vp_pty_set_winsize(char *args)
+vp_drain_unregister(char *args)
 {
+    VP_STATS_SCOPE(vp_drain_unregister, args);
+#ifdef VP_DRAIN
     vp_stack_t stack;
     int fd;
-    struct winsize ws = {0, 0, 0, 0};
 
     VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
     VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%hu", &(ws.ws_col)));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%hu", &(ws.ws_row)));
 
-    if (ioctl(fd, TIOCSWINSZ, &ws) < 0)
-        return vp_stack_return_error(&_result, "ioctl() error: %s",
-                strerror(errno));
+    vp_drain_unregister_fd(fd);
+#endif
     return NULL;
 }
 
 const char *
-vp_kill(char *args)
+vp_epoll_add(char *args)
 {
+    VP_STATS_SCOPE(vp_epoll_add, args);
     vp_stack_t stack;
-    pid_t pid;
-    int sig;
+    int fd;
 
     VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &pid));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &sig));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
 
-    if (kill(pid, sig) == -1)
-        return vp_stack_return_error(&_result, "kill() error: %s",
+    if (vp_epoll_index(fd) >= 0)
+        return NULL;
+    if (_epoll.nfds == _epoll.size) {
+        int newsize = (_epoll.size == 0) ? 64 : _epoll.size * 2;
+        int *newfds = (int *)realloc(_epoll.fds, sizeof(int) * newsize);
+
+        if (newfds == NULL)
+            return vp_stack_return_error(&_result, "vp_epoll_add: NOMEM");
+        _epoll.fds = newfds;
+        _epoll.size = newsize;
+    }
+    _epoll.fds[_epoll.nfds++] = fd;
+    if (vp_epoll_watch(fd) == -1) {
+        --_epoll.nfds;
+        return vp_stack_return_error(&_result, "epoll_ctl() error: %s",
                 strerror(errno));
+    }
     return NULL;
 }
 
 const char *
-vp_waitpid(char *args)
+vp_epoll_del(char *args)
 {
+    VP_STATS_SCOPE(vp_epoll_del, args);
     vp_stack_t stack;
-    pid_t pid;
-    pid_t n;
-    int status;
+    int fd;
 
     VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
-    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &pid));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &fd));
 
-    n = waitpid(pid, &status, WNOHANG | WUNTRACED);
-    if (n == -1)
-        return vp_stack_return_error(&_result, "waitpid() error: %s",
-                strerror(errno));
-    if (WIFCONTINUED(status)) {
-        vp_stack_push_str(&_result, "run");
-        vp_stack_push_num(&_result, "%d", 0);
-    } else if (WIFEXITED(status)) {
-        vp_stack_push_str(&_result, "exit");
-        vp_stack_push_num(&_result, "%d", WEXITSTATUS(status));
-    } else if (WIFSIGNALED(status)) {
-        vp_stack_push_str(&_result, "signal");
-        vp_stack_push_num(&_result, "%d", WTERMSIG(status));
-    } else if (WIFSTOPPED(status)) {
-        vp_stack_push_str(&_result, "stop");
-        vp_stack_push_num(&_result, "%d", WSTOPSIG(status));
-    } else {
-        return vp_stack_return_error(&_result,
-                "waitpid() unknown status: status=%d", status);
-    }
-    return vp_stack_return(&_result);
+    vp_epoll_forget(fd);
+    return NULL;
 }
 
+#ifdef VP_DRAIN
 /*
- * This is based on socket.diff.gz written by Yasuhiro Matsumoto.
- * see: http://marc.theaimsgroup.com/?l=vim-dev&m=105289857008664&w=2
+ * Move the bytes which the drain thread has read from fd into its buffer.
+ * Return 1 if fd has bytes or eof, 0 if not, or -1 on no memory.
+ */
+static int
+vp_epoll_take(int fd, int *eof)
+{
+    vp_ring_t *r = vp_drain_ring(fd);
+    vp_fdstate_t *state;
+    size_t taken;
+
+    *eof = __atomic_load_n(&r->eof, __ATOMIC_ACQUIRE);
+    if ((state = vp_fdstate_get(fd, 1)) == NULL
+            || vp_ring_take(fd, r, state, &taken) != NULL)
+        return -1;
+    if (taken > 0)
+        *eof = 0;
+    return state->len > 0 || *eof;
+}
+#endif
+
+/*
+ * Wait until some of the registered fds are ready, and return their
+ * output.  fds with buffered bytes are ready without waiting.  An fd at
+ * eof is removed from the registry.
  */
 const char *
-vp_socket_open(char *args)
+vp_epoll_wait(char *args)
 {
+    VP_STATS_SCOPE(vp_epoll_wait, args);
     vp_stack_t stack;
-    char *host;
-    char *port;
-    char *p;
+    int nr;
+    int timeout;
+    int ready[VP_POLL_MAX];
+    int eof[VP_POLL_MAX];
+    int nready = 0;
+    vp_fdstate_t *state;
+    size_t len;
+    size_t total = 0;
+    int fd;
+    int i;
     int n;
-    unsigned short nport;
-    int sock;
-    struct sockaddr_in sockaddr;
-    struct hostent *hostent;
-    struct servent *servent;
+#if defined __linux__
+    struct epoll_event ev[VP_POLL_MAX];
+    unsigned long long start;
+#else
+    struct pollfd pfd[VP_POLL_MAX + 1];
+    int npfd;
+#endif
+    int wait;
+#ifdef VP_DRAIN
+    int notified = 0;
+    long long deadline;
+#endif
 
+    vp_outq_flush_all();
     VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
-    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &host));
-    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &port));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &nr));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &timeout));
 
-    n = strtol(port, &p, 10);
-    if (p == port + strlen(port)) {
-        nport = htons(n);
-    } else {
-        servent = getservbyname(port, NULL);
-        if (servent == NULL)
-            return vp_stack_return_error(&_result, "getservbyname() error: %s",
-                    port);
-        nport = servent->s_port;
+    if (_epoll.nfds == 0)
+        return NULL;
+
+    /* bytes left by a former read, or read by the drain thread */
+#ifdef VP_DRAIN
+    if (_drain.running)
+        vp_drain_clear_notify();
+#endif
+    for (i = 0; i < _epoll.nfds && nready < VP_POLL_MAX; ++i) {
+        fd = _epoll.fds[i];
+        eof[nready] = 0;
+#ifdef VP_DRAIN
+        if (vp_drain_ring(fd) != NULL) {
+            if ((n = vp_epoll_take(fd, &eof[nready])) == -1)
+                return vp_stack_return_error(&_result, "vp_epoll_wait: NOMEM");
+            if (n)
+                ready[nready++] = fd;
+            continue;
+        }
+#endif
+        state = vp_fdstate_get(fd, 0);
+        if (state != NULL && state->len > 0)
+            ready[nready++] = fd;
     }
 
-    sock = socket(PF_INET, SOCK_STREAM, 0);
-    hostent = gethostbyname(host);
-    sockaddr.sin_family = AF_INET;
-    sockaddr.sin_port = nport;
-    sockaddr.sin_addr = *((struct in_addr*)*hostent->h_addr_list);
+#ifdef VP_DRAIN
+    deadline = vp_now_msec() + timeout;
+#endif
+    wait = timeout;
+    while (nready == 0) {
+#if defined __linux__
+        if (vp_epoll_create() == -1)
+            return vp_stack_return_error(&_result, "epoll_create1() error: %s",
+                    strerror(errno));
+# ifdef VP_DRAIN
+        if (_drain.running && !_epoll.notify) {
+            struct epoll_event nev;
 
-    if (connect(sock, (struct sockaddr*)&sockaddr, sizeof(struct sockaddr_in))
-            == -1)
-        return vp_stack_return_error(&_result, "connect() error: %s",
-                strerror(errno));
+            memset(&nev, 0, sizeof(nev));
+            nev.events = EPOLLIN;
+            nev.data.fd = _drain.notify[0];
+            epoll_ctl(_epoll.epfd, EPOLL_CTL_ADD, _drain.notify[0], &nev);
+            _epoll.notify = 1;
+        }
+# endif
+        start = VP_STATS_NOW();
+        n = epoll_wait(_epoll.epfd, ev, VP_POLL_MAX, wait);
+        VP_STATS_POLL(start);
+        VP_STATS_SYSCALL();
+        VP_TRACE_SYS(VP_TRACE_EPOLL_WAIT, start, _epoll.epfd, n);
+        if (n == -1 && errno != EINTR)
+            return vp_stack_return_error(&_result, "epoll_wait() error: %s",
+                    strerror(errno));
+        for (i = 0; i < n; ++i) {
+            fd = ev[i].data.fd;
+# ifdef VP_DRAIN
+            if (_drain.running && fd == _drain.notify[0]) {
+                /* the thread has read registered fds */
+                notified = 1;
+                continue;
+            }
+# endif
+            if (vp_epoll_index(fd) >= 0)
+                ready[nready++] = fd;
+        }
+#else
+        npfd = 0;
+# ifdef VP_DRAIN
+        if (_drain.running) {
+            pfd[npfd].fd = _drain.notify[0];
+            pfd[npfd].events = POLLIN;
+            pfd[npfd].revents = 0;
+            ++npfd;
+        }
+# endif
+        for (i = 0; i < _epoll.nfds && npfd < VP_POLL_MAX; ++i) {
+# ifdef VP_DRAIN
+            if (vp_drain_ring(_epoll.fds[i]) != NULL)
+                continue;
+# endif
+            pfd[npfd].fd = _epoll.fds[i];
+            pfd[npfd].events = POLLIN;
+            pfd[npfd].revents = 0;
+            ++npfd;
+        }
+        n = vp_sys_poll(pfd, npfd, wait);
+        if (n == -1 && errno != EINTR)
+            return vp_stack_return_error(&_result, "poll() error: %s",
+                    strerror(errno));
+        for (i = 0; i < npfd && n > 0; ++i) {
+            if (pfd[i].revents == 0)
+                continue;
+# ifdef VP_DRAIN
+            if (_drain.running && pfd[i].fd == _drain.notify[0]) {
+                notified = 1;
+                continue;
+            }
+# endif
+            ready[nready++] = pfd[i].fd;
+        }
+#endif
+        /* read now */
+        for (i = 0; i < nready; ++i) {
+            fd = ready[i];
+            eof[i] = 0;
+#ifdef VP_DRAIN
+            if (vp_drain_ring(fd) != NULL)
+                continue;
+#endif
+            if ((state = vp_fdstate_get(fd, 1)) == NULL)
+                return vp_stack_return_error(&_result, "vp_epoll_wait: NOMEM");
+            n = vp_fdstate_fill(state, fd);
+            if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR))
+                eof[i] = 1;
+        }
+#ifdef VP_DRAIN
+        if (notified) {
+            vp_drain_clear_notify();
+            for (i = 0; i < _epoll.nfds && nready < VP_POLL_MAX; ++i) {
+                fd = _epoll.fds[i];
+                if (vp_drain_ring(fd) == NULL)
+                    continue;
+                if ((n = vp_epoll_take(fd, &eof[nready])) == -1)
+                    return vp_stack_return_error(&_result,
+                            "vp_epoll_wait: NOMEM");
+                if (n)
+                    ready[nready++] = fd;
+            }
+            /* woken for fds which are not registered */
+            notified = 0;
+            if (nready == 0 && (timeout < 0
+                        || (wait = deadline - vp_now_msec()) > 0))
+                continue;
+        }
+#endif
+        break;
+    }
 
-    vp_stack_push_num(&_result, "%d", sock);
+    for (i = 0; i < nready; ++i) {
+        fd = ready[i];
+        state = vp_fdstate_get(fd, 0);
+        len = 0;
+        if (state != NULL)
+            len = (nr < 0 || (size_t)nr > state->len) ? state->len : (size_t)nr;
+        if (_result_cap != 0 && len > _result_cap - total)
+            len = _result_cap - total;
+        total += len;
+        vp_stack_push_num(&_result, "%d", fd);
+        vp_stack_push_bin(&_result, (state != NULL) ? state->buf : "", len);
+        if (state != NULL) {
+            vp_fdstate_consume(state, len);
+            if (state->len > 0)
+                eof[i] = 0;
+        }
+        vp_stack_push_num(&_result, "%d", eof[i]);
+        if (eof[i]) {
+            vp_epoll_forget(fd);
+            vp_fdstate_clear(fd);
+        } else {
+            vp_fdstate_shrink(fd);
+        }
+    }
     return vp_stack_return(&_result);
 }
 
-const char *
-vp_socket_close(char *args)
-{
-    return vp_file_close(args);
-}
+/* APIs which can be called by vp_batch() */
+static const struct {
+    const char *name;
+    const char *(*func)(char *);
+} _batch_api[] = {
+#define X(name) {#name, name},
+    VP_API_LIST
+#undef X
+};
 
+/*
+ * Call APIs in order in one libcall().  The arguments of each op are
+ * passed to the API as they are in args, so no copy is made.  Each result
+ * has its own error slot: an empty error and the values of the API, or
+ * the error message and no value.  An op is called even if the previous
+ * one failed.
+ */
 const char *
-vp_socket_read(char *args)
+vp_batch(char *args)
 {
-    return vp_file_read(args);
-}
+    VP_STATS_SCOPE(vp_batch, args);
+    vp_stack_t stack;
+    int nop;
+    char *name;
+    int argc;
+    char *end;
+    char *head;
+    const char *(*func)(char *);
+    const char *ret;
+    size_t len;
+    size_t nval;
+    const char *p;
+    int i;
+    int j;
 
-const char *
-vp_socket_write(char *args)
-{
-    return vp_file_write(args);
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &nop));
+
+    _batch.top = _batch.buf;
+    for (i = 0; i < nop; ++i) {
+        VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &name));
+        VP_RETURN_IF_FAIL(vp_stack_pop_num(&stack, "%d", &argc));
+        if (argc < 0)
+            return vp_stack_return_error(&_result, "argc range error: %d",
+                    argc);
+        /* the arguments of the op are the next argc values */
+        end = head = stack.top;
+        for (j = 0; j < argc; ++j) {
+            if (stack.top == stack.buf)
+                return vp_stack_return_error(&_result,
+                        "%s: too few arguments", name);
+            head = stack.top = vp_stack_pop_head(&stack);
+        }
+
+        func = NULL;
+        for (j = 0; j < (int)(sizeof(_batch_api) / sizeof(_batch_api[0])); ++j) {
+            if (strcmp(_batch_api[j].name, name) == 0) {
+                func = _batch_api[j].func;
+                break;
+            }
+        }
+        if (func == NULL || func == vp_batch) {
+            VP_RETURN_IF_FAIL(vp_stack_push_str(&_batch, "unknown API"));
+            VP_RETURN_IF_FAIL(vp_stack_push_num(&_batch, "%d", 0));
+            continue;
+        }
+
+        /* the head of argc is consumed; it terminates the arguments */
+        *end = '\0';
+        ret = func(head);
+        if (ret == NULL)
+            ret = "";
+        len = strlen(ret);
+        if (len > 0 && ret[len - 1] != VP_EOV) {
+            VP_RETURN_IF_FAIL(vp_stack_push_str(&_batch, ret));
+            VP_RETURN_IF_FAIL(vp_stack_push_num(&_batch, "%d", 0));
+            continue;
+        }
+        nval = 0;
+        for (p = ret; (p = strchr(p, VP_EOV)) != NULL; ++p)
+            ++nval;
+        VP_RETURN_IF_FAIL(vp_stack_push_str(&_batch, ""));
+        VP_RETURN_IF_FAIL(vp_stack_push_num(&_batch, "%zu", nval));
+        VP_RETURN_IF_FAIL(vp_stack_reserve(&_batch,
+                    (_batch.top - _batch.buf) + len + 1));
+        memcpy(_batch.top, ret, len);
+        _batch.top += len;
+    }
+    /* an error of an op is not an error of the batch */
+    vp_stack_failed = 0;
+    return vp_stack_return(&_batch);
 }
 
@@ -53,6 +53,7 @@ const int debug = 0;
 /* API */
 EXPORT const char *vp_dlopen(char *args);      /* [handle] (path) */
 EXPORT const char *vp_dlclose(char *args);     /* [] (handle) */
+EXPORT const char *vp_set_encoding(char *args);/* [encoding] (encoding) */
 
 EXPORT const char *vp_file_open(char *args);   /* [fd] (path, flags, mode) */
 EXPORT const char *vp_file_close(char *args);  /* [] (fd) */
@@ -120,6 +121,8 @@ vp_dlopen(char *args)
     VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
     VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &path));
 
+    vp_hex_init();
+
     handle = LoadLibrary(path);
     if (handle == NULL)
         return lasterror();
@@ -142,6 +145,27 @@ vp_dlclose(char *args)
     return NULL;
 }
 
+/* select the encoding of binary values: "hex" or "esc" */
+const char *
+vp_set_encoding(char *args)
+{
+    vp_stack_t stack;
+    char *encoding;
+
+    VP_RETURN_IF_FAIL(vp_stack_from_args(&stack, args));
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(&stack, &encoding));
+
+    if (strcmp(encoding, "hex") == 0)
+        vp_bin_encoding = VP_BIN_HEX;
+    else if (strcmp(encoding, "esc") == 0)
+        vp_bin_encoding = VP_BIN_ESC;
+    else
+        return vp_stack_return_error(&_result, "unknown encoding: %s",
+                encoding);
+    vp_stack_push_str(&_result, encoding);
+    return vp_stack_return(&_result);
+}
+
 
 const char *
 vp_file_open(char *args)
@@ -42,6 +42,15 @@ let s:last_status = 0
 if !exists('g:vimproc_dll_path')
   let g:vimproc_dll_path = expand("<sfile>:p:h") . (has('win32') || has('win64') || has('win32unix') ? '/proc.dll' : '/proc.so')
 endif
+if !exists('g:vimproc_drain_thread')
+  let g:vimproc_drain_thread = 0
+endif
+if !exists('g:vimproc_result_cap')
+  let g:vimproc_result_cap = 8388608
+endif
+if !exists('g:vimproc_pty_mode')
+  let g:vimproc_pty_mode = 'cooked'
+endif
 "}}}
 
 if has('iconv')
@@ -198,6 +207,14 @@ function! vimproc#system(cmdline, ...)"{{{
   endif
   
   let l:timeout = a:0 >= 2 ? a:2 : 0
+
+  let l:args = s:is_win ? [] : s:get_simple_command(a:cmdline)
+  if !empty(l:args)
+    " Spawn, feed, capture and reap in DLL.
+    let [l:output, s:last_errmsg, l:cond, s:last_status] =
+          \ s:vp_system(l:args, get(a:000, 0, ''), l:timeout)
+    return l:cond ==# 'timeout' ? '' : s:convert_newline(l:output)
+  endif
   
   " Open pipe.
   let l:subproc = (type(a:cmdline[0]) == type('')) ? 
@@ -248,14 +265,73 @@ function! vimproc#system(cmdline, ...)"{{{
 
   let [l:cond, s:last_status] = l:subproc.waitpid()
 
-  " Newline convert.
+  return s:convert_newline(l:output)
+endfunction"}}}
+function! vimproc#filter(cmdline, input, ...)"{{{
+  " Filter {input} by {cmdline} and return the output as a list of lines.
+  " {input} is a file name, or [line1, line2] of the current buffer.
+  let l:timeout = get(a:000, 0, 0)
+  let l:args = type(a:cmdline) == type('') ?
+        \ vimproc#parser#split_args(a:cmdline) : a:cmdline
+  if empty(l:args)
+    let s:last_status = 0
+    let s:last_errmsg = ''
+    return []
+  endif
+
+  if s:is_win
+    let l:input = type(a:input) == type([]) ?
+          \ getline(a:input[0], a:input[1]) : readfile(a:input)
+    let l:output = vimproc#system(l:args, join(l:input, "\n") . "\n", l:timeout)
+    return split(l:output, '\n')
+  endif
+
+  if type(a:input) == type([])
+    " The same as the filter of Vim; :write is much faster than
+    " writefile(getline()) for a large range.
+    let l:path_in = tempname()
+    silent execute 'keepalt noautocmd' a:input[0] . ',' . a:input[1]
+          \ . 'write!' fnameescape(l:path_in)
+  else
+    let l:path_in = fnamemodify(a:input, ':p')
+  endif
+  let l:path_out = tempname()
+
+  try
+    let [s:last_errmsg, l:cond, s:last_status] =
+          \ s:vp_filter(l:args, l:path_in, l:path_out, l:timeout)
+    return l:cond ==# 'timeout' ? [] : readfile(l:path_out)
+  finally
+    if type(a:input) == type([])
+      call delete(l:path_in)
+    endif
+    call delete(l:path_out)
+  endtry
+endfunction"}}}
+
+function! s:get_simple_command(cmdline)"{{{
+  " Return args if cmdline is a single command without pipe and
+  " redirection.  A string is left to popen3().
+  if type(a:cmdline) != type([])
+    return []
+  elseif type(a:cmdline[0]) == type('')
+    return a:cmdline
+  elseif len(a:cmdline) == 1 && len(a:cmdline[0].statement) == 1
+        \ && a:cmdline[0].statement[0].fd ==
+        \    { 'stdin' : '', 'stdout' : '', 'stderr' : '' }
+    return a:cmdline[0].statement[0].args
+  endif
+
+  return []
+endfunction"}}}
+function! s:convert_newline(output)"{{{
   if has('mac')
-    let l:output = substitute(l:output, '\r', '\n', 'g')
+    return substitute(a:output, '\r', '\n', 'g')
   elseif has('win32') || has('win64')
-    let l:output = substitute(l:output, '\r\n', '\n', 'g')
+    return substitute(a:output, '\r\n', '\n', 'g')
   endif
 
-  return l:output
+  return a:output
 endfunction"}}}
 function! vimproc#system_bg(cmdline)"{{{
   if type(a:cmdline) == type('')
@@ -282,6 +358,12 @@ function! vimproc#system_bg(cmdline)"{{{
     " Open pipe.
     let l:subproc = vimproc#popen3(a:cmdline)
     let s:bg_processes[l:subproc.pid] = l:subproc
+    for l:fd in [l:subproc.stdout, l:subproc.stderr]
+      let l:fd.bg_pid = l:subproc.pid
+      " Output is thrown away in DLL.
+      call vimproc#capture(l:fd, 'discard')
+      call vimproc#epoll_add(l:fd)
+    endfor
   endif
   
   return ''
@@ -316,6 +398,7 @@ function! vimproc#popen3(args)"{{{
 endfunction"}}}
 function! s:popen(npipe, args)"{{{
   let l:pipe = s:vp_pipe_open(a:npipe, s:convert_args(a:args))
+  let l:jobid = str2nr(remove(l:pipe, -1))
   if a:npipe == 3
     let [l:pid, l:fd_stdin, l:fd_stdout, l:fd_stderr] = l:pipe
   else
@@ -324,10 +407,13 @@ function! s:popen(npipe, args)"{{{
   
   let l:proc = {}
   let l:proc.pid = l:pid
+  let l:proc.jobid = l:jobid
   let l:proc.stdin = s:fdopen(l:fd_stdin, 'vp_pipe_close', 'vp_pipe_read', 'vp_pipe_write')
   let l:proc.stdout = s:fdopen(l:fd_stdout, 'vp_pipe_close', 'vp_pipe_read', 'vp_pipe_write')
+  call s:drain(l:fd_stdout)
   if a:npipe == 3
     let l:proc.stderr = s:fdopen(l:fd_stderr, 'vp_pipe_close', 'vp_pipe_read', 'vp_pipe_write')
+    call s:drain(l:fd_stderr)
   endif
   let l:proc.kill = s:funcref('vp_kill')
   let l:proc.waitpid = s:funcref('vp_waitpid')
@@ -351,12 +437,16 @@ function! vimproc#plineopen3(commands)"{{{
   return s:plineopen(3, a:commands)
 endfunction"}}}
 function! s:plineopen(npipe, commands)"{{{
+  if !s:is_win
+    return s:plineopen_native(a:npipe, a:commands)
+  endif
+
   let l:pid_list = []
   let l:stdin_list = []
   let l:stdout_list = []
   let l:stderr_list = []
   for l:command in a:commands
-    let l:pipe = s:vp_pipe_open(a:npipe, s:convert_args(l:command.args))
+    let l:pipe = s:vp_pipe_open(a:npipe, s:convert_args(l:command.args))[: -2]
     if a:npipe == 3
       let [l:pid, l:fd_stdin, l:fd_stdout, l:fd_stderr] = l:pipe
     else
@@ -404,6 +494,51 @@ function! s:plineopen(npipe, commands)"{{{
   return proc
 endfunction"}}}
 
+function! s:plineopen_native(npipe, commands)"{{{
+  " Stages are connected in DLL.
+  let [l:pid_list, l:fd_stdin, l:fd_stdout, l:fd_stderr_list, l:jobid] =
+        \ s:vp_pipeline_open(a:npipe, map(copy(a:commands), 's:convert_args(v:val.args)'))
+
+  let l:proc = {}
+  let l:proc.pid_list = l:pid_list
+  let l:proc.pid = l:pid_list[-1]
+  let l:proc.jobid = l:jobid
+  let l:proc.stdin = s:fdopen(l:fd_stdin, 'vp_pipe_close', 'vp_pipe_read', 'vp_pipe_write')
+  let l:proc.stdout = s:fdopen(l:fd_stdout, 'vp_pipe_close', 'vp_pipe_read', 'vp_pipe_write')
+  call s:drain(l:fd_stdout)
+  if a:npipe == 3
+    let l:stderr_list = []
+    for l:fd in l:fd_stderr_list
+      call s:drain(l:fd)
+      let l:stderr = s:fdopen(l:fd, 'vp_pipe_close', 'vp_pipe_read', 'vp_pipe_write')
+      let l:stderr.redirect_fd = []
+      call add(l:stderr_list, l:stderr)
+    endfor
+    let l:proc.stderr = s:fdopen_pipes(l:stderr_list, 'vp_pipes_all_close', 'read_pipes', 'write_pipes')
+  endif
+
+  " Redirect to files in DLL.
+  let l:stdout = get(get(a:commands[-1], 'fd', {}), 'stdout', '')
+  if l:stdout != '' && l:stdout != '/dev/clip'
+    " The file is already created by parser.
+    call s:redirect(l:proc.stdout, l:stdout, 'O_WRONLY|O_CREAT|O_APPEND')
+  endif
+  if a:npipe == 3
+    for l:i in range(len(a:commands))
+      let l:stderr = get(get(a:commands[l:i], 'fd', {}), 'stderr', '')
+      if l:stderr != '' && l:stderr != '/dev/clip'
+        call s:redirect(l:stderr_list[l:i], l:stderr, 'O_WRONLY|O_CREAT|O_TRUNC')
+      endif
+    endfor
+  endif
+
+  let l:proc.kill = s:funcref('vp_pipes_kill')
+  let l:proc.waitpid = s:funcref('vp_pipes_waitpid')
+  let l:proc.is_valid = 1
+
+  return proc
+endfunction"}}}
+
 function! vimproc#pgroup_open(statements)"{{{
   if type(a:statements) == type('')
     return vimproc#parser#pgroup_open(a:statements)
@@ -425,26 +560,30 @@ function! vimproc#pgroup_open(statements)"{{{
   return proc
 endfunction"}}}
 
-function! vimproc#ptyopen(args)"{{{
+function! vimproc#ptyopen(args, ...)"{{{
   if type(a:args) == type('')
-    return vimproc#parser#ptyopen(a:args)
+    return call('vimproc#parser#ptyopen', [a:args] + a:000)
   endif
+  let l:mode = get(a:000, 0, g:vimproc_pty_mode)
   
   if s:is_win
-    let [l:pid, l:fd_stdin, l:fd_stdout] = s:vp_pipe_open(2, s:convert_args(a:args))
+    let [l:pid, l:fd_stdin, l:fd_stdout, l:jobid] = s:vp_pipe_open(2, s:convert_args(a:args))
     let l:ttyname = ''
 
     let l:proc = s:fdopen_pty(l:fd_stdin, l:fd_stdout, 'vp_pty_close', 'vp_pty_read', 'vp_pty_write')
   else
-    let [l:pid, l:fd, l:ttyname] = s:vp_pty_open(winwidth(0)-5, winheight(0), s:convert_args(a:args))
+    let [l:pid, l:fd, l:ttyname, l:jobid] = s:vp_pty_open(winwidth(0)-5, winheight(0), l:mode, s:convert_args(a:args))
+    call s:drain(l:fd)
 
     let l:proc = s:fdopen(l:fd, 'vp_pty_close', 'vp_pty_read', 'vp_pty_write')
   endif
 
   let l:proc.pid = l:pid
+  let l:proc.jobid = l:jobid
   let l:proc.ttyname = l:ttyname
   let l:proc.get_winsize = s:funcref('vp_pty_get_winsize')
   let l:proc.set_winsize = s:funcref('vp_pty_set_winsize')
+  let l:proc.set_mode = s:funcref('vp_pty_set_mode')
   let l:proc.kill = s:funcref('vp_kill')
   let l:proc.waitpid = s:funcref('vp_waitpid')
   let l:proc.is_valid = 1
@@ -457,37 +596,301 @@ function! vimproc#socket_open(host, port)"{{{
   return s:fdopen(l:fd, 'vp_socket_close', 'vp_socket_read', 'vp_socket_write')
 endfunction"}}}
 
+function! vimproc#fd_buffers()"{{{
+  " Read ahead buffers in DLL.
+  let l:list = s:libcall('vp_fd_buffers', [])
+  let l:buffers = []
+  for l:i in range(0, len(l:list) - 1, 3)
+    call add(l:buffers, { 'fd' : str2nr(l:list[l:i]),
+          \ 'buffered' : str2nr(l:list[l:i+1]), 'size' : str2nr(l:list[l:i+2]) })
+  endfor
+  return l:buffers
+endfunction"}}}
+
+function! vimproc#epoll_add(fd)"{{{
+  " Register fd object to the readiness set in DLL.
+  call s:libcall('vp_epoll_add', [a:fd.fd])
+  let s:epoll_objects[a:fd.fd] = a:fd
+endfunction"}}}
+function! vimproc#epoll_del(fd)"{{{
+  if has_key(s:epoll_objects, a:fd.fd)
+    call s:libcall('vp_epoll_del', [a:fd.fd])
+    call remove(s:epoll_objects, a:fd.fd)
+  endif
+endfunction"}}}
+function! vimproc#epoll_wait(...)"{{{
+  " Return [fd object, output] of registered ones which are ready.
+  let l:timeout = get(a:000, 0, s:read_timeout)
+  let l:number = get(a:000, 1, -1)
+  " Ready ones found by the garbage collector go first.
+  let l:ready = s:epoll_pending
+  let s:epoll_pending = []
+  return l:ready + s:epoll_wait(empty(l:ready) ? l:timeout : 0, l:number)
+endfunction"}}}
+function! s:epoll_wait(timeout, number)"{{{
+  let l:list = s:libcall('vp_epoll_wait', [a:number, a:timeout])
+  let l:ready = []
+  for l:i in range(0, len(l:list) - 1, 3)
+    let [l:fdnum, l:hd, l:eof] = l:list[l:i : l:i + 2]
+    let l:fd = get(s:epoll_objects, l:fdnum, {})
+    if empty(l:fd)
+      continue
+    endif
+    let l:fd.eof = l:eof
+    if l:eof
+      " Removed in DLL.
+      call remove(s:epoll_objects, l:fdnum)
+    endif
+    call add(l:ready, [l:fd, s:decode(l:hd)])
+  endfor
+  return l:ready
+endfunction"}}}
+
+function! vimproc#reap_all()"{{{
+  " Return [pid, cond, status] of processes exited since the last call.
+  let l:list = s:libcall('vp_reap_all', [])
+  let l:exited = s:reap_pending
+  let s:reap_pending = []
+  for l:i in range(0, len(l:list) - 1, 3)
+    call add(l:exited, [l:list[l:i], l:list[l:i + 1], str2nr(l:list[l:i + 2])])
+  endfor
+  return l:exited
+endfunction"}}}
+
+function! vimproc#job_status_all()"{{{
+  " Return the state of every job in one call.
+  if s:is_win
+    " No job table.
+    return []
+  endif
+
+  let l:list = s:libcall('vp_job_status_all', [])
+  let l:jobs = []
+  for l:i in range(0, len(l:list) - 1, 6)
+    call add(l:jobs, {
+          \ 'jobid' : str2nr(l:list[l:i]), 'pid' : str2nr(l:list[l:i + 1]),
+          \ 'cond' : l:list[l:i + 2], 'status' : str2nr(l:list[l:i + 3]),
+          \ 'time' : str2nr(l:list[l:i + 4]), 'buffered' : str2nr(l:list[l:i + 5]),
+          \ })
+  endfor
+  return l:jobs
+endfunction"}}}
+
+function! vimproc#stats(...)"{{{
+  " Return counters of each libcall.  Clear them if {reset} is given.
+  if s:is_win
+    throw 'vimproc: vimproc#stats() is not supported on Windows.'
+  endif
+
+  let l:reset = get(a:000, 0, 0)
+  let l:list = s:libcall('vp_stats', [l:reset])
+  let l:stats = { 'result' : { 'size' : str2nr(l:list[0]), 'max' : str2nr(l:list[1]) },
+        \ 'calls' : {} }
+  for l:i in range(2, len(l:list) - 1, 11)
+    let [l:name, l:calls, l:errors, l:bytes_in, l:bytes_out, l:time, l:max_time,
+          \ l:poll_time, l:syscalls, l:max_arg, l:hist] = l:list[l:i : l:i + 10]
+    " [usec, count]: count calls took less than usec.
+    let l:histogram = map(split(l:hist, ','),
+          \ 'map(split(v:val, ":"), "str2nr(v:val)")')
+    call map(l:histogram, '[v:val[0] == 0 ? 1 : 2 * float2nr(pow(2, v:val[0] - 1)), v:val[1]]')
+    let l:stats.calls[l:name] = {
+          \ 'calls' : str2nr(l:calls), 'errors' : str2nr(l:errors),
+          \ 'bytes_in' : str2nr(l:bytes_in), 'bytes_out' : str2nr(l:bytes_out),
+          \ 'time' : str2nr(l:time), 'max_time' : str2nr(l:max_time),
+          \ 'poll_time' : str2nr(l:poll_time), 'syscalls' : str2nr(l:syscalls),
+          \ 'max_arg' : str2nr(l:max_arg), 'histogram' : l:histogram,
+          \ }
+  endfor
+  return l:stats
+endfunction"}}}
+
+function! vimproc#trace_start(...)"{{{
+  " Record the last {nevent} spans of libcalls and syscalls.
+  call s:libcall('vp_trace_start', [get(a:000, 0, 65536)])
+endfunction"}}}
+function! vimproc#trace_stop()"{{{
+  call s:libcall('vp_trace_stop', [])
+endfunction"}}}
+function! vimproc#trace_dump(path)"{{{
+  " Write Chrome trace event JSON, and return the number of spans.
+  let [l:count] = s:libcall('vp_trace_dump', [fnamemodify(a:path, ':p')])
+  return str2nr(l:count)
+endfunction"}}}
+function! vimproc#trace_slow(msec, ...)"{{{
+  " Log libcalls which took {msec} or more to {path}.  0 stops it.
+  let l:path = a:0 > 0 ? fnamemodify(a:1, ':p') : ''
+  if a:msec > 0 && l:path == ''
+    throw 'vimproc: vimproc#trace_slow() needs a path.'
+  endif
+  call s:libcall('vp_trace_slow', [a:msec, l:path])
+endfunction"}}}
+
+function! vimproc#batch(ops)"{{{
+  " Call [name, args] of {ops} in one libcall.  Return [error, values] of
+  " each; error is '' if it succeeded.
+  if s:is_win
+    throw 'vimproc: vimproc#batch() is not supported on Windows.'
+  endif
+
+  let l:args = [len(a:ops)]
+  for [l:name, l:op_args] in a:ops
+    let l:args += [l:name, len(l:op_args)] + l:op_args
+  endfor
+  let l:list = s:libcall('vp_batch', l:args)
+
+  let l:results = []
+  let l:i = 0
+  while l:i < len(l:list)
+    let l:nval = str2nr(l:list[l:i + 1])
+    call add(l:results, [l:list[l:i], l:list[l:i + 2 : l:i + 1 + l:nval]])
+    let l:i += 2 + l:nval
+  endwhile
+  return l:results
+endfunction"}}}
+
+function! vimproc#capture(fd, mode, ...)"{{{
+  " Keep output of {fd} in DLL by {mode}: 'discard', 'bytes', 'lines',
+  " 'spill' or 'all'.
+  if s:is_win
+    throw 'vimproc: vimproc#capture() is not supported on Windows.'
+  endif
+  call s:libcall('vp_capture_set', [a:fd.fd, a:mode, get(a:000, 0, 0)])
+endfunction"}}}
+function! vimproc#capture_read(fd, ...)"{{{
+  " Return the last {nlines} lines kept by vimproc#capture().
+  let [l:hd, l:eof, l:total, l:dropped] = s:libcall('vp_capture_read',
+        \ [a:fd.fd, get(a:000, 0, -1)])
+  let a:fd.eof = l:eof
+  return { 'output' : s:decode(l:hd), 'eof' : str2nr(l:eof),
+        \  'total' : str2nr(l:total), 'dropped' : str2nr(l:dropped) }
+endfunction"}}}
+
 function! vimproc#kill(pid, sig)"{{{
   call s:libcall('vp_kill', [a:pid, a:sig])
 endfunction"}}}
 
-function! s:close() dict"{{{
-  if self.is_valid
-    call self.f_close()
+function! s:drain(fd)"{{{
+  if s:drain_started
+    " Read by the thread in DLL while Vim is idle.
+    call s:libcall('vp_drain_register', [a:fd])
   endif
-  
-  let self.is_valid = 0
-  let self.eof = 1
-  let self.fd = -1
+endfunction"}}}
+
+function! s:close() dict"{{{
+  try
+    if self.is_valid
+      " Queued bytes are written before eof.
+      call self.f_close()
+    endif
+  finally
+    if type(self.fd) != type([]) && type(self.fd) != type({})
+          \ && has_key(s:epoll_objects, self.fd)
+      " Removed in DLL.
+      call remove(s:epoll_objects, self.fd)
+    endif
+
+    let self.is_valid = 0
+    let self.eof = 1
+    let self.fd = -1
+  endtry
 endfunction"}}}
 function! s:read(...) dict"{{{
+  if !self.is_valid
+    " Closed by close() or waitpid().
+    let self.eof = 1
+    return ''
+  endif
   let l:number = get(a:000, 0, -1)
   let l:timeout = get(a:000, 1, s:read_timeout)
   let [l:hd, l:eof] = self.f_read(l:number, l:timeout)
   let self.eof = l:eof
-  return s:hd2str(l:hd)
+  return s:decode(l:hd)
+endfunction"}}}
+function! s:read_records(framing, ...) dict"{{{
+  if !self.is_valid
+    let self.eof = 1
+    return []
+  endif
+  let l:number = get(a:000, 0, -1)
+  let l:timeout = get(a:000, 1, s:read_timeout)
+  let l:records = self.f_read_records(a:framing, l:number, l:timeout)
+  let self.eof = remove(l:records, -1)
+  return map(l:records, 's:decode(v:val)')
+endfunction"}}}
+function! s:read_lines(...) dict"{{{
+  return call(self.read_records, ['line'] + a:000, self)
+endfunction"}}}
+function! s:read_ansi(...) dict"{{{
+  " Escape sequences are decoded in DLL.  Return [text, ops].
+  if !self.is_valid
+    let self.eof = 1
+    return ['', []]
+  endif
+  let l:number = get(a:000, 0, -1)
+  let l:timeout = get(a:000, 1, s:read_timeout)
+  let l:list = self.f_read_ansi(l:number, l:timeout)
+  let self.eof = l:list[1]
+  let l:ops = []
+  for l:i in range(2, len(l:list) - 1, 5)
+    call add(l:ops, [l:list[l:i]] + map(l:list[l:i+1 : l:i+4], 'str2nr(v:val)'))
+  endfor
+  return [s:decode(l:list[0]), l:ops]
+endfunction"}}}
+function! s:read_until(kind, pattern, ...) dict"{{{
+  " Wait in DLL until {pattern} is read.  Return [output, found].
+  if !self.is_valid
+    let self.eof = 1
+    return ['', 0]
+  endif
+  let l:timeout = get(a:000, 0, s:read_timeout)
+  let [l:hd, l:found, l:eof] = self.f_read_until(a:kind, a:pattern, l:timeout)
+  let self.eof = l:eof
+  return [s:decode(l:hd), str2nr(l:found)]
 endfunction"}}}
 function! s:write(str, ...) dict"{{{
   let l:timeout = get(a:000, 0, s:write_timeout)
-  let l:hd = s:str2hd(a:str)
+  let l:hd = s:encode(a:str)
   return self.f_write(l:hd, l:timeout)
 endfunction"}}}
+function! s:write_async(str) dict"{{{
+  " Queue in DLL what is not written now.  Return queued bytes.
+  return self.f_write_async(s:encode(a:str))
+endfunction"}}}
+function! s:flush(...) dict"{{{
+  " Wait for queued bytes to be written.  Return the bytes left.
+  let l:timeout = get(a:000, 0, 0)
+  return self.f_flush(l:timeout)
+endfunction"}}}
+
+function! s:redirect(fd, path, flags)"{{{
+  " Output of fd object goes to the file without reading into Vim.
+  " 420 == 0644
+  let a:fd.fd_to = s:vp_file_open(a:path, a:flags, 420)
+  let a:fd.redirected = 0
+  let a:fd.read = s:funcref('read_redirect')
+  let a:fd.f_close = s:funcref('vp_pipe_redirect_close')
+endfunction"}}}
+function! s:read_redirect(...) dict"{{{
+  let l:number = get(a:000, 0, -1)
+  let l:timeout = get(a:000, 1, s:read_timeout)
+  let [l:nbytes, l:eof] = s:libcall('vp_pipe_redirect',
+        \ [self.fd, self.fd_to, l:number, l:timeout])
+  let self.redirected += l:nbytes
+  let self.eof = l:eof
+  return ''
+endfunction"}}}
 
 function! s:fdopen(fd, f_close, f_read, f_write)"{{{
   return {
         \'fd' : a:fd, 'eof' : 0, 'is_valid' : 1,  
         \'f_close' : s:funcref(a:f_close), 'f_read' : s:funcref(a:f_read), 'f_write' : s:funcref(a:f_write), 
-        \'close' : s:funcref('close'), 'read' : s:funcref('read'), 'write' : s:funcref('write')
+        \'f_read_records' : s:funcref(a:f_read . '_records'),
+        \'close' : s:funcref('close'), 'read' : s:funcref('read'), 'write' : s:funcref('write'),
+        \'read_records' : s:funcref('read_records'), 'read_lines' : s:funcref('read_lines'),
+        \'f_read_ansi' : s:funcref(a:f_read . '_ansi'), 'read_ansi' : s:funcref('read_ansi'),
+        \'f_read_until' : s:funcref(a:f_read . '_until'), 'read_until' : s:funcref('read_until'),
+        \'f_write_async' : s:funcref(a:f_write . '_async'), 'write_async' : s:funcref('write_async'),
+        \'f_flush' : s:funcref(substitute(a:f_write, '_write$', '_flush', '')), 'flush' : s:funcref('flush')
         \}
 endfunction"}}}
 function! s:fdopen_pty(fd_stdin, fd_stdout, f_close, f_read, f_write)"{{{
@@ -513,38 +916,98 @@ function! s:fdopen_pgroup(proc, fd, f_close, f_read, f_write)"{{{
 endfunction"}}}
 
 function! s:garbage_collect()"{{{
-  for l:proc in values(s:bg_processes)
-    " Check processes.
-    if !l:proc.stdout.eof
-      call l:proc.stdout.read(-1, 0)
+  " Only ready fds are read.  Output of background processes is discarded
+  " in DLL, and only eof is returned.  The pending ones of user are not
+  " returned here, so the pipes of background processes are always read.
+  for [l:fd, l:output] in s:epoll_wait(0, -1)
+    if !has_key(l:fd, 'bg_pid')
+      " Registered by user.  Keep it for the next vimproc#epoll_wait().
+      call add(s:epoll_pending, [l:fd, l:output])
+    endif
+  endfor
+
+  " Exited processes are reaped in DLL at once.
+  for l:exited in vimproc#reap_all()
+    let l:proc = get(s:bg_processes, l:exited[0], {})
+    if empty(l:proc)
+      " Keep it for the next vimproc#reap_all().
+      call add(s:reap_pending, l:exited)
       continue
     endif
-    
+
     try
+      " Close pipes.  The status is kept in DLL.
       let [l:cond, s:last_status] = l:proc.waitpid()
-      if l:cond != 'exit'
-        " Kill process.
-        " 15 == SIGTERM
-        call l:proc.kill(15)
-      endif
     catch
       " Ignore error.
     endtry
 
     call remove(s:bg_processes, l:proc.pid)
-    if empty(s:bg_processes)
-      unlet s:bg_processes
-
-      augroup vimproc
-        autocmd!
-      augroup END
-    endif
   endfor
+
+  if empty(s:bg_processes)
+    unlet s:bg_processes
+
+    autocmd! vimproc CursorHold
+  endif
 endfunction"}}}
 
 "-----------------------------------------------------------
 " UTILS
 
+" Binary value encoding.  It is negotiated with DLL in initialize.
+let s:encoding = 'hex'
+
+function! s:encode(str)
+  return s:encoding ==# 'esc' ? s:str2esc(a:str) : s:str2hd(a:str)
+endfunction
+
+function! s:decode(bin)
+  return s:encoding ==# 'esc' ? s:esc2str(a:bin) : s:hd2str(a:bin)
+endfunction
+
+" Escape sequences of "esc" encoding.
+let s:esc_table = { '0' : '', '1' : "\xFF", '2' : "\x01" }
+
+function! s:str2esc(str)
+  " Vim string never contains \x00.
+  return s:str_replace(s:str_replace(a:str, "\x01", "\x012"), "\xFF", "\x011")
+endfunction
+
+function! s:esc2str(esc)
+  if stridx(a:esc, "\x01") < 0
+    " Not escaped.
+    return a:esc
+  endif
+
+  " Since Vim can not handle \x00 byte, remove it.
+  let l:list = s:str_split(a:esc, "\x01")
+  if !empty(filter(l:list[1:], '!has_key(s:esc_table, v:val[0])'))
+    throw 'vimproc: Invalid escape sequence in a value from DLL.'
+  endif
+  return l:list[0] . join(map(l:list[1:],
+        \ 's:esc_table[v:val[0]] . v:val[1:]'), '')
+endfunction
+
+function! s:str_split(str, sep)
+  " Note: Do not use split().  Regexp matches "\xFF" to U+00FF in utf-8.
+  let l:list = []
+  let l:start = 0
+  let l:pos = stridx(a:str, a:sep)
+  while l:pos >= 0
+    call add(l:list, strpart(a:str, l:start, l:pos - l:start))
+    let l:start = l:pos + len(a:sep)
+    let l:pos = stridx(a:str, a:sep, l:start)
+  endwhile
+  call add(l:list, strpart(a:str, l:start))
+
+  return l:list
+endfunction
+
+function! s:str_replace(str, from, to)
+  return stridx(a:str, a:from) < 0 ? a:str : join(s:str_split(a:str, a:from), a:to)
+endfunction
+
 function! s:str2hd(str)
   return join(map(range(len(a:str)), 'printf("%02X", char2nr(a:str[v:val]))'), '')
 endfunction
@@ -622,13 +1085,16 @@ augroup END
 let s:lasterr = []
 let s:read_timeout = 100
 let s:write_timeout = 100
+let s:epoll_objects = {}
+let s:epoll_pending = []
+let s:reap_pending = []
 
 function! s:libcall(func, args)"{{{
   " End Of Value
   let l:EOV = "\xFF"
   let l:args = empty(a:args) ? '' : (join(reverse(copy(a:args)), l:EOV) . l:EOV)
   let l:stack_buf = libcall(g:vimproc_dll_path, a:func, l:args)
-  let l:result = split(l:stack_buf, '[\xFF]', 1)
+  let l:result = s:str_split(l:stack_buf, l:EOV)
   if !empty(l:result) && l:result[-1] != ''
     let s:lasterr = l:result
     let l:msg = string(l:result)
@@ -668,6 +1134,16 @@ function! s:vp_dlclose(handle)
   call s:libcall('vp_dlclose', [a:handle])
 endfunction
 
+function! s:vp_set_encoding(encoding)
+  try
+    let [l:encoding] = s:libcall('vp_set_encoding', [a:encoding])
+  catch
+    " Old DLL supports hexdump only.
+    let l:encoding = 'hex'
+  endtry
+  return l:encoding
+endfunction
+
 function! s:vp_file_open(path, flags, mode)
   let [l:fd] = s:libcall('vp_file_open', [a:path, a:flags, a:mode])
   return l:fd
@@ -690,6 +1166,28 @@ function! s:vp_file_write(hd, timeout) dict
   return l:nleft
 endfunction
 
+function! s:vp_file_read_records(framing, number, timeout) dict
+  return s:libcall('vp_file_read_records', [self.fd, a:framing, a:number, a:timeout])
+endfunction
+
+function! s:vp_file_read_ansi(number, timeout) dict
+  return s:libcall('vp_file_read_ansi', [self.fd, a:number, a:timeout])
+endfunction
+
+function! s:vp_file_read_until(kind, pattern, timeout) dict
+  return s:libcall('vp_file_read_until', [self.fd, a:kind, a:pattern, a:timeout])
+endfunction
+
+function! s:vp_file_write_async(hd) dict
+  let [l:nqueued] = s:libcall('vp_file_write_async', [self.fd, a:hd])
+  return l:nqueued
+endfunction
+
+function! s:vp_file_flush(timeout) dict
+  let [l:nqueued] = s:libcall('vp_file_flush', [self.fd, a:timeout])
+  return l:nqueued
+endfunction
+
 function! s:vp_pipe_open(npipe, argv)"{{{
   if s:is_win
     let l:cmdline = ''
@@ -697,6 +1195,8 @@ function! s:vp_pipe_open(npipe, argv)"{{{
       let l:cmdline .= '"' . substitute(arg, '"', '\\"', 'g') . '" '
     endfor
     let [l:pid; l:fdlist] = s:libcall('vp_pipe_open', [a:npipe, l:cmdline])
+    " No job table.
+    let l:fdlist += [0]
   else
     let [l:pid; l:fdlist] = s:libcall('vp_pipe_open',
           \ [a:npipe, len(a:argv)] + a:argv)
@@ -705,6 +1205,32 @@ function! s:vp_pipe_open(npipe, argv)"{{{
   return [l:pid] + l:fdlist
 endfunction"}}}
 
+function! s:vp_system(args, input, timeout)"{{{
+  let l:argv = s:convert_args(a:args)
+  let [l:out, l:err, l:cond, l:status] = s:libcall('vp_system',
+        \ [s:encode(a:input), a:timeout, len(l:argv)] + l:argv)
+  return [s:decode(l:out), s:decode(l:err), l:cond, str2nr(l:status)]
+endfunction"}}}
+
+function! s:vp_filter(args, path_in, path_out, timeout)"{{{
+  let l:argv = s:convert_args(a:args)
+  let [l:out, l:err, l:cond, l:status] = s:libcall('vp_filter',
+        \ [a:path_in, a:path_out, a:timeout, len(l:argv)] + l:argv)
+  return [s:decode(l:err), l:cond, str2nr(l:status)]
+endfunction"}}}
+
+function! s:vp_pipeline_open(npipe, argv_list)"{{{
+  let l:args = [a:npipe, len(a:argv_list)]
+  for l:argv in a:argv_list
+    let l:args += [len(l:argv)] + l:argv
+  endfor
+  let l:nstage = len(a:argv_list)
+  let l:list = map(s:libcall('vp_pipeline_open', l:args), 'str2nr(v:val)')
+
+  return [l:list[: l:nstage - 1], l:list[l:nstage], l:list[l:nstage + 1],
+        \ l:list[l:nstage + 2 : -2], l:list[-1]]
+endfunction"}}}
+
 function! s:vp_pipe_close() dict
   if self.fd != 0
     call s:libcall('vp_pipe_close', [self.fd])
@@ -712,6 +1238,14 @@ function! s:vp_pipe_close() dict
   endif
 endfunction
 
+function! s:vp_pipe_redirect_close() dict
+  call call('s:vp_pipe_close', [], self)
+  if self.fd_to != 0
+    call s:libcall('vp_file_close', [self.fd_to])
+    let self.fd_to = 0
+  endif
+endfunction
+
 function! s:vp_pipes_front_close() dict
   call self.fd[0].close()
 endfunction
@@ -720,6 +1254,12 @@ function! s:vp_pipes_back_close() dict
   call self.fd[-1].close()
 endfunction
 
+function! s:vp_pipes_all_close() dict
+  for l:fd in self.fd
+    call l:fd.close()
+  endfor
+endfunction
+
 function! s:vp_pgroup_close() dict
   call self.fd.close()
 endfunction
@@ -734,12 +1274,73 @@ function! s:vp_pipe_write(hd, timeout) dict
   return l:nleft
 endfunction
 
+function! s:vp_pipe_read_records(framing, number, timeout) dict
+  return s:libcall('vp_pipe_read_records', [self.fd, a:framing, a:number, a:timeout])
+endfunction
+
+function! s:vp_pipe_read_ansi(number, timeout) dict
+  return s:libcall('vp_pipe_read_ansi', [self.fd, a:number, a:timeout])
+endfunction
+
+function! s:vp_pipe_read_until(kind, pattern, timeout) dict
+  return s:libcall('vp_pipe_read_until', [self.fd, a:kind, a:pattern, a:timeout])
+endfunction
+
+function! s:vp_pipe_write_async(hd) dict
+  let [l:nqueued] = s:libcall('vp_pipe_write_async', [self.fd, a:hd])
+  return l:nqueued
+endfunction
+
+function! s:vp_pipe_flush(timeout) dict
+  let [l:nqueued] = s:libcall('vp_pipe_flush', [self.fd, a:timeout])
+  return l:nqueued
+endfunction
+
 function! s:read_pipes(...) dict"{{{
   let l:number = get(a:000, 0, -1)
   let l:timeout = get(a:000, 1, s:read_timeout)
   
   let l:output = ''
   let l:eof = 0
+
+  if !s:is_win
+    " Read all pipes by one poll().  Redirected ones are moved in DLL.
+    let l:wait = empty(filter(copy(self.fd),
+          \ '!v:val.eof && !has_key(v:val, "fd_to")')) ? l:timeout : 0
+    for l:fd in filter(copy(self.fd), 'has_key(v:val, "fd_to") && !v:val.eof')
+      call l:fd.read(l:number, l:wait)
+      let l:wait = 0
+    endfor
+    let l:list = s:vp_poll_read(self.fd, l:number, l:timeout)
+    for l:i in range(len(self.fd))
+      let l:fd = self.fd[l:i]
+      if l:list[l:i] != ''
+        if empty(l:fd.redirect_fd)
+          " Append output.
+          let l:output .= l:list[l:i]
+        else
+          " Write pipe.
+          for l:redirect_fd in l:fd.redirect_fd
+            call l:redirect_fd.write(l:list[l:i])
+          endfor
+        endif
+      endif
+
+      if l:fd.eof
+        " Close pipe.
+        for l:redirect_fd in l:fd.redirect_fd
+          if l:redirect_fd.fd >= 0
+            call l:redirect_fd.close()
+          endif
+        endfor
+      endif
+    endfor
+
+    let self.eof = empty(filter(copy(self.fd), '!v:val.eof'))
+
+    return l:output
+  endif
+
   for l:fd in self.fd
     if !l:fd.eof
       let l:read = l:fd.read(l:number, l:timeout)
@@ -771,6 +1372,25 @@ function! s:read_pipes(...) dict"{{{
   return l:output
 endfunction"}}}
 
+function! s:vp_poll_read(fds, number, timeout)"{{{
+  " Read fd objects by one poll().  Return the outputs in the same order.
+  let l:targets = filter(copy(a:fds), '!v:val.eof && !has_key(v:val, "fd_to")')
+  if empty(l:targets)
+    return map(copy(a:fds), '""')
+  endif
+
+  let l:result = s:libcall('vp_poll_read',
+        \ [a:number, a:timeout, len(l:targets)] + map(copy(l:targets), 'v:val.fd'))
+  let l:outputs = {}
+  for l:i in range(len(l:targets))
+    let [l:fd, l:hd, l:eof] = l:result[l:i * 3 : l:i * 3 + 2]
+    let l:outputs[l:fd] = s:decode(l:hd)
+    let l:targets[l:i].eof = l:eof
+  endfor
+
+  return map(copy(a:fds), 'get(l:outputs, v:val.fd, "")')
+endfunction"}}}
+
 function! s:write_pipes(str, ...) dict"{{{
   let l:timeout = get(a:000, 0, s:write_timeout)
   
@@ -863,14 +1483,14 @@ endfunction"}}}
 
 if s:is_win
   " For Windows.
-  function! s:vp_pty_open(width, height, argv)
+  function! s:vp_pty_open(width, height, mode, argv)
     let l:cmdline = ''
     for arg in a:argv
       let l:cmdline .= '"' . substitute(arg, '"', '\\"', 'g') . '" '
     endfor
     let [l:pid, l:fd_stdin, l:fd_stdout, l:ttyname] = s:libcall('vp_pty_open',
           \ [a:width, a:height, l:cmdline])
-    return [l:pid, l:fd_stdin, l:fd_stdout, l:ttyname]
+    return [l:pid, l:fd_stdin, l:fd_stdout, l:ttyname, 0]
   endfunction
 
   function! s:vp_pty_close() dict
@@ -903,11 +1523,15 @@ if s:is_win
     " Not implemented.
     "call s:libcall('vp_pty_set_winsize', [self.fd_stdout, a:width, a:height])
   endfunction
+
+  function! s:vp_pty_set_mode(mode) dict
+    " Not implemented.
+  endfunction
 else
-  function! s:vp_pty_open(width, height, argv)
-    let [l:pid, l:fd, l:ttyname] = s:libcall('vp_pty_open',
-          \ [a:width, a:height, len(a:argv)] + a:argv)
-    return [l:pid, l:fd, l:ttyname]
+  function! s:vp_pty_open(width, height, mode, argv)
+    let [l:pid, l:fd, l:ttyname, l:jobid] = s:libcall('vp_pty_open',
+          \ [a:width, a:height, a:mode, len(a:argv)] + a:argv)
+    return [l:pid, l:fd, l:ttyname, str2nr(l:jobid)]
   endfunction
 
   function! s:vp_pty_close() dict
@@ -924,6 +1548,28 @@ else
     return l:nleft
   endfunction
 
+  function! s:vp_pty_read_records(framing, number, timeout) dict
+    return s:libcall('vp_pty_read_records', [self.fd, a:framing, a:number, a:timeout])
+  endfunction
+
+  function! s:vp_pty_read_ansi(number, timeout) dict
+    return s:libcall('vp_pty_read_ansi', [self.fd, a:number, a:timeout])
+  endfunction
+
+  function! s:vp_pty_read_until(kind, pattern, timeout) dict
+    return s:libcall('vp_pty_read_until', [self.fd, a:kind, a:pattern, a:timeout])
+  endfunction
+
+  function! s:vp_pty_write_async(hd) dict
+    let [l:nqueued] = s:libcall('vp_pty_write_async', [self.fd, a:hd])
+    return l:nqueued
+  endfunction
+
+  function! s:vp_pty_flush(timeout) dict
+    let [l:nqueued] = s:libcall('vp_pty_flush', [self.fd, a:timeout])
+    return l:nqueued
+  endfunction
+
   function! s:vp_pty_get_winsize() dict
     let [width, height] = s:libcall('vp_pty_get_winsize', [self.fd])
     return [width, height]
@@ -935,6 +1581,10 @@ else
     " Send SIGWINCH = 28 signal.
     call vimproc#kill(self.pid, 28)
   endfunction
+
+  function! s:vp_pty_set_mode(mode) dict
+    call s:libcall('vp_pty_set_mode', [self.fd, a:mode])
+  endfunction
 endif
 
 function! s:vp_kill(sig) dict
@@ -945,7 +1595,7 @@ function! s:vp_kill(sig) dict
     call self.stdout.close()
   endif
   if has_key(self, 'stderr')
-    call self.stdout.close()
+    call self.stderr.close()
   endif
   if has_key(self, 'ttyname')
     call self.close()
@@ -963,7 +1613,7 @@ function! s:vp_pipes_kill(sig) dict
     call self.stdout.close()
   endif
   if has_key(self, 'stderr')
-    call self.stdout.close()
+    call self.stderr.close()
   endif
   if has_key(self, 'ttyname')
     call self.close()
@@ -983,7 +1633,7 @@ function! s:vp_pgroup_kill(sig) dict
     call self.stdout.close()
   endif
   if has_key(self, 'stderr')
-    call self.stdout.close()
+    call self.stderr.close()
   endif
   if has_key(self, 'ttyname')
     call self.close()
@@ -1002,7 +1652,7 @@ function! s:vp_waitpid() dict
     call self.stdout.close()
   endif
   if has_key(self, 'stderr')
-    call self.stdout.close()
+    call self.stderr.close()
   endif
   if has_key(self, 'ttyname')
     call self.close()
@@ -1010,9 +1660,31 @@ function! s:vp_waitpid() dict
   
   let [l:cond, l:status] = s:libcall('vp_waitpid', [self.pid])
   let self.is_valid = 0
+  call s:reap_forget(self.pid)
   return [l:cond, str2nr(l:status)]
 endfunction
 
+function! s:vp_pipes_waitpid() dict
+  " Reap every stage.  The status is the last one's.
+  let [l:cond, l:status] = call('s:vp_waitpid', [], self)
+  for l:pid in self.pid_list[: -2]
+    try
+      call s:libcall('vp_waitpid', [l:pid])
+    catch
+      " Ignore error.
+    endtry
+    call s:reap_forget(l:pid)
+  endfor
+  return [l:cond, l:status]
+endfunction
+
+function! s:reap_forget(pid)
+  " The exit kept by the garbage collector is not reported once waited.
+  if !empty(s:reap_pending)
+    call filter(s:reap_pending, 'v:val[0] != a:pid')
+  endif
+endfunction
+
 function! s:vp_pgroup_waitpid() dict
   let [l:cond, l:status] = 
         \ has_key(self, 'cond') && has_key(self, 'status') ?
@@ -1042,9 +1714,41 @@ function! s:vp_socket_write(hd, timeout) dict
   return l:nleft
 endfunction
 
+function! s:vp_socket_read_records(framing, number, timeout) dict
+  return s:libcall('vp_socket_read_records', [self.fd, a:framing, a:number, a:timeout])
+endfunction
+
+function! s:vp_socket_read_ansi(number, timeout) dict
+  return s:libcall('vp_socket_read_ansi', [self.fd, a:number, a:timeout])
+endfunction
+
+function! s:vp_socket_read_until(kind, pattern, timeout) dict
+  return s:libcall('vp_socket_read_until', [self.fd, a:kind, a:pattern, a:timeout])
+endfunction
+
+function! s:vp_socket_write_async(hd) dict
+  let [l:nqueued] = s:libcall('vp_socket_write_async', [self.fd, a:hd])
+  return l:nqueued
+endfunction
+
+function! s:vp_socket_flush(timeout) dict
+  let [l:nqueued] = s:libcall('vp_socket_flush', [self.fd, a:timeout])
+  return l:nqueued
+endfunction
+
 " Initialize.
 if !exists('s:dlhandle')
   let s:dll_handle = s:vp_dlopen(g:vimproc_dll_path)
+  let s:encoding = s:vp_set_encoding('esc')
+  if !s:is_win
+    call s:libcall('vp_set_result_cap', [g:vimproc_result_cap])
+  endif
+  let s:drain_started = 0
+  if g:vimproc_drain_thread && !s:is_win
+    " 1048576 == ring size per fd
+    call s:libcall('vp_drain_start', [1048576])
+    let s:drain_started = 1
+  endif
 endif
 
 " Restore 'cpoptions' {{{
@@ -65,18 +65,18 @@ function! vimproc#parser#popen2(cmdline)"{{{
   return vimproc#popen2(vimproc#parser#split_args(a:cmdline))
 endfunction"}}}
 function! vimproc#parser#plineopen2(args)"{{{
-  return vimproc#popen2(vimproc#parser#parse_pipe(a:args))
+  return vimproc#plineopen2(vimproc#parser#parse_pipe(a:args))
 endfunction"}}}
 
 function! vimproc#parser#popen3(cmdline)"{{{
   return vimproc#popen3(vimproc#parser#split_args(a:cmdline))
 endfunction"}}}
 function! vimproc#parser#plineopen3(args)"{{{
-  return vimproc#popen3(vimproc#parser#parse_pipe(a:args))
+  return vimproc#plineopen3(vimproc#parser#parse_pipe(a:args))
 endfunction"}}}
 
-function! vimproc#parser#ptyopen(cmdline)"{{{
-  return vimproc#ptyopen(vimproc#parser#split_args(a:cmdline))
+function! vimproc#parser#ptyopen(cmdline, ...)"{{{
+  return call('vimproc#ptyopen', [vimproc#parser#split_args(a:cmdline)] + a:000)
 endfunction"}}}
 
 function! vimproc#parser#pgroup_open(cmdline)"{{{
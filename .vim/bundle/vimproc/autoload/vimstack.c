@@ -8,6 +8,11 @@
 #include <stdarg.h>
 #include <errno.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define VP_HEX_X86
+# include <immintrin.h>
+#endif
+
 /*
  * Argument and Result are Stack. Each value is EOV terminated String.
  * Number can be stored as String.
@@ -19,8 +24,43 @@
 #define VP_EOV '\xFF'
 #define VP_EOV_STR "\xFF"
 
+/*
+ * Binary value encoding.
+ * VP_BIN_HEX: hexdump.  Each byte is two hex digits.
+ * VP_BIN_ESC: bytes are passed through.  Only NUL, EOV and VP_ESC are
+ *             escaped as VP_ESC followed by '0', '1' or '2'.
+ */
+#define VP_BIN_HEX 0
+#define VP_BIN_ESC 1
+
+/* Escape */
+#define VP_ESC '\x01'
+
+static int vp_bin_encoding = VP_BIN_HEX;
+
+/* the last return, for statistics */
+static size_t vp_stack_returned = 0;    /* bytes returned */
+static int vp_stack_failed = 0;         /* error message was returned */
+
+/*
+ * Hexdump codec.  The kernel is selected by vp_hex_init() at vp_dlopen().
+ * encode writes size * 2 upper case digits.
+ * decode reads size * 2 digits, returns -1 for invalid digit.  dst may be
+ * same as src (decode in place).
+ */
+typedef void (*vp_hex_encode_t)(char *dst, const unsigned char *src, size_t size);
+typedef int (*vp_hex_decode_t)(unsigned char *dst, const char *src, size_t size);
+
+static vp_hex_encode_t vp_hex_encode = NULL;
+static vp_hex_decode_t vp_hex_decode = NULL;
+static const char *vp_hex_kernel = NULL;
+static const signed char vp_hex_values[256];
+
 #define VP_NUM_BUFSIZE 64
 #define VP_NUMFMT_BUFSIZE 16
+#define VP_STACK_INDEX_MAX 32
+#define VP_STACK_KEEP_SIZE (1024 * 1024)
+#define VP_STACK_SHRINK_COUNT 16
 #define VP_INITIAL_BUFSIZE 512
 #define VP_ERRMSG_SIZE 512
 
@@ -30,16 +70,29 @@
         if (vp_err) return vp_err;  \
     } while (0)
 
-/* buf:var|EOV|var|EOV|top:free buffer|buf+size */
+/*
+ * buf:var|EOV|var|EOV|top:free buffer|buf+size
+ *
+ * The arguments are indexed by vp_stack_from_args(): val[i] is the head
+ * of the i-th value, so that a pop does not scan the value backward.
+ * nval is -1 if the stack is not indexed (a result, or too many values).
+ *
+ * A result buffer grown by a large result is shrunk to VP_STACK_KEEP_SIZE
+ * when VP_STACK_SHRINK_COUNT results in a row have used less than a
+ * quarter of it.
+ */
 typedef struct vp_stack_t {
     size_t size; /* stack size */
     char *buf;   /* stack bufffer */
     char *top;   /* stack top */
+    int nval;    /* number of indexed values */
+    int nsmall;  /* number of small results in a row */
+    char *val[VP_STACK_INDEX_MAX];
 } vp_stack_t;
 
 /* use for initialize */
-#define VP_STACK_NULL {0, NULL, NULL}
-static vp_stack_t vp_stack_null = {0, NULL, NULL};
+#define VP_STACK_NULL {0, NULL, NULL, -1, 0, {NULL}}
+static vp_stack_t vp_stack_null = VP_STACK_NULL;
 
 static void vp_stack_free(vp_stack_t *stack);
 static const char *vp_stack_from_args(vp_stack_t *stack, char *args);
@@ -47,11 +100,34 @@ static const char *vp_stack_return(vp_stack_t *stack);
 static const char *vp_stack_return_error(vp_stack_t *stack, const char *fmt, ...);
 static const char *vp_stack_reserve(vp_stack_t *stack, size_t needsize);
 static const char *vp_stack_pop_num(vp_stack_t *stack, const char *fmt, void *ptr);
+static const char *vp_stack_pop_int(vp_stack_t *stack, int *num);
+static const char *vp_stack_pop_ushort(vp_stack_t *stack, unsigned short *num);
+static const char *vp_stack_pop_ptr(vp_stack_t *stack, void **ptr);
 static const char *vp_stack_pop_str(vp_stack_t *stack, char **str);
 static const char *vp_stack_pop_bin(vp_stack_t *stack, char **buf, size_t *size);
+static const char *vp_stack_pop_hex(vp_stack_t *stack, char **buf, size_t *size);
+static const char *vp_stack_pop_esc(vp_stack_t *stack, char **buf, size_t *size);
 static const char *vp_stack_push_num(vp_stack_t *stack, const char *fmt, ...);
+static const char *vp_stack_push_int(vp_stack_t *stack, long long num);
+static const char *vp_stack_push_uint(vp_stack_t *stack, unsigned long long num);
 static const char *vp_stack_push_str(vp_stack_t *stack, const char *str);
 static const char *vp_stack_push_bin(vp_stack_t *stack, const char *buf, size_t size);
+static const char *vp_stack_push_hex(vp_stack_t *stack, const char *buf, size_t size);
+static const char *vp_stack_push_esc(vp_stack_t *stack, const char *buf, size_t size);
+
+static char *vp_stack_pop_head(vp_stack_t *stack);
+static const char *vp_stack_pop_dec(vp_stack_t *stack, int neg, unsigned long limit, long long *num);
+static size_t vp_fmt_uint(char *dst, unsigned long long num);
+
+static void vp_hex_init(void);
+static void vp_hex_encode_scalar(char *dst, const unsigned char *src, size_t size);
+static int vp_hex_decode_scalar(unsigned char *dst, const char *src, size_t size);
+#ifdef VP_HEX_X86
+static void vp_hex_encode_sse2(char *dst, const unsigned char *src, size_t size);
+static int vp_hex_decode_sse2(unsigned char *dst, const char *src, size_t size);
+static void vp_hex_encode_avx2(char *dst, const unsigned char *src, size_t size);
+static int vp_hex_decode_avx2(unsigned char *dst, const char *src, size_t size);
+#endif
 
 static void
 vp_stack_free(vp_stack_t *stack)
@@ -64,24 +140,51 @@ vp_stack_free(vp_stack_t *stack)
     }
 }
 
-/* make readonly stack from arguments */
+/* make readonly stack from arguments and index the values */
 static const char *
 vp_stack_from_args(vp_stack_t *stack, char *args)
 {
+    char *p;
+    char *eov;
+
+    stack->nval = 0;
     if (args == NULL || args[0] == '\0') {
         stack->size = 0;
         stack->buf = NULL;
         stack->top = NULL;
-    } else {
-        stack->size = strlen(args); /* don't count end of NUL. */
-        stack->buf = args;
-        stack->top = stack->buf + stack->size;
-        if (stack->top[-1] != VP_EOV)
-            return "vp_stack_from_buf: no EOV";
+        return NULL;
+    }
+    stack->buf = args;
+    for (p = args; (eov = strchr(p, VP_EOV)) != NULL; p = eov + 1) {
+        if (stack->nval == VP_STACK_INDEX_MAX) {
+            /* too many values; pop scans them */
+            stack->nval = -1;
+            p += strlen(p);
+            break;
+        }
+        stack->val[stack->nval++] = p;
     }
+    if (*p != '\0' || p[-1] != VP_EOV)
+        return "vp_stack_from_buf: no EOV";
+    stack->top = p;
+    stack->size = p - args; /* don't count end of NUL. */
     return NULL;
 }
 
+/* head of the top value, which is popped.  stack must not be empty. */
+static char *
+vp_stack_pop_head(vp_stack_t *stack)
+{
+    char *top;
+
+    if (stack->nval > 0)
+        return stack->val[--stack->nval];
+    top = stack->top - 1;
+    while (top != stack->buf && top[-1] != VP_EOV)
+        --top;
+    return top;
+}
+
 /* clear stack top and return stack buffer */
 static const char *
 vp_stack_return(vp_stack_t *stack)
@@ -90,6 +193,11 @@ vp_stack_return(vp_stack_t *stack)
      * cleared when no value is assigned. */
     if (stack->top != NULL)
         stack->top[0] = '\0';
+    vp_stack_returned = stack->top - stack->buf;
+    if (vp_stack_returned < stack->size / 4)
+        ++stack->nsmall;
+    else
+        stack->nsmall = 0;
     stack->top = stack->buf;
     return stack->buf;
 }
@@ -109,6 +217,7 @@ vp_stack_return_error(vp_stack_t *stack, const char *fmt, ...)
     stack->top += vsnprintf(stack->top,
             stack->size - (stack->top - stack->buf), fmt, ap);
     va_end(ap);
+    vp_stack_failed = 1;
     return vp_stack_return(stack);
 }
 
@@ -116,6 +225,18 @@ vp_stack_return_error(vp_stack_t *stack, const char *fmt, ...)
 static const char *
 vp_stack_reserve(vp_stack_t *stack, size_t needsize)
 {
+    /* the returned buffer has been copied by Vim before the next push */
+    if (stack->top == stack->buf && stack->size > VP_STACK_KEEP_SIZE
+            && stack->nsmall >= VP_STACK_SHRINK_COUNT
+            && needsize <= VP_STACK_KEEP_SIZE) {
+        char *newbuf = (char *)realloc(stack->buf, VP_STACK_KEEP_SIZE);
+
+        if (newbuf != NULL) {
+            stack->buf = stack->top = newbuf;
+            stack->size = VP_STACK_KEEP_SIZE;
+        }
+        stack->nsmall = 0;
+    }
     if (needsize > stack->size) {
         size_t newsize;
         char *newbuf;
@@ -135,6 +256,7 @@ vp_stack_reserve(vp_stack_t *stack, size_t needsize)
     return NULL;
 }
 
+/* "%d", "%hu" and "%p" are parsed by hand, others by sscanf() */
 static const char *
 vp_stack_pop_num(vp_stack_t *stack, const char *fmt, void *ptr)
 {
@@ -142,12 +264,17 @@ vp_stack_pop_num(vp_stack_t *stack, const char *fmt, void *ptr)
     int n;
     char *top;
 
+    if (strcmp(fmt, "%d") == 0)
+        return vp_stack_pop_int(stack, (int *)ptr);
+    if (strcmp(fmt, "%hu") == 0)
+        return vp_stack_pop_ushort(stack, (unsigned short *)ptr);
+    if (strcmp(fmt, "%p") == 0)
+        return vp_stack_pop_ptr(stack, (void **)ptr);
+
     if (stack->buf == stack->top)
         return "vp_stack_pop_num: stack over flow";
 
-    top = stack->top - 1;
-    while (top != stack->buf && top[-1] != VP_EOV)
-        --top;
+    top = vp_stack_pop_head(stack);
 
     strcpy(fmtbuf, fmt);
     strcat(fmtbuf, "%n");
@@ -159,6 +286,103 @@ vp_stack_pop_num(vp_stack_t *stack, const char *fmt, void *ptr)
     return NULL;
 }
 
+/*
+ * Decimal with an optional sign, up to limit in magnitude (limit + 1 for
+ * a negative number if neg is allowed).  top is not moved on error.
+ */
+static const char *
+vp_stack_pop_dec(vp_stack_t *stack, int neg, unsigned long limit,
+        long long *num)
+{
+    char *top;
+    char *p;
+    unsigned long long n = 0;
+    int minus = 0;
+
+    if (stack->buf == stack->top)
+        return "vp_stack_pop_num: stack over flow";
+
+    p = top = vp_stack_pop_head(stack);
+    if (*p == '-' && neg) {
+        minus = 1;
+        ++p;
+    } else if (*p == '+') {
+        ++p;
+    }
+    if (*p == VP_EOV)
+        goto error;
+    for (; *p != VP_EOV; ++p) {
+        if (*p < '0' || '9' < *p)
+            goto error;
+        n = n * 10 + (*p - '0');
+        if (n > limit + minus)
+            goto error;
+    }
+    *num = minus ? -(long long)n : (long long)n;
+    stack->top = top;
+    return NULL;
+
+error:
+    if (stack->nval >= 0)
+        ++stack->nval;
+    return "vp_stack_pop_num: sscanf error";
+}
+
+static const char *
+vp_stack_pop_int(vp_stack_t *stack, int *num)
+{
+    long long n;
+
+    VP_RETURN_IF_FAIL(vp_stack_pop_dec(stack, 1, 2147483647UL, &n));
+    *num = (int)n;
+    return NULL;
+}
+
+static const char *
+vp_stack_pop_ushort(vp_stack_t *stack, unsigned short *num)
+{
+    long long n;
+
+    VP_RETURN_IF_FAIL(vp_stack_pop_dec(stack, 0, 65535UL, &n));
+    *num = (unsigned short)n;
+    return NULL;
+}
+
+/* hex digits with an optional "0x", as printed by "%p" */
+static const char *
+vp_stack_pop_ptr(vp_stack_t *stack, void **ptr)
+{
+    char *top;
+    char *p;
+    size_t n = 0;
+    int ndigit = 0;
+
+    if (stack->buf == stack->top)
+        return "vp_stack_pop_num: stack over flow";
+
+    p = top = vp_stack_pop_head(stack);
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X') && p[2] != VP_EOV)
+        p += 2;
+    for (; *p != VP_EOV; ++p) {
+        int d = vp_hex_values[(unsigned char)*p];
+
+        if (d < 0 || ++ndigit > (int)sizeof(void *) * 2) {
+            if (stack->nval >= 0)
+                ++stack->nval;
+            return "vp_stack_pop_num: sscanf error";
+        }
+        n = (n << 4) | d;
+    }
+    if (ndigit == 0) {
+        if (stack->nval >= 0)
+            ++stack->nval;
+        return "vp_stack_pop_num: sscanf error";
+    }
+    *ptr = (void *)n;
+    stack->top = top;
+    return NULL;
+}
+
 /* str will be invalid after vp_stack_push_*() */
 static const char *
 vp_stack_pop_str(vp_stack_t *stack, char **str)
@@ -168,9 +392,7 @@ vp_stack_pop_str(vp_stack_t *stack, char **str)
     if (stack->buf == stack->top)
         return "vp_stack_pop_str: stack over flow";
 
-    top = stack->top - 1;
-    while (top != stack->buf && top[-1] != VP_EOV)
-        --top;
+    top = vp_stack_pop_head(stack);
 
     *str = top;
     stack->top[-1] = '\0';
@@ -178,64 +400,439 @@ vp_stack_pop_str(vp_stack_t *stack, char **str)
     return NULL;
 }
 
-/* bin is hexdump */
+/* bin is encoded by vp_bin_encoding */
 static const char *
 vp_stack_pop_bin(vp_stack_t *stack, char **buf, size_t *size)
+{
+    if (vp_bin_encoding == VP_BIN_ESC)
+        return vp_stack_pop_esc(stack, buf, size);
+    return vp_stack_pop_hex(stack, buf, size);
+}
+
+static const char *
+vp_stack_pop_hex(vp_stack_t *stack, char **buf, size_t *size)
+{
+    size_t len;
+
+    VP_RETURN_IF_FAIL(vp_stack_pop_str(stack, buf));
+    len = strlen(*buf);
+    if (len % 2 != 0)
+        return "vp_stack_pop_hex: odd length";
+    if (vp_hex_decode == NULL)
+        vp_hex_init();
+    if (vp_hex_decode((unsigned char *)*buf, *buf, len / 2) != 0)
+        return "vp_stack_pop_hex: invalid digit";
+    *size = len / 2;
+    return NULL;
+}
+
+/* decode in place.  the decoded value is never longer than encoded one. */
+static const char *
+vp_stack_pop_esc(vp_stack_t *stack, char **buf, size_t *size)
 {
     char *p;
-    unsigned num;
+    char *q;
 
     VP_RETURN_IF_FAIL(vp_stack_pop_str(stack, buf));
-    *size = 0;
-    p = *buf;
+    p = q = *buf;
     while (*p) {
-        /* "%0.2x" is warned by gcc. */
-        if (sscanf(p, "%2x", &num) != 1)
-            return "vp_stack_pop_bin: sscanf error";
-        (*buf)[*size] = num;
-        *size += 1;
+        if (*p != VP_ESC) {
+            *q++ = *p++;
+            continue;
+        }
+        switch (p[1]) {
+        case '0': *q++ = '\0';    break;
+        case '1': *q++ = VP_EOV;  break;
+        case '2': *q++ = VP_ESC;  break;
+        default:
+            return "vp_stack_pop_esc: invalid escape";
+        }
         p += 2;
     }
+    *size = q - *buf;
     return NULL;
 }
 
+/* decimal integer formats are written by hand, others by vsprintf() */
 static const char *
 vp_stack_push_num(vp_stack_t *stack, const char *fmt, ...)
 {
     va_list ap;
     char buf[VP_NUM_BUFSIZE];
+    const char *ret;
 
     va_start(ap, fmt);
-    if (vsprintf(buf, fmt, ap) < 0) {
-        va_end(ap);
-        return "vp_stack_push_num: vsprintf error";
-    }
+    if (strcmp(fmt, "%d") == 0 || strcmp(fmt, "%hu") == 0)
+        ret = vp_stack_push_int(stack, va_arg(ap, int));
+    else if (strcmp(fmt, "%u") == 0)
+        ret = vp_stack_push_uint(stack, va_arg(ap, unsigned int));
+    else if (strcmp(fmt, "%ld") == 0)
+        ret = vp_stack_push_int(stack, va_arg(ap, long));
+    else if (strcmp(fmt, "%lld") == 0)
+        ret = vp_stack_push_int(stack, va_arg(ap, long long));
+    else if (strcmp(fmt, "%llu") == 0)
+        ret = vp_stack_push_uint(stack, va_arg(ap, unsigned long long));
+    else if (strcmp(fmt, "%zu") == 0)
+        ret = vp_stack_push_uint(stack, va_arg(ap, size_t));
+    else if (vsprintf(buf, fmt, ap) < 0)
+        ret = "vp_stack_push_num: vsprintf error";
+    else
+        ret = vp_stack_push_str(stack, buf);
     va_end(ap);
-    return vp_stack_push_str(stack, buf);
+    return ret;
+}
+
+static const char *
+vp_stack_push_int(vp_stack_t *stack, long long num)
+{
+    size_t needsize;
+
+    needsize = (stack->top - stack->buf) + VP_NUM_BUFSIZE;
+    VP_RETURN_IF_FAIL(vp_stack_reserve(stack, needsize));
+    if (num < 0) {
+        *(stack->top++) = '-';
+        stack->top += vp_fmt_uint(stack->top, -(unsigned long long)num);
+    } else {
+        stack->top += vp_fmt_uint(stack->top, num);
+    }
+    *(stack->top++) = VP_EOV;
+    return NULL;
+}
+
+static const char *
+vp_stack_push_uint(vp_stack_t *stack, unsigned long long num)
+{
+    size_t needsize;
+
+    needsize = (stack->top - stack->buf) + VP_NUM_BUFSIZE;
+    VP_RETURN_IF_FAIL(vp_stack_reserve(stack, needsize));
+    stack->top += vp_fmt_uint(stack->top, num);
+    *(stack->top++) = VP_EOV;
+    return NULL;
+}
+
+static const char vp_dec_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+
+/* decimal of num without NUL; two digits a step.  returns the length. */
+static size_t
+vp_fmt_uint(char *dst, unsigned long long num)
+{
+    char buf[20];   /* 18446744073709551615 */
+    char *p = buf + sizeof(buf);
+    size_t len;
+
+    while (num >= 100) {
+        unsigned int i = (unsigned int)(num % 100) * 2;
+
+        num /= 100;
+        *--p = vp_dec_pairs[i + 1];
+        *--p = vp_dec_pairs[i];
+    }
+    if (num >= 10) {
+        *--p = vp_dec_pairs[num * 2 + 1];
+        *--p = vp_dec_pairs[num * 2];
+    } else {
+        *--p = (char)('0' + num);
+    }
+    len = buf + sizeof(buf) - p;
+    memcpy(dst, p, len);
+    return len;
 }
 
 static const char *
 vp_stack_push_str(vp_stack_t *stack, const char *str)
 {
     size_t needsize;
+    size_t len = strlen(str);
 
-    needsize = (stack->top - stack->buf) + strlen(str) + sizeof(VP_EOV_STR);
+    needsize = (stack->top - stack->buf) + len + sizeof(VP_EOV_STR);
     VP_RETURN_IF_FAIL(vp_stack_reserve(stack, needsize));
-    stack->top += sprintf(stack->top, "%s%c", str, VP_EOV);
+    memcpy(stack->top, str, len);
+    stack->top += len;
+    *(stack->top++) = VP_EOV;
     return NULL;
 }
 
 static const char *
 vp_stack_push_bin(vp_stack_t *stack, const char *buf, size_t size)
+{
+    if (vp_bin_encoding == VP_BIN_ESC)
+        return vp_stack_push_esc(stack, buf, size);
+    return vp_stack_push_hex(stack, buf, size);
+}
+
+static const char *
+vp_stack_push_hex(vp_stack_t *stack, const char *buf, size_t size)
 {
     size_t needsize;
-    size_t i;
 
     needsize = (stack->top - stack->buf) + (size * 2) + sizeof(VP_EOV_STR);
     VP_RETURN_IF_FAIL(vp_stack_reserve(stack, needsize));
-    for (i = 0; i < size; ++i)
-        /* is this slow? */
-        stack->top += sprintf(stack->top, "%02X", buf[i] & 0xFF);
+    if (vp_hex_encode == NULL)
+        vp_hex_init();
+    vp_hex_encode(stack->top, (const unsigned char *)buf, size);
+    stack->top += size * 2;
     *(stack->top++) = VP_EOV;
     return NULL;
 }
+
+static const char *
+vp_stack_push_esc(vp_stack_t *stack, const char *buf, size_t size)
+{
+    size_t needsize;
+    const char *p;
+    const char *end;
+    char *top;
+
+    /* count escapes first so that the buffer is reserved only once. */
+    needsize = (stack->top - stack->buf) + size + sizeof(VP_EOV_STR);
+    end = buf + size;
+    for (p = buf; p < end; ++p)
+        if (*p == '\0' || *p == VP_EOV || *p == VP_ESC)
+            ++needsize;
+    VP_RETURN_IF_FAIL(vp_stack_reserve(stack, needsize));
+
+    top = stack->top;
+    for (p = buf; p < end; ++p) {
+        switch (*p) {
+        case '\0':    *top++ = VP_ESC; *top++ = '0'; break;
+        case VP_EOV:  *top++ = VP_ESC; *top++ = '1'; break;
+        case VP_ESC:  *top++ = VP_ESC; *top++ = '2'; break;
+        default:      *top++ = *p;                   break;
+        }
+    }
+    *(top++) = VP_EOV;
+    stack->top = top;
+    return NULL;
+}
+
+/* select the fastest hex kernel for this CPU */
+static void
+vp_hex_init(void)
+{
+    vp_hex_encode = vp_hex_encode_scalar;
+    vp_hex_decode = vp_hex_decode_scalar;
+    vp_hex_kernel = "scalar";
+#ifdef VP_HEX_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        vp_hex_encode = vp_hex_encode_avx2;
+        vp_hex_decode = vp_hex_decode_avx2;
+        vp_hex_kernel = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        vp_hex_encode = vp_hex_encode_sse2;
+        vp_hex_decode = vp_hex_decode_sse2;
+        vp_hex_kernel = "sse2";
+    }
+#endif
+}
+
+static const char vp_hex_digits[] = "0123456789ABCDEF";
+
+/* digit value, or -1 */
+static const signed char vp_hex_values[256] = {
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+     0, 1, 2, 3, 4, 5, 6, 7, 8, 9,-1,-1,-1,-1,-1,-1,
+    -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
+};
+
+static void
+vp_hex_encode_scalar(char *dst, const unsigned char *src, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; ++i) {
+        dst[i * 2] = vp_hex_digits[src[i] >> 4];
+        dst[i * 2 + 1] = vp_hex_digits[src[i] & 0x0F];
+    }
+}
+
+static int
+vp_hex_decode_scalar(unsigned char *dst, const char *src, size_t size)
+{
+    size_t i;
+    int hi;
+    int lo;
+
+    for (i = 0; i < size; ++i) {
+        hi = vp_hex_values[(unsigned char)src[i * 2]];
+        lo = vp_hex_values[(unsigned char)src[i * 2 + 1]];
+        if ((hi | lo) < 0)
+            return -1;
+        dst[i] = (hi << 4) | lo;
+    }
+    return 0;
+}
+
+#ifdef VP_HEX_X86
+
+/* nibble (0-15) to upper case digit */
+#define VP_HEX_NIBBLE_SSE2(n)                                           \
+    _mm_add_epi8(_mm_add_epi8((n), _mm_set1_epi8('0')),                 \
+            _mm_and_si128(_mm_cmpgt_epi8((n), _mm_set1_epi8(9)),        \
+                _mm_set1_epi8('A' - '0' - 10)))
+
+/* digit to value.  *valid gets 0xFF for each valid digit. */
+#define VP_HEX_VALUE_SSE2(c, valid)                                     \
+    do {                                                                \
+        __m128i vp_l = _mm_or_si128((c), _mm_set1_epi8(0x20));          \
+        __m128i vp_dg = _mm_and_si128(                                  \
+                _mm_cmpgt_epi8((c), _mm_set1_epi8('0' - 1)),            \
+                _mm_cmplt_epi8((c), _mm_set1_epi8('9' + 1)));           \
+        __m128i vp_al = _mm_and_si128(                                  \
+                _mm_cmpgt_epi8(vp_l, _mm_set1_epi8('a' - 1)),           \
+                _mm_cmplt_epi8(vp_l, _mm_set1_epi8('f' + 1)));          \
+        (valid) = _mm_or_si128(vp_dg, vp_al);                           \
+        (c) = _mm_or_si128(                                             \
+                _mm_and_si128(vp_dg,                                    \
+                    _mm_sub_epi8((c), _mm_set1_epi8('0'))),             \
+                _mm_and_si128(vp_al,                                    \
+                    _mm_sub_epi8(vp_l, _mm_set1_epi8('a' - 10))));      \
+    } while (0)
+
+__attribute__((target("sse2")))
+static void
+vp_hex_encode_sse2(char *dst, const unsigned char *src, size_t size)
+{
+    size_t i;
+    __m128i v;
+    __m128i hi;
+    __m128i lo;
+
+    for (i = 0; i + 16 <= size; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(src + i));
+        hi = _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0F));
+        lo = _mm_and_si128(v, _mm_set1_epi8(0x0F));
+        hi = VP_HEX_NIBBLE_SSE2(hi);
+        lo = VP_HEX_NIBBLE_SSE2(lo);
+        _mm_storeu_si128((__m128i *)(dst + i * 2), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *)(dst + i * 2 + 16),
+                _mm_unpackhi_epi8(hi, lo));
+    }
+    vp_hex_encode_scalar(dst + i * 2, src + i, size - i);
+}
+
+__attribute__((target("sse2")))
+static int
+vp_hex_decode_sse2(unsigned char *dst, const char *src, size_t size)
+{
+    size_t i;
+    __m128i a;
+    __m128i b;
+    __m128i va;
+    __m128i vb;
+    __m128i mask = _mm_set1_epi16(0x00FF);
+
+    for (i = 0; i + 16 <= size; i += 16) {
+        a = _mm_loadu_si128((const __m128i *)(src + i * 2));
+        b = _mm_loadu_si128((const __m128i *)(src + i * 2 + 16));
+        VP_HEX_VALUE_SSE2(a, va);
+        VP_HEX_VALUE_SSE2(b, vb);
+        if (_mm_movemask_epi8(_mm_and_si128(va, vb)) != 0xFFFF)
+            return -1;
+        /* 16bit lane is (lo << 8 | hi) */
+        a = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(a, mask), 4),
+                _mm_srli_epi16(a, 8));
+        b = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b, mask), 4),
+                _mm_srli_epi16(b, 8));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(a, b));
+    }
+    return vp_hex_decode_scalar(dst + i, src + i * 2, size - i);
+}
+
+#define VP_HEX_NIBBLE_AVX2(n)                                           \
+    _mm256_add_epi8(_mm256_add_epi8((n), _mm256_set1_epi8('0')),        \
+            _mm256_and_si256(_mm256_cmpgt_epi8((n), _mm256_set1_epi8(9)), \
+                _mm256_set1_epi8('A' - '0' - 10)))
+
+#define VP_HEX_VALUE_AVX2(c, valid)                                     \
+    do {                                                                \
+        __m256i vp_l = _mm256_or_si256((c), _mm256_set1_epi8(0x20));    \
+        __m256i vp_dg = _mm256_andnot_si256(                            \
+                _mm256_cmpgt_epi8((c), _mm256_set1_epi8('9')),          \
+                _mm256_cmpgt_epi8((c), _mm256_set1_epi8('0' - 1)));     \
+        __m256i vp_al = _mm256_andnot_si256(                            \
+                _mm256_cmpgt_epi8(vp_l, _mm256_set1_epi8('f')),         \
+                _mm256_cmpgt_epi8(vp_l, _mm256_set1_epi8('a' - 1)));    \
+        (valid) = _mm256_or_si256(vp_dg, vp_al);                        \
+        (c) = _mm256_or_si256(                                          \
+                _mm256_and_si256(vp_dg,                                 \
+                    _mm256_sub_epi8((c), _mm256_set1_epi8('0'))),       \
+                _mm256_and_si256(vp_al,                                 \
+                    _mm256_sub_epi8(vp_l, _mm256_set1_epi8('a' - 10))));\
+    } while (0)
+
+__attribute__((target("avx2")))
+static void
+vp_hex_encode_avx2(char *dst, const unsigned char *src, size_t size)
+{
+    size_t i;
+    __m256i v;
+    __m256i hi;
+    __m256i lo;
+    __m256i x;
+    __m256i y;
+
+    for (i = 0; i + 32 <= size; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)(src + i));
+        hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0F));
+        lo = _mm256_and_si256(v, _mm256_set1_epi8(0x0F));
+        hi = VP_HEX_NIBBLE_AVX2(hi);
+        lo = VP_HEX_NIBBLE_AVX2(lo);
+        /* unpack works in each 128bit lane. */
+        x = _mm256_unpacklo_epi8(hi, lo);
+        y = _mm256_unpackhi_epi8(hi, lo);
+        _mm256_storeu_si256((__m256i *)(dst + i * 2),
+                _mm256_permute2x128_si256(x, y, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + i * 2 + 32),
+                _mm256_permute2x128_si256(x, y, 0x31));
+    }
+    vp_hex_encode_sse2(dst + i * 2, src + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static int
+vp_hex_decode_avx2(unsigned char *dst, const char *src, size_t size)
+{
+    size_t i;
+    __m256i a;
+    __m256i b;
+    __m256i va;
+    __m256i vb;
+    __m256i mask = _mm256_set1_epi16(0x00FF);
+
+    for (i = 0; i + 32 <= size; i += 32) {
+        a = _mm256_loadu_si256((const __m256i *)(src + i * 2));
+        b = _mm256_loadu_si256((const __m256i *)(src + i * 2 + 32));
+        VP_HEX_VALUE_AVX2(a, va);
+        VP_HEX_VALUE_AVX2(b, vb);
+        if (_mm256_movemask_epi8(_mm256_and_si256(va, vb)) != -1)
+            return -1;
+        a = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(a, mask), 4),
+                _mm256_srli_epi16(a, 8));
+        b = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(b, mask), 4),
+                _mm256_srli_epi16(b, 8));
+        /* pack works in each 128bit lane. */
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8));
+    }
+    return vp_hex_decode_sse2(dst + i, src + i * 2, size - i);
+}
+
+#endif /* VP_HEX_X86 */
@@ -0,0 +1,173 @@
+/* vim:set sw=4 sts=4 et: */
+/**
+ * FILE:   drain_stress.c
+ * Stress test of the drain thread with many high-output jobs.
+ *
+ *   $ cc -O2 -pthread -o drain_stress bench/drain_stress.c -lutil
+ *   $ ./drain_stress [njobs [lines [idle [tick]]]]
+ *
+ * njobs children run "seq 1 lines" at once.  Vim is idle for idle msec
+ * first and reads nothing, then reads every fd by vp_file_read(fd, -1, 0)
+ * once per tick msec (0 reads as fast as possible, which races the thread
+ * the most).  It is run without and with the drain thread, and the output
+ * of every job must be the same.  The number of children which finished
+ * while Vim was idle and the time until all output is read are reported.
+ */
+
+#include "../autoload/proc.c"
+
+#define JOB_MAX 256
+
+typedef struct {
+    pid_t pid;
+    int fd;
+    int eof;
+    int exited;
+    size_t bytes;
+    unsigned long hash;
+} job_t;
+
+static double
+now_msec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* call an API with one number argument */
+static const char *
+call1(const char *(*func)(char *), int n)
+{
+    char args[32];
+
+    snprintf(args, sizeof(args), "%d" VP_EOV_STR, n);
+    return func(args);
+}
+
+/* FNV-1a of the encoded output; chunks of hex concatenate. */
+static void
+hash_update(job_t *job, const char *p, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i)
+        job->hash = (job->hash ^ (unsigned char)p[i]) * 16777619UL;
+    job->bytes += len / 2;
+}
+
+static int
+reap(int njobs, job_t *jobs)
+{
+    int status;
+    int n = 0;
+    int i;
+
+    for (i = 0; i < njobs; ++i) {
+        if (!jobs[i].exited
+                && waitpid(jobs[i].pid, &status, WNOHANG) == jobs[i].pid)
+            jobs[i].exited = 1;
+        n += jobs[i].exited;
+    }
+    return n;
+}
+
+static void
+run(int njobs, int lines, int idle, int tick, int drain, job_t *jobs)
+{
+    char count[32];
+    char *argv[] = {"/usr/bin/env", "seq", "1", count, NULL};
+    int fd[3];
+    char args[64];
+    const char *ret;
+    const char *sep;
+    double start = now_msec();
+    int nidle;
+    int neof = 0;
+    int i;
+
+    snprintf(count, sizeof(count), "%d", lines);
+    if (drain && (ret = call1(vp_drain_start, 1024 * 1024)) != NULL) {
+        fprintf(stderr, "vp_drain_start: %s\n", ret);
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < njobs; ++i) {
+        if (vp_pipe_exec(argv, 2, fd, &jobs[i].pid) != NULL) {
+            perror("vp_pipe_exec");
+            exit(EXIT_FAILURE);
+        }
+        close(fd[0]);
+        jobs[i].fd = fd[1];
+        jobs[i].eof = jobs[i].exited = 0;
+        jobs[i].bytes = 0;
+        jobs[i].hash = 2166136261UL;
+        if (drain && (ret = call1(vp_drain_register, fd[1])) != NULL) {
+            fprintf(stderr, "vp_drain_register: %s\n", ret);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    poll(NULL, 0, idle);
+    nidle = reap(njobs, jobs);
+
+    while (neof < njobs) {
+        if (tick > 0)
+            poll(NULL, 0, tick);
+        for (i = 0; i < njobs; ++i) {
+            if (jobs[i].eof)
+                continue;
+            /* (fd, nr, timeout) */
+            snprintf(args, sizeof(args), "0" VP_EOV_STR "-1" VP_EOV_STR
+                    "%d" VP_EOV_STR, jobs[i].fd);
+            ret = vp_file_read(args);
+            sep = strchr(ret, VP_EOV);
+            if (sep == NULL) {
+                fprintf(stderr, "vp_file_read: %s\n", ret);
+                exit(EXIT_FAILURE);
+            }
+            hash_update(&jobs[i], ret, sep - ret);
+            if (sep[1] == '1') {
+                jobs[i].eof = 1;
+                ++neof;
+                call1(vp_file_close, jobs[i].fd);
+            }
+        }
+    }
+    while (reap(njobs, jobs) < njobs)
+        poll(NULL, 0, 1);
+    printf("%-6s %4d jobs x %9zu bytes  finished while idle %4d  "
+            "read all in %8.1f ms\n", drain ? "drain" : "direct", njobs,
+            jobs[0].bytes, nidle, now_msec() - start);
+    if (drain)
+        vp_drain_stop(NULL);
+}
+
+int
+main(int argc, char **argv)
+{
+    static job_t direct[JOB_MAX];
+    static job_t drained[JOB_MAX];
+    int njobs = (argc > 1) ? atoi(argv[1]) : 32;
+    int lines = (argc > 2) ? atoi(argv[2]) : 100000;
+    int idle = (argc > 3) ? atoi(argv[3]) : 500;
+    int tick = (argc > 4) ? atoi(argv[4]) : 0;
+    int i;
+
+    if (njobs < 1 || JOB_MAX < njobs) {
+        fprintf(stderr, "njobs must be 1..%d\n", JOB_MAX);
+        return EXIT_FAILURE;
+    }
+    run(njobs, lines, idle, tick, 0, direct);
+    run(njobs, lines, idle, tick, 1, drained);
+    for (i = 0; i < njobs; ++i) {
+        if (direct[i].hash != direct[0].hash
+                || drained[i].hash != direct[0].hash
+                || drained[i].bytes != direct[0].bytes) {
+            fprintf(stderr, "job %d: output differs\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+    printf("ok\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,112 @@
+/* vim:set sw=4 sts=4 et: */
+/**
+ * FILE:   hex_bench.c
+ * Microbenchmark of the hexdump kernels in vimstack.c.
+ *
+ *   $ cc -O2 -o hex_bench bench/hex_bench.c
+ *   $ ./hex_bench [size [loops]]
+ *
+ * Each kernel is checked against the scalar one, then its encode and
+ * decode throughput is reported in GB/s of binary data.
+ */
+
+#include <time.h>
+
+#include "../autoload/vimstack.c"
+
+typedef struct {
+    const char *name;
+    vp_hex_encode_t encode;
+    vp_hex_decode_t decode;
+    const char *feature;
+} kernel_t;
+
+static kernel_t kernels[] = {
+    {"scalar", vp_hex_encode_scalar, vp_hex_decode_scalar, NULL},
+#ifdef VP_HEX_X86
+    {"sse2", vp_hex_encode_sse2, vp_hex_decode_sse2, "sse2"},
+    {"avx2", vp_hex_encode_avx2, vp_hex_decode_avx2, "avx2"},
+#endif
+};
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+supported(const kernel_t *k)
+{
+    if (k->feature == NULL)
+        return 1;
+#ifdef VP_HEX_X86
+    __builtin_cpu_init();
+    if (strcmp(k->feature, "sse2") == 0)
+        return __builtin_cpu_supports("sse2");
+    if (strcmp(k->feature, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+#endif
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t size = (argc > 1) ? strtoul(argv[1], NULL, 10) : (1 << 20) + 7;
+    int loops = (argc > 2) ? atoi(argv[2]) : 200;
+    unsigned char *bin = malloc(size);
+    unsigned char *out = malloc(size);
+    char *ref = malloc(size * 2);
+    char *hex = malloc(size * 2);
+    size_t i;
+    size_t k;
+    int n;
+    double t;
+
+    if (bin == NULL || out == NULL || ref == NULL || hex == NULL) {
+        fprintf(stderr, "malloc() error\n");
+        return 1;
+    }
+    srand(1);
+    for (i = 0; i < size; ++i)
+        bin[i] = rand() & 0xFF;
+    vp_hex_encode_scalar(ref, bin, size);
+
+    vp_hex_init();
+    printf("size=%zu loops=%d dispatch=%s\n", size, loops, vp_hex_kernel);
+    for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+        if (!supported(&kernels[k])) {
+            printf("%-8s unsupported\n", kernels[k].name);
+            continue;
+        }
+
+        kernels[k].encode(hex, bin, size);
+        if (memcmp(hex, ref, size * 2) != 0) {
+            printf("%-8s encode MISMATCH\n", kernels[k].name);
+            return 1;
+        }
+        if (kernels[k].decode(out, hex, size) != 0
+                || memcmp(out, bin, size) != 0) {
+            printf("%-8s decode MISMATCH\n", kernels[k].name);
+            return 1;
+        }
+
+        t = now();
+        for (n = 0; n < loops; ++n)
+            kernels[k].encode(hex, bin, size);
+        t = now() - t;
+        printf("%-8s encode %8.3f GB/s", kernels[k].name,
+                (double)size * loops / t / 1e9);
+
+        t = now();
+        for (n = 0; n < loops; ++n)
+            kernels[k].decode(out, hex, size);
+        t = now() - t;
+        printf("   decode %8.3f GB/s\n", (double)size * loops / t / 1e9);
+    }
+    return 0;
+}
@@ -0,0 +1,114 @@
+/* vim:set sw=4 sts=4 et: */
+/**
+ * FILE:   spawn_bench.c
+ * Latency of starting a child as the parent's RSS grows.
+ *
+ *   $ cc -O2 -o spawn_bench bench/spawn_bench.c -lutil
+ *   $ ./spawn_bench [loops [MB ...]]
+ *
+ * For each RSS, "/bin/true" is started and reaped loops times with
+ * fork() + execv() and with vp_pipe_exec() (posix_spawn() unless built
+ * with -DVP_USE_FORK), and the mean latency is reported in msec.
+ */
+
+#include "../autoload/proc.c"
+
+#include <sys/mman.h>
+
+static char *argv_true[] = {"/bin/true", NULL};
+
+static double
+now_msec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void
+run_fork(void)
+{
+    pid_t pid;
+    int status;
+
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    } else if (pid == 0) {
+        execv(argv_true[0], argv_true);
+        _exit(EXIT_FAILURE);
+    }
+    waitpid(pid, &status, 0);
+}
+
+static void
+run_exec(void)
+{
+    int fd[3];
+    pid_t pid;
+    int status;
+    const char *errfunc;
+
+    errfunc = vp_pipe_exec(argv_true, 3, fd, &pid);
+    if (errfunc != NULL) {
+        fprintf(stderr, "%s: %s\n", errfunc, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    close(fd[0]);
+    close(fd[1]);
+    close(fd[2]);
+    waitpid(pid, &status, 0);
+}
+
+static double
+measure(void (*run)(void), int loops)
+{
+    double start;
+    int i;
+
+    start = now_msec();
+    for (i = 0; i < loops; ++i)
+        run();
+    return (now_msec() - start) / loops;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const int default_mb[] = {0, 256, 1024, 2048};
+    int loops = (argc > 1) ? atoi(argv[1]) : 200;
+    int nmb = (argc > 2) ? argc - 2 : 4;
+    size_t rss = 0;
+    int i;
+
+    printf("%8s %12s %12s\n", "RSS(MB)", "fork(ms)",
+#ifdef VP_SPAWN
+            "spawn(ms)"
+#else
+            "vp(ms)"
+#endif
+          );
+    for (i = 0; i < nmb; ++i) {
+        size_t mb = (argc > 2) ? (size_t)atoi(argv[i + 2])
+            : (size_t)default_mb[i];
+        char *p;
+
+        if (mb > rss) {
+            /* grow RSS; every page is touched so that it is mapped. */
+            p = mmap(NULL, (mb - rss) << 20, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                perror("mmap");
+                return EXIT_FAILURE;
+            }
+            memset(p, 1, (mb - rss) << 20);
+            rss = mb;
+        }
+        printf("%8zu %12.3f %12.3f\n", rss,
+                measure(run_fork, loops), measure(run_exec, loops));
+        fflush(stdout);
+    }
+    return EXIT_SUCCESS;
+}
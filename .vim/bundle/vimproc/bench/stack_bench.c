@@ -0,0 +1,198 @@
+/* vim:set sw=4 sts=4 et: */
+/**
+ * FILE:   stack_bench.c
+ * Microbenchmark of the argument and number codec in vimstack.c.
+ *
+ *   $ cc -O2 -o stack_bench bench/stack_bench.c
+ *   $ ./stack_bench [loops [payload KB]]
+ *
+ * The arguments of vp_file_write(fd, hd, timeout) with a payload of the
+ * given size (64 KB by default) are parsed, and a result of three numbers
+ * is returned, loops times.  It is done by vimstack.c and by the codec
+ * before the arguments were indexed (backward scan, sscanf() and
+ * vsprintf()), which is copied below.  The mean time of each step is
+ * reported in nsec.
+ */
+
+#include "../autoload/vimstack.c"
+
+#include <time.h>
+
+static double
+now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* the previous codec */
+
+static const char *
+legacy_from_args(vp_stack_t *stack, char *args)
+{
+    stack->size = strlen(args);
+    stack->buf = args;
+    stack->top = stack->buf + stack->size;
+    stack->nval = -1;
+    if (stack->top[-1] != VP_EOV)
+        return "vp_stack_from_buf: no EOV";
+    return NULL;
+}
+
+static const char *
+legacy_pop_num(vp_stack_t *stack, const char *fmt, void *ptr)
+{
+    char fmtbuf[VP_NUMFMT_BUFSIZE];
+    int n;
+    char *top;
+
+    if (stack->buf == stack->top)
+        return "vp_stack_pop_num: stack over flow";
+
+    top = stack->top - 1;
+    while (top != stack->buf && top[-1] != VP_EOV)
+        --top;
+
+    strcpy(fmtbuf, fmt);
+    strcat(fmtbuf, "%n");
+
+    if (sscanf(top, fmtbuf, ptr, &n) != 1 || top[n] != VP_EOV)
+        return "vp_stack_pop_num: sscanf error";
+
+    stack->top = top;
+    return NULL;
+}
+
+static const char *
+legacy_pop_str(vp_stack_t *stack, char **str)
+{
+    char *top;
+
+    if (stack->buf == stack->top)
+        return "vp_stack_pop_str: stack over flow";
+
+    top = stack->top - 1;
+    while (top != stack->buf && top[-1] != VP_EOV)
+        --top;
+
+    *str = top;
+    stack->top[-1] = '\0';
+    stack->top = top;
+    return NULL;
+}
+
+static const char *
+legacy_push_num(vp_stack_t *stack, const char *fmt, ...)
+{
+    va_list ap;
+    char buf[VP_NUM_BUFSIZE];
+    size_t needsize;
+
+    va_start(ap, fmt);
+    if (vsprintf(buf, fmt, ap) < 0) {
+        va_end(ap);
+        return "vp_stack_push_num: vsprintf error";
+    }
+    va_end(ap);
+    needsize = (stack->top - stack->buf) + strlen(buf) + sizeof(VP_EOV_STR);
+    VP_RETURN_IF_FAIL(vp_stack_reserve(stack, needsize));
+    stack->top += sprintf(stack->top, "%s%c", buf, VP_EOV);
+    return NULL;
+}
+
+typedef struct {
+    const char *(*from_args)(vp_stack_t *, char *);
+    const char *(*pop_num)(vp_stack_t *, const char *, void *);
+    const char *(*pop_str)(vp_stack_t *, char **);
+    const char *(*push_num)(vp_stack_t *, const char *, ...);
+} codec_t;
+
+static const codec_t codec_new = {
+    vp_stack_from_args, vp_stack_pop_num, vp_stack_pop_str, vp_stack_push_num
+};
+
+static const codec_t codec_legacy = {
+    legacy_from_args, legacy_pop_num, legacy_pop_str, legacy_push_num
+};
+
+static void
+run(const char *name, const codec_t *codec, const char *args, size_t len,
+        int loops)
+{
+    static vp_stack_t result = VP_STACK_NULL;
+    char *buf = malloc(len + 1);
+    double t[4] = {0, 0, 0, 0};
+    double start;
+    int i;
+
+    if (buf == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < loops; ++i) {
+        vp_stack_t stack;
+        int fd;
+        int timeout;
+        char *hd;
+
+        /* the arguments are modified by the pops */
+        memcpy(buf, args, len + 1);
+
+        start = now_nsec();
+        if (codec->from_args(&stack, buf) != NULL)
+            exit(EXIT_FAILURE);
+        t[0] += now_nsec() - start;
+
+        start = now_nsec();
+        if (codec->pop_num(&stack, "%d", &fd) != NULL)
+            exit(EXIT_FAILURE);
+        t[1] += now_nsec() - start;
+
+        start = now_nsec();
+        if (codec->pop_str(&stack, &hd) != NULL)
+            exit(EXIT_FAILURE);
+        t[2] += now_nsec() - start;
+
+        if (codec->pop_num(&stack, "%d", &timeout) != NULL)
+            exit(EXIT_FAILURE);
+
+        start = now_nsec();
+        codec->push_num(&result, "%d", fd);
+        codec->push_num(&result, "%zu", len);
+        codec->push_num(&result, "%llu", (unsigned long long)start);
+        vp_stack_return(&result);
+        t[3] += now_nsec() - start;
+    }
+    printf("%-8s %12.1f %12.1f %12.1f %12.1f\n", name, t[0] / loops,
+            t[1] / loops, t[2] / loops, t[3] / loops);
+    free(buf);
+}
+
+int
+main(int argc, char **argv)
+{
+    int loops = (argc > 1) ? atoi(argv[1]) : 20000;
+    size_t kb = (argc > 2) ? (size_t)atoi(argv[2]) : 64;
+    size_t len;
+    char *args;
+
+    /* (fd, hd, timeout) in reverse order */
+    args = malloc(kb * 2048 + 64);
+    if (args == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    len = sprintf(args, "%d" VP_EOV_STR, 100);
+    memset(args + len, 'A', kb * 2048);
+    len += kb * 2048;
+    len += sprintf(args + len, VP_EOV_STR "%d" VP_EOV_STR, 12);
+
+    printf("%-8s %12s %12s %12s %12s\n", "codec", "args(ns)", "pop_num(ns)",
+            "pop_str(ns)", "push_num(ns)");
+    run("legacy", &codec_legacy, args, len, loops);
+    run("indexed", &codec_new, args, len, loops);
+    free(args);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,236 @@
+/* vim:set sw=4 sts=4 et: */
+/**
+ * FILE:   stack_fuzz.c
+ * Fuzz target of the argument and number codec in vimstack.c.
+ *
+ *   $ clang -g -O1 -fsanitize=fuzzer,address -DVP_LIBFUZZER \
+ *         -o stack_fuzz bench/stack_fuzz.c
+ *   $ ./stack_fuzz corpus/
+ * or without libFuzzer, with random inputs:
+ *   $ cc -g -O1 -fsanitize=address,undefined -o stack_fuzz bench/stack_fuzz.c
+ *   $ ./stack_fuzz [iterations [seed]]
+ *
+ * An input is taken as libcall() arguments.  Every value is popped by the
+ * index of vp_stack_from_args() and by the backward scan, and must be the
+ * same; "%d", "%hu" and "%p" must agree with strtoll()/strtoull().  The
+ * first 8 bytes are also pushed as numbers, which must read back by
+ * sscanf() as pushed.  A mismatch aborts.
+ */
+
+#include "../autoload/vimstack.c"
+
+#include <stdint.h>
+#include <ctype.h>
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            abort(); \
+        } \
+    } while (0)
+
+/*
+ * 1 and the value of "%d" or "%hu" in num, 0 if it is invalid, -1 if it is
+ * too long to tell by strtoll().
+ */
+static int
+ref_dec(const char *v, size_t len, long long min, long long max,
+        long long *num)
+{
+    char buf[32];
+    size_t i = 0;
+
+    if (len == 0)
+        return 0;
+    if (len >= 19)
+        return -1;
+    memcpy(buf, v, len);
+    buf[len] = '\0';
+    if (buf[0] == '+' || (buf[0] == '-' && min < 0))
+        i = 1;
+    if (buf[i] == '\0')
+        return 0;
+    for (; buf[i] != '\0'; ++i)
+        if (!isdigit((unsigned char)buf[i]))
+            return 0;
+    *num = strtoll(buf, NULL, 10);
+    return min <= *num && *num <= max;
+}
+
+static void
+check_pops(char *args, const char *orig, int type)
+{
+    vp_stack_t indexed;
+    vp_stack_t scanned;
+    char *copy;
+    size_t len = strlen(args);
+    const char *err1;
+    const char *err2;
+
+    if (vp_stack_from_args(&indexed, args) != NULL) {
+        CHECK(len > 0 && args[len - 1] != VP_EOV);
+        return;
+    }
+    CHECK(len == 0 || args[len - 1] == VP_EOV);
+    copy = malloc(len + 1);
+    CHECK(copy != NULL);
+    memcpy(copy, orig, len + 1);
+    CHECK(vp_stack_from_args(&scanned, copy) == NULL);
+    scanned.nval = -1;
+
+    while (indexed.top != indexed.buf) {
+        /* the value in the original input, as the pop may modify it */
+        size_t off = vp_stack_pop_head(&scanned) - copy;
+        const char *v = orig + off;
+        size_t vlen = strchr(v, VP_EOV) - v;
+        long long expect = 0;
+        int valid;
+
+        scanned.nval = -1;
+        switch (type++ % 4) {
+        case 0: {
+            int n1 = 0;
+            int n2 = 0;
+
+            valid = ref_dec(v, vlen, -2147483648LL, 2147483647LL, &expect);
+            err1 = vp_stack_pop_num(&indexed, "%d", &n1);
+            err2 = vp_stack_pop_num(&scanned, "%d", &n2);
+            CHECK((err1 == NULL) == (err2 == NULL));
+            if (valid >= 0)
+                CHECK((err1 == NULL) == valid);
+            if (err1 == NULL && valid > 0)
+                CHECK(n1 == expect && n2 == expect);
+            break;
+        }
+        case 1: {
+            unsigned short n1 = 0;
+            unsigned short n2 = 0;
+
+            valid = ref_dec(v, vlen, 0, 65535, &expect);
+            err1 = vp_stack_pop_num(&indexed, "%hu", &n1);
+            err2 = vp_stack_pop_num(&scanned, "%hu", &n2);
+            CHECK((err1 == NULL) == (err2 == NULL));
+            if (valid >= 0)
+                CHECK((err1 == NULL) == valid);
+            if (err1 == NULL && valid > 0)
+                CHECK(n1 == expect && n2 == expect);
+            break;
+        }
+        case 2: {
+            void *p1 = NULL;
+            void *p2 = NULL;
+
+            err1 = vp_stack_pop_num(&indexed, "%p", &p1);
+            err2 = vp_stack_pop_num(&scanned, "%p", &p2);
+            CHECK((err1 == NULL) == (err2 == NULL));
+            if (err1 == NULL) {
+                CHECK(p1 == p2);
+                CHECK((uintptr_t)p1 == strtoull(v, NULL, 16));
+            }
+            break;
+        }
+        default: {
+            char *s1;
+            char *s2;
+
+            err1 = vp_stack_pop_str(&indexed, &s1);
+            err2 = vp_stack_pop_str(&scanned, &s2);
+            CHECK(err1 == NULL && err2 == NULL);
+            CHECK(s1 - indexed.buf == s2 - scanned.buf);
+            CHECK(strlen(s1) == vlen && memcmp(s1, v, vlen) == 0);
+            break;
+        }
+        }
+        if (err1 != NULL) {
+            /* a failed pop leaves the value; take it as a string */
+            char *s;
+
+            CHECK(vp_stack_pop_str(&indexed, &s) == NULL);
+            CHECK(vp_stack_pop_str(&scanned, &s) == NULL);
+        }
+        CHECK(indexed.top - indexed.buf == scanned.top - scanned.buf);
+    }
+    CHECK(scanned.top == scanned.buf);
+    free(copy);
+}
+
+static void
+check_push(const uint8_t *data, size_t size)
+{
+    static vp_stack_t result = VP_STACK_NULL;
+    unsigned long long u = 0;
+    long long d;
+    unsigned long long u2;
+    long long d2;
+    char *p;
+    size_t i;
+
+    for (i = 0; i < size && i < 8; ++i)
+        u = (u << 8) | data[i];
+    d = (long long)u;
+
+    CHECK(vp_stack_push_num(&result, "%llu", u) == NULL);
+    CHECK(vp_stack_push_num(&result, "%lld", d) == NULL);
+    CHECK(vp_stack_push_num(&result, "%d", (int)d) == NULL);
+    CHECK(vp_stack_push_num(&result, "%hu", (unsigned short)u) == NULL);
+    p = (char *)vp_stack_return(&result);
+    CHECK(sscanf(p, "%llu", &u2) == 1 && u2 == u);
+    p = strchr(p, VP_EOV) + 1;
+    CHECK(sscanf(p, "%lld", &d2) == 1 && d2 == d);
+    p = strchr(p, VP_EOV) + 1;
+    CHECK(sscanf(p, "%lld", &d2) == 1 && d2 == (int)d);
+    p = strchr(p, VP_EOV) + 1;
+    CHECK(sscanf(p, "%llu", &u2) == 1 && u2 == (unsigned short)u);
+    CHECK(strchr(p, VP_EOV)[1] == '\0');
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    char *args;
+    char *orig;
+    size_t len;
+
+    check_push(data, size);
+    if (size == 0)
+        return 0;
+    /* NUL terminates the arguments of libcall() */
+    len = strnlen((const char *)data + 1, size - 1);
+    args = malloc(len + 1);
+    orig = malloc(len + 1);
+    CHECK(args != NULL && orig != NULL);
+    memcpy(args, data + 1, len);
+    args[len] = '\0';
+    memcpy(orig, args, len + 1);
+    check_pops(args, orig, data[0]);
+    free(args);
+    free(orig);
+    return 0;
+}
+
+#ifndef VP_LIBFUZZER
+int
+main(int argc, char **argv)
+{
+    /* numbers and their neighbors are the interesting bytes */
+    static const char alphabet[] = "0123456789+-xXaFf (nil)\xFF\xFF\xFF";
+    long iterations = (argc > 1) ? atol(argv[1]) : 1000000;
+    uint8_t data[256];
+    long i;
+
+    srand((argc > 2) ? atoi(argv[2]) : 1);
+    for (i = 0; i < iterations; ++i) {
+        size_t size = rand() % sizeof(data);
+        size_t j;
+
+        for (j = 0; j < size; ++j) {
+            data[j] = (rand() % 8 == 0) ? (uint8_t)rand()
+                : (uint8_t)alphabet[rand() % (sizeof(alphabet) - 1)];
+        }
+        LLVMFuzzerTestOneInput(data, size);
+    }
+    printf("ok %ld\n", iterations);
+    return EXIT_SUCCESS;
+}
+#endif
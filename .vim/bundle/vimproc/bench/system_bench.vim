@@ -0,0 +1,52 @@
+" FILE:   system_bench.vim
+" Per-call latency of vimproc#system().
+"
+"   $ vim -u NONE -N -es --cmd 'set rtp^=.' -S bench/system_bench.vim
+"
+" The native single-call path is compared with the popen3 + read loop
+" that vimproc#system() used for every command before.
+
+let s:loops = get(g:, 'system_bench_loops', 200)
+
+function! s:popen3_system(args, input)"{{{
+  let l:subproc = vimproc#popen3(a:args)
+  call l:subproc.stdin.write(a:input)
+  call l:subproc.stdin.close()
+  let l:output = ''
+  while !l:subproc.stdout.eof || !l:subproc.stderr.eof
+    if !l:subproc.stdout.eof
+      let l:output .= l:subproc.stdout.read(-1, 40)
+    endif
+    if !l:subproc.stderr.eof
+      let l:output .= l:subproc.stderr.read(-1, 40)
+    endif
+  endwhile
+  call l:subproc.waitpid()
+  return l:output
+endfunction"}}}
+
+function! s:measure(name, func, args, input)"{{{
+  let l:start = reltime()
+  for l:i in range(s:loops)
+    call call(a:func, [a:args, a:input])
+  endfor
+  let l:sec = str2float(reltimestr(reltime(l:start)))
+  return printf('%-24s %8.3f ms/call', a:name, l:sec * 1000 / s:loops)
+endfunction"}}}
+
+let s:lines = []
+for [s:name, s:args, s:input] in [
+      \ ['true', ['true'], ''],
+      \ ['echo', ['echo', 'hello'], ''],
+      \ ['cat 64KB', ['cat'], repeat('x', 65536)],
+      \ ]
+  call add(s:lines, s:measure(s:name . ' (native)', 'vimproc#system', s:args, s:input))
+  call add(s:lines, s:measure(s:name . ' (popen3)', 's:popen3_system', s:args, s:input))
+endfor
+
+for s:line in s:lines
+  echo s:line
+endfor
+if exists('g:system_bench_output')
+  call writefile(s:lines, g:system_bench_output)
+endif
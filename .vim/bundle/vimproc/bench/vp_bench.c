@@ -0,0 +1,486 @@
+/* vim:set sw=4 sts=4 et: */
+/**
+ * FILE:   vp_bench.c
+ * Throughput and latency of the vp_* ABI, called through dlopen() as Vim
+ * does by libcall().
+ *
+ *   $ cc -O2 -shared -fPIC -o autoload/proc.so autoload/proc.c -lutil -lpthread
+ *   $ cc -O2 -o vp_bench bench/vp_bench.c -ldl -lpthread
+ *   $ ./vp_bench [path/to/proc.so [maxsize]]
+ *
+ * For each payload size from 1K by 32 times up to maxsize (32M by default,
+ * K, M and G suffixes are accepted, e.g. 1G), the payload is moved by
+ *
+ *   pipe-write  vp_file_write() to "cat >/dev/null" by vp_pipe_open()
+ *   pipe-read   vp_file_read() from "head -c size /dev/zero"
+ *   pty-read    vp_pty_read() from the same command by vp_pty_open() in
+ *               "cooked" mode
+ *   sock-write  vp_socket_write() to a loopback listener which discards
+ *   sock-read   vp_socket_read() from a loopback listener which sends
+ *
+ * and the throughput, syscalls per MB (by vp_stats(), "-" if the library
+ * is built with -DVP_NO_STATS) and p50/p99 latency of a call are reported.
+ * A write call carries min(size, 1M) bytes.  Arguments and results are
+ * EOV-terminated values in hex encoding, the same as vimproc.vim.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define VP_EOV '\xFF'
+#define VP_EOV_STR "\xFF"
+
+#define CHUNK_MAX (1024 * 1024)
+
+typedef const char *(*vp_func_t)(char *);
+
+static void *lib;
+static char *argbuf;
+static size_t argsize;
+
+/* latency of each call in usec */
+static double *lat;
+static size_t nlat;
+static size_t latsize;
+
+static double
+now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static vp_func_t
+sym(const char *name)
+{
+    vp_func_t func = (vp_func_t)dlsym(lib, name);
+
+    if (func == NULL) {
+        fprintf(stderr, "dlsym(%s): %s\n", name, dlerror());
+        exit(EXIT_FAILURE);
+    }
+    return func;
+}
+
+/*
+ * Call name with argc values.  They are pushed in reverse order, so that
+ * the first one is popped first.  The result is split into vals and the
+ * number of values is returned.  An error message exits.
+ */
+static int
+call(const char *name, int argc, const char **argv, char **vals, int nval)
+{
+    size_t need = 1;
+    const char *ret;
+    char *p;
+    int n = 0;
+    int i;
+    double start;
+
+    for (i = 0; i < argc; ++i)
+        need += strlen(argv[i]) + 1;
+    if (need > argsize) {
+        argsize = need;
+        if ((argbuf = realloc(argbuf, argsize)) == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    p = argbuf;
+    for (i = argc - 1; i >= 0; --i) {
+        size_t len = strlen(argv[i]);
+
+        memcpy(p, argv[i], len);
+        p += len;
+        *p++ = VP_EOV;
+    }
+    *p = '\0';
+
+    start = now_usec();
+    ret = sym(name)(argbuf);
+    if (nlat == latsize) {
+        latsize = (latsize == 0) ? 1024 : latsize * 2;
+        if ((lat = realloc(lat, sizeof(double) * latsize)) == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    lat[nlat++] = now_usec() - start;
+
+    if (ret == NULL)
+        return 0;
+    if (ret[0] != '\0' && ret[strlen(ret) - 1] != VP_EOV) {
+        fprintf(stderr, "%s: %s\n", name, ret);
+        exit(EXIT_FAILURE);
+    }
+    /* values point into the result buffer until the next call */
+    for (p = (char *)ret; *p != '\0' && n < nval; ++n) {
+        vals[n] = p;
+        p = strchr(p, VP_EOV);
+        *p++ = '\0';
+    }
+    return n;
+}
+
+/* number of syscalls counted by vp_stats() since the last reset */
+static long long
+syscalls(int reset)
+{
+    const char *argv[] = {reset ? "1" : "0"};
+    char *vals[4096];
+    vp_func_t stats = (vp_func_t)dlsym(lib, "vp_stats");
+    char args[8];
+    const char *ret;
+    long long n = 0;
+    int nval;
+    int i;
+
+    if (stats == NULL)
+        return -1;
+    snprintf(args, sizeof(args), "%s" VP_EOV_STR, argv[0]);
+    ret = stats(args);
+    if (ret == NULL || ret[0] == '\0' || ret[strlen(ret) - 1] != VP_EOV)
+        return -1;
+    for (nval = 0; *ret != '\0' && nval < 4096; ++nval) {
+        vals[nval] = (char *)ret;
+        ret = strchr(ret, VP_EOV) + 1;
+    }
+    /* [result_size, result_max, [name, calls, ..., nsyscall, ...] * n] */
+    for (i = 2; i + 10 < nval; i += 11)
+        n += atoll(vals[i + 8]);
+    return n;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void
+report(const char *kind, size_t size, double usec, long long nsys)
+{
+    char sys[32];
+    double mb = size / (1024.0 * 1024.0);
+
+    qsort(lat, nlat, sizeof(double), cmp_double);
+    if (nsys < 0)
+        snprintf(sys, sizeof(sys), "-");
+    else
+        snprintf(sys, sizeof(sys), "%.1f", nsys / mb);
+    printf("%-10s %10zu %10.1f %10s %10.1f %10.1f %8zu\n", kind, size,
+            mb / (usec / 1e6), sys, lat[nlat / 2],
+            lat[nlat - 1 - nlat / 100], nlat);
+    fflush(stdout);
+}
+
+/* hex of min(size, CHUNK_MAX) bytes of 0xA5 */
+static char *
+payload(size_t size)
+{
+    size_t len = (size < CHUNK_MAX) ? size : CHUNK_MAX;
+    char *hd = malloc(len * 2 + 1);
+    size_t i;
+
+    if (hd == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < len * 2; i += 2) {
+        hd[i] = 'A';
+        hd[i + 1] = '5';
+    }
+    hd[len * 2] = '\0';
+    return hd;
+}
+
+/* write size bytes to fd by wfunc; the payload is written chunk by chunk */
+static void
+bench_write(const char *wfunc, int fd, size_t size)
+{
+    char *hd = payload(size);
+    char fdstr[16];
+    char *vals[2];
+    const char *argv[3];
+    size_t chunk = strlen(hd) / 2;
+    size_t done = 0;
+
+    snprintf(fdstr, sizeof(fdstr), "%d", fd);
+    /* (fd, hd, timeout) */
+    argv[0] = fdstr;
+    argv[2] = "1000";
+    while (done < size) {
+        size_t len = (size - done < chunk) ? size - done : chunk;
+        size_t n;
+
+        argv[1] = hd + (chunk - len) * 2;
+        call(wfunc, 3, argv, vals, 2);
+        n = strtoul(vals[0], NULL, 10);
+        if (n == 0) {
+            fprintf(stderr, "%s: no progress\n", wfunc);
+            exit(EXIT_FAILURE);
+        }
+        done += n;
+        if (n < len) {
+            /* the rest of the chunk; the payload is all same bytes */
+            continue;
+        }
+    }
+    free(hd);
+}
+
+/* read fd by rfunc until eof; return the bytes read */
+static size_t
+bench_read(const char *rfunc, int fd)
+{
+    char fdstr[16];
+    char *vals[2];
+    const char *argv[3];
+    size_t total = 0;
+
+    snprintf(fdstr, sizeof(fdstr), "%d", fd);
+    /* (fd, nr, timeout) */
+    argv[0] = fdstr;
+    argv[1] = "-1";
+    argv[2] = "1000";
+    for (;;) {
+        if (call(rfunc, 3, argv, vals, 2) != 2) {
+            fprintf(stderr, "%s: bad result\n", rfunc);
+            exit(EXIT_FAILURE);
+        }
+        total += strlen(vals[0]) / 2;
+        if (vals[1][0] == '1')
+            break;
+    }
+    return total;
+}
+
+static void
+close_fd(const char *func, int fd)
+{
+    char fdstr[16];
+    const char *argv[] = {fdstr};
+    char *vals[1];
+
+    snprintf(fdstr, sizeof(fdstr), "%d", fd);
+    call(func, 1, argv, vals, 0);
+}
+
+static void
+run_pipe(size_t size, int out)
+{
+    char cmd[64];
+    const char *argv[] = {"2", "3", "/bin/sh", "-c", cmd};
+    char *vals[4];
+    double start;
+    long long nsys;
+    size_t n;
+    pid_t pid;
+    int fd_in;
+    int fd_out;
+    int status;
+
+    if (out)
+        snprintf(cmd, sizeof(cmd), "exec cat >/dev/null");
+    else
+        snprintf(cmd, sizeof(cmd), "exec head -c %zu /dev/zero", size);
+    /* [pid, fd_stdin, fd_stdout, jobid] (npipe, argc, [argv]) */
+    call("vp_pipe_open", 5, argv, vals, 4);
+    /* vals are overwritten by the next call */
+    pid = atoi(vals[0]);
+    fd_in = atoi(vals[1]);
+    fd_out = atoi(vals[2]);
+    syscalls(1);
+    nlat = 0;
+    start = now_usec();
+    if (out) {
+        bench_write("vp_file_write", fd_in, size);
+        n = size;
+    } else {
+        n = bench_read("vp_file_read", fd_out);
+    }
+    nsys = syscalls(0);
+    report(out ? "pipe-write" : "pipe-read", n, now_usec() - start, nsys);
+    close_fd("vp_pipe_close", fd_in);
+    close_fd("vp_pipe_close", fd_out);
+    waitpid(pid, &status, 0);
+}
+
+static void
+run_pty(size_t size)
+{
+    char cmd[64];
+    const char *argv[] = {"80", "24", "cooked", "3", "/bin/sh", "-c", cmd};
+    char *vals[4];
+    double start;
+    long long nsys;
+    size_t n;
+    pid_t pid;
+    int fd;
+    int status;
+
+    snprintf(cmd, sizeof(cmd), "exec head -c %zu /dev/zero", size);
+    /* [pid, fd, ttyname, jobid] (width, height, mode, argc, [argv]) */
+    call("vp_pty_open", 7, argv, vals, 4);
+    pid = atoi(vals[0]);
+    fd = atoi(vals[1]);
+    syscalls(1);
+    nlat = 0;
+    start = now_usec();
+    n = bench_read("vp_pty_read", fd);
+    nsys = syscalls(0);
+    report("pty-read", n, now_usec() - start, nsys);
+    close_fd("vp_pty_close", fd);
+    waitpid(pid, &status, 0);
+}
+
+/* the peer of a socket benchmark */
+typedef struct {
+    int listener;
+    size_t size;
+    int send;
+} peer_t;
+
+static void *
+peer_main(void *arg)
+{
+    peer_t *peer = arg;
+    static char buf[65536];
+    int fd = accept(peer->listener, NULL, NULL);
+    size_t done = 0;
+    ssize_t n;
+
+    if (fd == -1) {
+        perror("accept");
+        exit(EXIT_FAILURE);
+    }
+    if (peer->send) {
+        memset(buf, 0, sizeof(buf));
+        while (done < peer->size) {
+            n = write(fd, buf, (peer->size - done < sizeof(buf))
+                    ? peer->size - done : sizeof(buf));
+            if (n <= 0)
+                break;
+            done += n;
+        }
+    } else {
+        while (read(fd, buf, sizeof(buf)) > 0)
+            ;
+    }
+    close(fd);
+    return NULL;
+}
+
+static void
+run_socket(size_t size, int out)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    char port[16];
+    const char *argv[] = {"127.0.0.1", port};
+    char *vals[1];
+    peer_t peer;
+    pthread_t thread;
+    double start;
+    long long nsys;
+    size_t n;
+    int fd;
+
+    peer.listener = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (peer.listener == -1
+            || bind(peer.listener, (struct sockaddr *)&addr, sizeof(addr)) == -1
+            || listen(peer.listener, 1) == -1
+            || getsockname(peer.listener, (struct sockaddr *)&addr,
+                &addrlen) == -1) {
+        perror("listener");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(port, sizeof(port), "%d", ntohs(addr.sin_port));
+    peer.size = size;
+    peer.send = !out;
+    pthread_create(&thread, NULL, peer_main, &peer);
+
+    /* [socket] (host, port) */
+    call("vp_socket_open", 2, argv, vals, 1);
+    fd = atoi(vals[0]);
+    syscalls(1);
+    nlat = 0;
+    start = now_usec();
+    if (out) {
+        bench_write("vp_socket_write", fd, size);
+        n = size;
+    } else {
+        n = bench_read("vp_socket_read", fd);
+    }
+    nsys = syscalls(0);
+    report(out ? "sock-write" : "sock-read", n, now_usec() - start, nsys);
+    close_fd("vp_socket_close", fd);
+    pthread_join(thread, NULL);
+    close(peer.listener);
+}
+
+static size_t
+parse_size(const char *s)
+{
+    char *end;
+    size_t n = strtoul(s, &end, 10);
+
+    switch (*end) {
+    case 'G': case 'g': n <<= 10; /* FALLTHROUGH */
+    case 'M': case 'm': n <<= 10; /* FALLTHROUGH */
+    case 'K': case 'k': n <<= 10;
+    }
+    return n;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *path = (argc > 1) ? argv[1] : "./autoload/proc.so";
+    size_t maxsize = (argc > 2) ? parse_size(argv[2]) : 32 << 20;
+    size_t size;
+
+    signal(SIGPIPE, SIG_IGN);
+    /* a path without '/' would be searched in the library path */
+    if (strchr(path, '/') == NULL) {
+        fprintf(stderr, "give the path with '/': ./%s\n", path);
+        return EXIT_FAILURE;
+    }
+    if ((lib = dlopen(path, RTLD_NOW)) == NULL) {
+        fprintf(stderr, "dlopen: %s\n", dlerror());
+        return EXIT_FAILURE;
+    }
+
+    printf("%-10s %10s %10s %10s %10s %10s %8s\n", "kind", "bytes", "MB/s",
+            "syscall/MB", "p50(us)", "p99(us)", "calls");
+    for (size = 1024; size <= maxsize; size *= 32) {
+        run_pipe(size, 1);
+        run_pipe(size, 0);
+        run_pty(size);
+        run_socket(size, 1);
+        run_socket(size, 0);
+    }
+    dlclose(lib);
+    return EXIT_SUCCESS;
+}
@@ -36,6 +36,8 @@ set cpo&vim
 
 command! -nargs=+ -complete=shellcmd VimProcBang call s:bang(<q-args>)
 command! -nargs=+ -complete=shellcmd VimProcRead call s:read(<q-args>)
+command! -range -nargs=+ -complete=shellcmd VimProcFilter
+      \ call s:filter(<line1>, <line2>, <q-args>)
 
 " Command functions:
 function! s:bang(cmdline)"{{{
@@ -82,6 +84,19 @@ function! s:read(cmdline)"{{{
   call append('.', split(iconv(vimshell#system(l:cmdline), &termencoding, &encoding), '\r\n\|\n'))
 endfunction"}}}
 
+function! s:filter(line1, line2, cmdline)"{{{
+  " Replace the lines by the output, as :{range}!.
+  let l:cmdline = join(map(split(a:cmdline), 'expand(v:val)'))
+  let l:output = vimproc#filter(l:cmdline, [a:line1, a:line2])
+  call append(a:line2, l:output)
+  silent execute a:line1 . ',' . a:line2 . 'delete _'
+
+  let l:errmsg = vimproc#get_last_errmsg()
+  if l:errmsg != ''
+    echohl WarningMsg | echo l:errmsg | echohl None
+  endif
+endfunction"}}}
+
 let &cpo = s:save_cpo
 unlet s:save_cpo
 
@@ -0,0 +1,80 @@
+" vim:foldmethod=marker:fen:sw=2:sts=2
+scriptencoding utf-8
+
+" Saving 'cpoptions' {{{
+let s:save_cpo = &cpo
+set cpo&vim
+" }}}
+
+
+
+function! s:read_all(sub, framing)
+  let res = []
+  while !a:sub.stdout.eof
+    let res += a:sub.stdout.read_records(a:framing)
+  endwhile
+  call a:sub.waitpid()
+  return res
+endfunction
+
+function! s:run()
+  let sub = vimproc#popen2(['sh', '-c', 'printf "a\nbb\n"; sleep 1; printf "c"; sleep 1; printf "c\nd"'])
+  let res = []
+  while !sub.stdout.eof
+    let res += sub.stdout.read_lines()
+  endwhile
+  call sub.waitpid()
+  IsDeeply res, ['a', 'bb', 'cc', 'd'], 'read_lines() joins a line split across reads'
+
+  let sub = vimproc#popen2(['printf', 'one\000two\000'])
+  let res = s:read_all(sub, 'nul')
+  IsDeeply res, ['one', 'two'], 'read_records("nul")'
+
+  let sub = vimproc#popen2(['printf', '\000\000\000\002hi\000\000\000\000'])
+  let res = s:read_all(sub, 'length')
+  IsDeeply res, ['hi', ''], 'read_records("length")'
+
+  let sub = vimproc#popen2(['printf', 'Content-Length: 3\r\n\r\nabcContent-Length: 2\r\n\r\nxy'])
+  let res = s:read_all(sub, 'content-length')
+  IsDeeply res, ['abc', 'xy'], 'read_records("content-length")'
+
+  let sub = vimproc#popen2(['printf', '\377\377\377\377'])
+  sleep 100m
+  let err = ''
+  try
+    call sub.stdout.read_records('length', -1, 1000)
+  catch
+    let err = v:exception
+  endtry
+  call sub.waitpid()
+  Ok err =~# 'record error', 'read_records("length") rejects a huge length'
+
+  let sub = vimproc#popen2(['printf', 'Content-Type: x\r\n\r\nabc'])
+  sleep 100m
+  let err = ''
+  try
+    call sub.stdout.read_records('content-length', -1, 1000)
+  catch
+    let err = v:exception
+  endtry
+  call sub.waitpid()
+  Ok err =~# 'record error', 'read_records("content-length") needs the header'
+
+  let sub = vimproc#popen2(['printf', 'one\ntwo\n'])
+  let first = sub.stdout.read_lines(1, 1000)
+  let rest = ''
+  while !sub.stdout.eof
+    let rest .= sub.stdout.read()
+  endwhile
+  call sub.waitpid()
+  IsDeeply first, ['one'], 'read_lines(1)'
+  Is rest, "two\n", 'read() returns carried over bytes'
+endfunction
+
+call s:run()
+Done
+
+
+" Restore 'cpoptions' {{{
+let &cpo = s:save_cpo
+" }}}
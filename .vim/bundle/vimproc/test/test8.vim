@@ -0,0 +1,364 @@
+" vim:foldmethod=marker:fen:sw=2:sts=2
+scriptencoding utf-8
+
+" Saving 'cpoptions' {{{
+let s:save_cpo = &cpo
+set cpo&vim
+" }}}
+
+
+
+function! s:run()
+  Is vimproc#system(['echo', 'foo']), "foo\n", 'system() with a list'
+  Is vimproc#get_last_status(), 0, 'last status of echo'
+
+  Is vimproc#system(['sh', '-c', 'exit 3']), '', 'system() without output'
+  Is vimproc#get_last_status(), 3, 'last status of exit 3'
+
+  let dir = tempname()
+  call mkdir(dir)
+  call writefile(['#!/bin/sh', 'echo "$@"'], dir . '/man')
+  call vimproc#system(['chmod', '+x', dir . '/man'])
+  let save_path = $PATH
+  let $PATH = dir . ':' . $PATH
+  Is vimproc#system('man -w ls'), "-w ls\n", 'system() of a string of man'
+  let $PATH = save_path
+  call vimproc#system(['rm', '-r', dir])
+
+  let input = "a\x01b\xFFc\x012"
+  Is vimproc#system(['cat'], input), input, 'system() passes \x01 and \xFF through'
+
+  let input = repeat("0123456789abcdef\n", 65536)
+  Is vimproc#system(['cat'], input), input, 'system() does not block on a large input'
+
+  Is vimproc#system(['sh', '-c', 'sleep 5'], '', 200), '', 'system() with a timeout'
+  Is vimproc#get_last_status(), 15, 'timed out process gets SIGTERM'
+
+  let file = tempname()
+  Is vimproc#system('seq 1 3 > ' . file), '', 'redirected output is not returned'
+  IsDeeply readfile(file), ['1', '2', '3'], 'redirect stdout to a file'
+  call vimproc#system('echo 4 >> ' . file)
+  IsDeeply readfile(file), ['1', '2', '3', '4'], 'append stdout to a file'
+  call vimproc#system(printf("sh -c 'echo 5; sleep 0.2; echo 6 >> %s; sleep 0.2; echo 7' >> %s", file, file))
+  IsDeeply readfile(file), ['1', '2', '3', '4', '5', '6', '7'],
+        \ 'redirect keeps O_APPEND of a file'
+  call delete(file)
+
+  let sub = vimproc#popen2(['cat'])
+  call vimproc#epoll_add(sub.stdout)
+  IsDeeply vimproc#epoll_wait(50), [], 'epoll_wait() returns no idle fd'
+  call sub.stdin.write("foo\n")
+  let ready = vimproc#epoll_wait(1000)
+  Is len(ready), 1, 'epoll_wait() returns a ready fd'
+  Is ready[0][1], "foo\n", 'epoll_wait() reads a ready fd'
+  call sub.stdin.close()
+  let ready = vimproc#epoll_wait(1000)
+  Ok len(ready) == 1 && ready[0][0].eof, 'epoll_wait() sets eof'
+  call sub.waitpid()
+
+  let sub = vimproc#popen2(['sh', '-c', 'exit 7'])
+  let exited = []
+  for i in range(100)
+    let exited = filter(vimproc#reap_all(), 'v:val[0] == sub.pid')
+    if !empty(exited)
+      break
+    endif
+    sleep 10m
+  endfor
+  IsDeeply exited, [[sub.pid, 'exit', 7]], 'reap_all() returns an exited process'
+  IsDeeply sub.waitpid(), ['exit', 7], 'waitpid() after reap_all()'
+
+  let sub = vimproc#popen2(['cat'])
+  call vimproc#epoll_add(sub.stdout)
+  call sub.stdin.write("foo\n")
+  sleep 50m
+  call vimproc#system_bg(['sh', '-c', 'seq 1 200000'])
+  for i in range(300)
+    silent doautocmd vimproc CursorHold
+    if !exists('#vimproc#CursorHold')
+      break
+    endif
+    sleep 10m
+  endfor
+  Ok !exists('#vimproc#CursorHold'), 'background job is reaped while a user fd is ready'
+  let ready = vimproc#epoll_wait(0)
+  Ok len(ready) == 1 && ready[0][1] ==# "foo\n", 'epoll_wait() returns what the collector read'
+  call vimproc#epoll_del(sub.stdout)
+  call sub.stdin.close()
+  call sub.waitpid()
+
+  let sub = vimproc#popen3(['true'])
+  call sub.waitpid()
+  Is sub.stderr.read(), '', 'read() of a closed fd object'
+  Ok sub.stderr.eof, 'closed fd object is at eof'
+  IsDeeply sub.stderr.read_lines(), [], 'read_lines() of a closed fd object'
+  IsDeeply sub.stderr.read_until('literal', 'x'), ['', 0],
+        \ 'read_until() of a closed fd object'
+
+  call vimproc#system_bg(['sleep', '0.3'])
+  let sub = vimproc#popen2(['true'])
+  sleep 100m
+  silent doautocmd vimproc CursorHold
+  call sub.waitpid()
+  IsDeeply filter(vimproc#reap_all(), 'v:val[0] == sub.pid'), [],
+        \ 'reap_all() does not return a waited process'
+  while exists('#vimproc#CursorHold')
+    sleep 10m
+    silent doautocmd vimproc CursorHold
+  endwhile
+
+  let sub = vimproc#popen2(['sleep', '5'])
+  IsDeeply sub.waitpid(), ['run', 0], 'waitpid() of a running process'
+  call sub.kill(9)
+
+  let sub = vimproc#popen2(['sh', '-c', 'sleep 0.1'])
+  let jobs = filter(vimproc#job_status_all(), 'v:val.jobid == sub.jobid')
+  Ok len(jobs) == 1 && jobs[0].cond ==# 'run', 'job_status_all() returns a running job'
+  for i in range(100)
+    let jobs = filter(vimproc#job_status_all(), 'v:val.jobid == sub.jobid')
+    if jobs[0].cond !=# 'run'
+      break
+    endif
+    sleep 10m
+  endfor
+  Is jobs[0].cond, 'exit', 'job_status_all() returns an exited job'
+  call sub.waitpid()
+  IsDeeply filter(vimproc#job_status_all(), 'v:val.jobid == sub.jobid'), [], 'waited job is removed'
+
+  call vimproc#stats(1)
+  call vimproc#system(['echo', 'foo'])
+  let stats = vimproc#stats()
+  Is get(get(stats.calls, 'vp_system', {}), 'calls', 0), 1, 'stats() counts a call'
+  Ok stats.result.max >= stats.result.size, 'stats() has the high water mark of result'
+
+  let file = tempname()
+  call vimproc#trace_start(100)
+  call vimproc#system(['echo', 'foo'])
+  Ok vimproc#trace_dump(file) > 0, 'trace_dump() writes spans'
+  Ok join(readfile(file)) =~# '"name":"vp_system"', 'trace has a span of a libcall'
+  call vimproc#trace_stop()
+  call delete(file)
+
+  let sub = vimproc#popen2(['sleep', '5'])
+  let results = vimproc#batch([['vp_waitpid', [sub.pid]],
+        \ ['vp_no_such_api', []], ['vp_kill', [sub.pid, 9]]])
+  IsDeeply results[0], ['', ['run', '0']], 'batch() returns the values of an op'
+  Ok results[1][0] != '' && empty(results[1][1]), 'batch() returns the error of an op'
+  IsDeeply results[2], ['', []], 'batch() runs an op after an error'
+  let results = vimproc#batch([['vp_file_read', [-1, -1, 0]]])
+  Ok results[0][0] =~# 'invalid fd', 'read() of an invalid fd is not NOMEM'
+  call sub.waitpid()
+
+  new
+  call setline(1, map(range(100000), 'printf("%06d", 100000 - v:val)'))
+  let output = vimproc#filter(['sort'], [1, line('$')])
+  Ok len(output) == 100000 && output[0] ==# '000001', 'filter() a large range'
+  bwipeout!
+  let file = tempname()
+  call writefile(['foo', 'bar'], file)
+  IsDeeply vimproc#filter(['tac'], file), ['bar', 'foo'], 'filter() a file'
+  call delete(file)
+
+  let sub = vimproc#plineopen3([
+        \ {'args': ['sh', '-c', 'printf "b\na\n"; echo e1 >&2']},
+        \ {'args': ['sort']},
+        \ {'args': ['sh', '-c', 'sed s/^/x/; echo e3 >&2; exit 3']}])
+  let output = ''
+  while !sub.stdout.eof
+    let output .= sub.stdout.read(-1, 100)
+  endwhile
+  Is output, "xa\nxb\n", 'plineopen3() connects the stages in order'
+  let errors = []
+  for fd in sub.stderr.fd
+    let err = ''
+    while !fd.eof
+      let err .= fd.read(-1, 100)
+    endwhile
+    call add(errors, err)
+  endfor
+  IsDeeply errors, ["e1\n", '', "e3\n"], 'plineopen3() has stderr of each stage'
+  IsDeeply sub.waitpid(), ['exit', 3], 'waitpid() of a pipeline is of the last stage'
+
+  let sub = vimproc#plineopen3([{'args': ['sh', '-c', 'printf "hello world" >&2; sleep 5']}])
+  let output = sub.stderr.read(5, 3000)
+  let start = reltime()
+  let output .= sub.stderr.read(5, 3000)
+  Ok output ==# 'hello worl' && str2float(reltimestr(reltime(start))) < 1.0,
+        \ 'read() of pipes returns buffered bytes without waiting'
+  call sub.kill(9)
+  call sub.waitpid()
+
+  call vimproc#batch([['vp_set_result_cap', [1000]]])
+  let sub = vimproc#popen2(['seq', '1', '2000'])
+  sleep 100m
+  let output = sub.stdout.read(-1, 100)
+  Ok len(output) <= 1000, 'read() returns a capped slice'
+  while !sub.stdout.eof
+    let output .= sub.stdout.read(-1, 100)
+  endwhile
+  Is len(split(output, '\n')), 2000, 'read() returns the rest after the cap'
+  call sub.waitpid()
+
+  let sub = vimproc#popen2(['seq', '1', '2000'])
+  let [output, found] = sub.stdout.read_until('literal', 'never', 100)
+  Ok len(output) <= 1000 && !found, 'read_until() returns a capped slice'
+  while !sub.stdout.eof
+    let output .= sub.stdout.read_until('literal', 'never', 100)[0]
+  endwhile
+  Is len(split(output, '\n')), 2000, 'read_until() returns the rest after the cap'
+  call sub.waitpid()
+  call vimproc#batch([['vp_set_result_cap', [g:vimproc_result_cap]]])
+
+  call vimproc#system(['seq', '1', '600000'])
+  for i in range(20)
+    call vimproc#system(['true'])
+  endfor
+  Ok vimproc#stats().result.size <= 1048576, 'result buffer shrinks after a spike'
+
+  let sub = vimproc#popen2(['seq', '1', '10000'])
+  call vimproc#capture(sub.stdout, 'lines', 3)
+  let captured = vimproc#capture_read(sub.stdout, 2)
+  while !captured.eof
+    sleep 10m
+    let captured = vimproc#capture_read(sub.stdout, 2)
+  endwhile
+  Is sub.stdout.read(), '', 'read() of a captured fd returns nothing'
+  Is captured.output, "9999\n10000\n", 'capture_read() returns the tail'
+  Is vimproc#capture_read(sub.stdout).output, "9998\n9999\n10000\n", 'capture keeps the last lines'
+  Is captured.total - captured.dropped, 16, 'capture drops the rest'
+  call sub.waitpid()
+
+  let sub = vimproc#popen2(['seq', '1', '100000'])
+  call vimproc#capture(sub.stdout, 'spill', 1000)
+  let captured = vimproc#capture_read(sub.stdout, 1)
+  while !captured.eof
+    sleep 10m
+    let captured = vimproc#capture_read(sub.stdout, 1)
+  endwhile
+  Ok captured.output ==# "100000\n" && captured.dropped == 0, 'spilled capture keeps all'
+  call sub.waitpid()
+
+  for [mode, expected] in [['cooked', "foo\r\nfoo\r\n"], ['noecho', "foo\r\n"], ['raw', "foo\n"]]
+    let sub = vimproc#ptyopen(['cat'], mode)
+    call sub.write("foo\n")
+    let output = ''
+    for i in range(100)
+      let output .= sub.read(-1, 10)
+      if len(output) >= len(expected)
+        break
+      endif
+    endfor
+    Is output, expected, 'ptyopen() in ' . mode . ' mode'
+    call sub.kill(9)
+    call sub.waitpid()
+  endfor
+
+  let sub = vimproc#popen2(['printf', '\033[1;31mred\033[0m plain\033]0;title\007\033[2K\n'])
+  let [text, ops] = sub.stdout.read_ansi(-1, 1000)
+  Is text, "red plain\n", 'read_ansi() strips escape sequences'
+  IsDeeply ops, [['attr', 0, 1, -1, 1], ['attr', 3, -1, -1, 0], ['el', 9, 2, 0, 0]],
+        \ 'read_ansi() returns the ops'
+  call sub.waitpid()
+
+  let sub = vimproc#popen2(['cat'])
+  call sub.stdin.write("a\e[3")
+  let [text1, ops1] = sub.stdout.read_ansi(-1, 1000)
+  call sub.stdin.write("8;5;208mb")
+  let [text2, ops2] = sub.stdout.read_ansi(-1, 1000)
+  Ok text1 ==# 'a' && empty(ops1) && text2 ==# 'b' && ops2 ==# [['attr', 0, 208, -1, 0]],
+        \ 'read_ansi() decodes a sequence split between reads'
+  call sub.stdin.close()
+  call sub.waitpid()
+
+  let sub = vimproc#popen2(['sh', '-c', 'printf "foo\nbar> "; sleep 0.1; printf baz'])
+  IsDeeply sub.stdout.read_until('literal', '> ', 1000), ["foo\nbar> ", 1],
+        \ 'read_until() a literal'
+  Is sub.stdout.read_until('literal', 'z', 1000)[0], 'baz', 'read_until() keeps the rest'
+  call sub.waitpid()
+
+  let sub = vimproc#popen2(['cat'])
+  call sub.stdin.write("1\n>>> 2\n>>> ")
+  IsDeeply sub.stdout.read_until('regex', '^>>> $', 1000), ["1\n>>> 2\n>>> ", 1],
+        \ 'read_until() a regex'
+  call sub.stdin.write("\e]133;A\x07$ \e]133;B\e\\ls")
+  IsDeeply sub.stdout.read_until('osc133', 'B', 1000), ["\e]133;A\x07$ \e]133;B\e\\", 1],
+        \ 'read_until() an OSC 133 marker'
+  let start = reltime()
+  IsDeeply sub.stdout.read_until('literal', 'never', 100), ['ls', 0],
+        \ 'read_until() returns what is read at the deadline'
+  Ok str2float(reltimestr(reltime(start))) < 1.0, 'read_until() stops at the deadline'
+  call sub.stdin.close()
+  call sub.waitpid()
+
+  let sub = vimproc#popen2(['sh', '-c', 'seq 1 1000; printf ">"; sleep 0.1; printf ">> "'])
+  let [output, found] = sub.stdout.read_until('regex', '^>>> $', 1000)
+  Ok found && output ==# join(range(1, 1000), "\n") . "\n>>> ",
+        \ 'read_until() a regex split between reads'
+  call sub.waitpid()
+
+  let sub = vimproc#popen2(['sh', '-c', 'sleep 0.2; exec cat'])
+  let input = repeat("0123456789abcdef\n", 65536)
+  let start = reltime()
+  let nqueued = sub.stdin.write_async(input)
+  Ok nqueued > 0 && str2float(reltimestr(reltime(start))) < 0.5,
+        \ 'write_async() queues what a pipe does not take'
+  let output = ''
+  while len(output) < len(input)
+    let output .= sub.stdout.read(-1, 100)
+  endwhile
+  Ok output ==# input && sub.stdin.flush() == 0, 'write_async() writes the queue later'
+  call sub.stdin.close()
+  call sub.waitpid()
+
+  let sub = vimproc#popen2(['sh', '-c', 'sleep 0.2; exec wc -c'])
+  Ok sub.stdin.write_async(input) > 0, 'write_async() before close()'
+  call sub.stdin.close()
+  let output = ''
+  while !sub.stdout.eof
+    let output .= sub.stdout.read(-1, 100)
+  endwhile
+  Is str2nr(output), len(input), 'close() writes the queue first'
+  call sub.waitpid()
+
+  let sub = vimproc#popen2(['sh', '-c', 'sleep 0.2; exec wc -c'])
+  call sub.stdin.write_async(input)
+  Is sub.stdin.write('tail', 10), 4, 'write() queues behind a queue not written'
+  Ok sub.stdin.flush(5000) == 0, 'flush() writes the queue and write()'
+  let fdinfo = '/proc/' . getpid() . '/fdinfo/' . sub.stdin.fd
+  if filereadable(fdinfo)
+    let flags = str2nr(matchstr(readfile(fdinfo)[1], '\d\+'), 8)
+    Ok and(flags, 0x800) == 0, 'fd blocks again after the queue is written'
+  endif
+  call sub.stdin.close()
+  let output = ''
+  while !sub.stdout.eof
+    let output .= sub.stdout.read(-1, 100)
+  endwhile
+  Is str2nr(output), len(input) + 4, 'write() after write_async() is not dropped'
+  call sub.waitpid()
+
+  " The drain thread reads a child while Vim does not.  Output larger than
+  " the ring stops the thread until Vim reads.
+  call vimproc#batch([['vp_drain_start', [65536]]])
+  let sub = vimproc#popen2(['seq', '1', '200000'])
+  let results = vimproc#batch([['vp_drain_register', [sub.stdout.fd]]])
+  Is results[0][0], '', 'drain thread takes fd'
+  sleep 200m
+  let output = ''
+  while !sub.stdout.eof
+    let output .= sub.stdout.read(-1, 100)
+  endwhile
+  Is output, join(range(1, 200000), "\n") . "\n", 'read from drain thread to eof'
+  IsDeeply sub.waitpid(), ['exit', 0], 'waitpid() after drain thread'
+  if !g:vimproc_drain_thread
+    call vimproc#batch([['vp_drain_stop', []]])
+  endif
+endfunction
+
+call s:run()
+Done
+
+
+" Restore 'cpoptions' {{{
+let &cpo = s:save_cpo
+" }}}